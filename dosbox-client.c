@@ -6,6 +6,94 @@
  *   Guest executes script via MBXJOB.BAT, redirects stdout to OUT.NEW,
  *   then renames OUT.NEW -> OUT.TXT (and RC.NEW -> RC.TXT).
  *
+ * Queued mode (pipelined):
+ *   Host writes numbered jobs CMD.001 ... CMD.999 (wrapping) while earlier
+ *   ones run. Guest claims CMD.nnn -> RUN.nnn in order and publishes
+ *   RC.nnn then OUT.nnn. The host removes the replies once read.
+ *
+ * Workers (MBX_WORKER=1..9):
+ *   Several MBXSRVs can serve one folder, e.g. under DESQview or in
+ *   Windows 3.x DOS boxes. Worker n claims into CMDn.RUN / RUNn.nnn and
+ *   uses its own MBXJOBn.BAT, OUTn.NEW, RCn.NEW, LOGn.TXT and STAn.TXT, so
+ *   queued jobs run in parallel and finish in any order. On restart a
+ *   worker recovers only its own claims.
+ *
+ * Session mode (MBX_SESSION=1):
+ *   Current drive/directory and SET variables carry over between jobs.
+ *   RESET on the first line returns the session to its startup state.
+ *
+ * File transfer (first line is the verb; chunks are XFR.001, XFR.002, ...):
+ *   STAT <path>                      -> "STAT <size|-1> <crc32> <partial>"
+ *   PUT <size> <crc32> <from> <path> + lines "<seq> <len> <crc32>": append
+ *       chunk files to <path with .$$$ ext> from byte <from>, checking each
+ *       CRC, then check the whole file and rename it into place. Replies
+ *       "OK <seq>" per chunk, then "DONE", or "BAD <seq> <offset>" (rc 2),
+ *       "BADFILE" (rc 3) or "RESTART" (rc 4) when the host must resend.
+ *   GET <chunk> <from> <have_size> <have_crc32> <path>: "SAME" if the host
+ *       copy matches, else XFR.nnn chunks from <from> listed as "CHUNK <seq>
+ *       <len> <crc32>", then "FILE <size> <crc32>" (or "MORE <offset>").
+ *
+ * Directives:
+ *   Leading lines of the form ":MBX <KEY> [value]" set per-job options and
+ *   are not copied into the job. (They are batch labels, so an older MBXSRV
+ *   ignores them.) Keys:
+ *     BATCH   after each command line, echo "@MBX@ <n> <errorlevel>" so the
+ *             host can split the output into per-command replies
+ *     CHAIN n split the job into MBXJ001.BAT, MBXJ002.BAT, ... of about n KB
+ *             each, CALLed in turn from MBXJOB.BAT (default MBX_CHAIN_KB, 0 =
+ *             one file). GOTO cannot cross a part boundary.
+ *     PACK [n] compress the output with LZSS if it is at least n bytes
+ *             (default 4096) and that makes it smaller; the OUT file then
+ *             starts with ESC "MBXLZ1" and the RC's TIM line has packed=
+ *     ID tag  echo "ID <tag>" as the first line of the job's RC file, so the
+ *             host can tell its reply from an earlier one by content alone
+ *             (RC is published after OUT, so it vouches for both)
+ *     TIMEOUT s  stop the job if it runs longer than s seconds (default
+ *             MBX_JOB_TIMEOUT, 0 = no limit); see Watchdog below
+ *     RES     reply to a CMD.TXT job with one RES.TXT instead of OUT.TXT and
+ *             RC.TXT: the RC text (ID, rc and TIM lines), "LEN <bytes>", an
+ *             empty line, then the output. One rename publishes it all.
+ *             MBX_RES=0 ignores the directive; control commands (EXIT,
+ *             RESET) and queued or serial jobs always reply the classic way.
+ *
+ * Jobs have no size limit: the body is streamed into MBXJOB.BAT in JOB_BUF
+ * blocks, and lines longer than the buffer pass through in pieces.
+ *
+ * Serial transport (MBX_COM=1 or 2):
+ *   Jobs can also arrive on COM1/COM2, e.g. a DOSBox-X "nullmodem" port the
+ *   host reaches over TCP. Frames are "<KIND> <len>\n" plus len bytes: the
+ *   host sends CMD (the CMD.TXT text) or PING; we answer PONG, or OUT and RC
+ *   (the OUT.TXT/RC.TXT text). Serial jobs run through SER.RUN/SER.OUT/SER.RC.
+ *   While idle we watch the UART every ms instead of sleeping a whole tick.
+ *
+ * Polling:
+ *   The idle poll interval starts at MBX_POLL_MIN ms (default 10) after each
+ *   job and grows by MBX_POLL_DECAY percent per idle tick (default 150) up to
+ *   the long idle interval: argv[1] or MBX_POLL_MAX ms (default 500).
+ *
+ * Logging and status:
+ *   MBX_LOG_BUF=1 buffers LOG.TXT lines and writes them when the buffer
+ *   fills or the server goes idle; MBX_LOG_MAX_KB=n rotates LOG.TXT to
+ *   LOG.OLD at about n KB. MBX_NOSTATUS=1 leaves STA.TXT at READY while
+ *   jobs run (only startup and BYE are written). Otherwise STA.TXT reads
+ *   "<STATE> beat=<n> every=<ms> job=<file>" and is rewritten every
+ *   MBX_BEAT ms (default 2000; 0 = plain state, no heartbeat) while idle.
+ *
+ * Timings:
+ *   RC files get a second line "TIM claim= build= exec= publish= payload=
+ *   out= packed= res=" with per-phase times in ms, payload/output sizes in bytes and
+ *   the timer resolution in ms (1 with DJGPP's uclock, else ~55 BIOS ticks).
+ *
+ * Watchdog:
+ *   While a job runs, the timer tick stops it once it is over its TIMEOUT,
+ *   or when CANCEL.TXT holds its ID tag (or "*"). The job then gets RC 124
+ *   (timed out) or 130 (cancelled), with a note at the end of OUT, and
+ *   MBXSRV returns to READY. MBX_WATCHDOG=0 leaves the timer alone.
+ *
+ * Templates:
+ *   "RUN <name> [args]" runs TPL\<name>.BAT (up to 8 arguments), which the
+ *   host stores once; no job file is built for it outside session mode.
+ *
  * Stop command:
  *   Put EXIT or QUIT on the first non-empty line (or as first command line).
  *
@@ -22,6 +110,21 @@
 #include <io.h>
 #include <errno.h>
 #include <conio.h>
+#include <sys/stat.h>
+#include <signal.h>
+#ifdef __DJGPP__
+#include <time.h>
+#include <pc.h>
+#include <crt0.h>
+#include <dpmi.h>
+#include <go32.h>
+#include <sys/farptr.h>
+#else
+#include <bios.h>
+#endif
+#ifdef __WATCOMC__
+#include <direct.h>
+#endif
 
 #define CMD_TXT   "CMD.TXT"
 #define CMD_RUN   "CMD.RUN"
@@ -29,16 +132,194 @@
 #define OUT_NEW   "OUT.NEW"
 #define RC_TXT    "RC.TXT"
 #define RC_NEW    "RC.NEW"
+#define RES_TXT   "RES.TXT"   /* combined reply (:MBX RES) */
+#define RES_NEW   "RES.NEW"
 #define STA_TXT   "STA.TXT"
 #define LOG_TXT   "LOG.TXT"
+#define LOG_OLD   "LOG.OLD"   /* previous log after rotation */
 #define JOB_BAT   "MBXJOB.BAT"
+#define JOB_PART  "MBXJ%03d.BAT"  /* chained parts */
+#define JOB_PARTS "MBXJ???.BAT"
+#define JOB_PART_MAX 999
+#define TPL_DIR   "TPL"          /* templates: TPL\<name>.BAT */
+#define TPL_BAT   "MBXTPL.BAT"   /* fixed wrapper that CALLs one */
+#define SES_CWD   "SES.CWD"
+#define CANCEL_TXT "CANCEL.TXT" /* "<tag>" or "*": stop the running job */
+#define SES_ENV   "SES.ENV"
+
+/* File transfer */
+#define XFR_BUF   4096
+#define XFR_MAX   999      /* chunk files XFR.001 .. XFR.999 per job */
+
+/* Serial transport */
+#define SER_RUN   "SER.RUN"
+#define SER_OUT   "SER.OUT"
+#define SER_RC    "SER.RC"
+#define COM_BYTE_MS 2000   /* drop a frame after this long without a byte */
+
+/* Output compression (:MBX PACK) */
+#define OUT_LZ    "OUT.LZ"
+#define LZ_MAGIC  "\033MBXLZ1\n"  /* then plain size and CRC32, LE */
+#define LZ_HEAD   16
+#define LZ_WIN    4096     /* match distance 1..4096 */
+#define LZ_MIN    3
+#define LZ_MAX    (LZ_MIN + 15 + 255)
+#define LZ_HASH   2048
+#define LZ_PROBES 16       /* chain steps per position */
+#define PACK_MIN  4096     /* default: smaller outputs go plain */
+
+/* Queued mode: CMD.nnn -> RUN.nnn -> OUT.nnn / RC.nnn */
+#define QUEUE_MAX     999
+#define QUEUE_PATTERN "CMD.???"
+#define QRUN_PATTERN  "RUN.???"
+
+/* Per-job directives */
+#define DIRECTIVE     ":MBX "
+#define BATCH_MARK    "@MBX@ "
+
+/* Adaptive polling defaults (ms, percent) */
+#define POLL_MIN_MS     10
+#define POLL_MAX_MS     500
+#define POLL_DECAY_PCT  150
 
 /* Limits */
 #define MAX_LINE      512
-#define MAX_PAYLOAD   (32 * 1024) /* max bytes copied from CMD into JOB_BAT */
+#define JOB_BUF       8192        /* job copy block; longer lines go in pieces */
+#define LOG_BUF       2048        /* buffered log lines (MBX_LOG_BUF=1) */
 
 static void ms_sleep(unsigned ms) { delay(ms); }
 
+/* Phase timer. DJGPP's uclock() reads the PIT (~1 us); elsewhere we count
+   BIOS ticks since midnight (18.2 Hz). */
+#ifdef __DJGPP__
+#define TIMER_RES_MS 1
+static unsigned long timer_now(void)
+{
+    return (unsigned long)(uclock() / (UCLOCKS_PER_SEC / 1000));
+}
+
+static unsigned long timer_ms(unsigned long from, unsigned long to)
+{
+    return to - from;
+}
+#else
+#define TIMER_RES_MS 55
+static unsigned long timer_now(void)
+{
+    long ticks = 0;
+    _bios_timeofday(_TIME_GETCLOCK, &ticks);
+    return (unsigned long)ticks;
+}
+
+static unsigned long timer_ms(unsigned long from, unsigned long to)
+{
+    if (to < from) to += 0x1800B0UL; /* ticks per day; wrapped at midnight */
+    return (to - from) * 2197UL / 40UL; /* 54.925 ms per tick */
+}
+#endif
+
+/* Timings of the job in progress, written into its RC file */
+struct job_timing {
+    unsigned long mark;   /* end of the previous phase */
+    unsigned long claim, build, exec, publish;
+    long payload, out;    /* bytes */
+    long packed;          /* bytes of OUT after :MBX PACK, 0 = plain */
+};
+
+static struct job_timing g_tim;
+static int g_res_ok = 1;    /* MBX_RES=0: ignore :MBX RES */
+static int g_job_res;       /* the job in progress asked for a combined reply */
+static char g_req_id[16];   /* :MBX ID of the job in progress */
+static long g_job_timeout;  /* its :MBX TIMEOUT in seconds, 0 = none */
+
+static void timing_start(void)
+{
+    memset(&g_tim, 0, sizeof(g_tim));
+    g_tim.mark = timer_now();
+}
+
+/* Close the current phase into *phase and start the next one */
+static void timing_lap(unsigned long *phase)
+{
+    unsigned long now = timer_now();
+    *phase = timer_ms(g_tim.mark, now);
+    g_tim.mark = now;
+}
+
+/* Integer env option within [lo, hi], or def when unset/out of range */
+static long env_long(const char *name, long def, long lo, long hi)
+{
+    const char *v = getenv(name);
+    long x;
+    if (!v || !v[0]) return def;
+    x = atol(v);
+    return (x >= lo && x <= hi) ? x : def;
+}
+
+/* Worker identity. With MBX_WORKER=1..9 several MBXSRVs (e.g. DESQview or
+   Windows 3.x DOS boxes) share one folder: each claims jobs under its own
+   names (CMD1.RUN, RUN1.nnn) and keeps its own scratch files, log and
+   status, i.e. "<stem><id>.<ext>". Without it the names are the classic ones. */
+static char g_wid[2] = "";
+static char g_cmd_run[13] = CMD_RUN;
+static char g_out_new[13] = OUT_NEW;
+static char g_rc_new[13] = RC_NEW;
+static char g_res_new[13] = RES_NEW;
+static char g_sta_new[13] = "STA.NEW";
+static char g_sta_txt[13] = STA_TXT;
+static char g_log_txt[13] = LOG_TXT;
+static char g_log_old[13] = LOG_OLD;
+static char g_job_bat[13] = JOB_BAT;
+static char g_tpl_bat[13] = TPL_BAT;
+static char g_job_part[16] = JOB_PART;
+static char g_job_parts[13] = JOB_PARTS;
+static char g_ses_cwd[13] = SES_CWD;
+static char g_ses_env[13] = SES_ENV;
+static char g_ser_run[13] = SER_RUN;
+static char g_ser_out[13] = SER_OUT;
+static char g_ser_rc[13] = SER_RC;
+static char g_out_lz[13] = OUT_LZ;
+static char g_qrun_pattern[13] = QRUN_PATTERN;
+
+/* NAME.EXT -> NAME<id>.EXT */
+static void worker_name(char *buf, const char *name)
+{
+    const char *dot = strchr(name, '.');
+    size_t stem = dot ? (size_t)(dot - name) : strlen(name);
+
+    memcpy(buf, name, stem);
+    strcpy(buf + stem, g_wid);
+    strcat(buf, name + stem);
+}
+
+static void worker_init(void)
+{
+    const char *opt = getenv("MBX_WORKER");
+
+    if (!opt || opt[0] < '1' || opt[0] > '9' || opt[1]) return;
+    g_wid[0] = opt[0];
+    worker_name(g_cmd_run, CMD_RUN);
+    worker_name(g_out_new, OUT_NEW);
+    worker_name(g_rc_new, RC_NEW);
+    worker_name(g_res_new, RES_NEW);
+    worker_name(g_sta_new, "STA.NEW");
+    worker_name(g_sta_txt, STA_TXT);
+    worker_name(g_log_txt, LOG_TXT);
+    worker_name(g_log_old, LOG_OLD);
+    worker_name(g_job_bat, JOB_BAT);
+    worker_name(g_tpl_bat, TPL_BAT);
+    worker_name(g_ses_cwd, SES_CWD);
+    worker_name(g_ses_env, SES_ENV);
+    worker_name(g_ser_run, SER_RUN);
+    worker_name(g_ser_out, SER_OUT);
+    worker_name(g_ser_rc, SER_RC);
+    worker_name(g_out_lz, OUT_LZ);
+    worker_name(g_qrun_pattern, QRUN_PATTERN);
+    /* Parts keep 8.3 names: MBX1001.BAT rather than MBXJ001.BAT */
+    sprintf(g_job_part, "MBX%c%%03d.BAT", g_wid[0]);
+    sprintf(g_job_parts, "MBX%c???.BAT", g_wid[0]);
+}
+
 static void timestamp(char *buf, size_t cap)
 {
     struct dosdate_t d;
@@ -51,14 +332,70 @@ static void timestamp(char *buf, size_t cap)
             d.year, d.month, d.day, t.hour, t.minute, t.second);
 }
 
+/* Logging. By default every line is appended straight to LOG.TXT. With
+   MBX_LOG_BUF=1 lines collect in g_log_buf and go out in one write when the
+   buffer fills, when we go idle, and on exit. MBX_LOG_MAX_KB rotates
+   LOG.TXT to LOG.OLD once it would grow past that size. */
+static char g_log_buf[LOG_BUF];
+static unsigned g_log_len = 0;
+static int  g_log_buffered = 0;
+static long g_log_max = 0;     /* bytes; 0 = no rotation */
+static long g_log_size = -1;   /* size of LOG.TXT, -1 until known */
+
+static void log_open(void)
+{
+    const char *opt = getenv("MBX_LOG_BUF");
+    struct stat st;
+
+    g_log_buffered = (opt && opt[0] == '1');
+    g_log_max = env_long("MBX_LOG_MAX_KB", 0, 0, 32767) * 1024L;
+    g_log_size = (stat(g_log_txt, &st) == 0) ? (long)st.st_size : 0L;
+}
+
+/* Write out `len` bytes, rotating first if LOG.TXT would pass the cap */
+static void log_write(const char *text, unsigned len)
+{
+    FILE *f;
+
+    if (g_log_max > 0 && g_log_size > 0 && g_log_size + (long)len > g_log_max) {
+        remove(g_log_old);
+        rename(g_log_txt, g_log_old);
+        g_log_size = 0;
+    }
+    f = fopen(g_log_txt, "ab");
+    if (!f) return;
+    fwrite(text, 1, len, f);
+    fclose(f);
+    if (g_log_size >= 0) g_log_size += len;
+}
+
+static void log_flush(void)
+{
+    if (g_log_len == 0) return;
+    log_write(g_log_buf, g_log_len);
+    g_log_len = 0;
+}
+
 static void log_line(const char *msg)
 {
-    FILE *f = fopen(LOG_TXT, "at");
+    char line[320];
     char ts[32];
-    if (!f) return;
+    size_t mlen = strlen(msg);
+    unsigned n;
+
+    if (mlen > sizeof(line) - 40) mlen = sizeof(line) - 40;
     timestamp(ts, sizeof(ts));
-    fprintf(f, "[%s] %s\r\n", ts, msg);
-    fclose(f);
+    sprintf(line, "[%s] ", ts);
+    n = (unsigned)strlen(line);
+    memcpy(line + n, msg, mlen);
+    n += (unsigned)mlen;
+    line[n++] = '\r';
+    line[n++] = '\n';
+
+    if (!g_log_buffered) { log_write(line, n); return; }
+    if (g_log_len + n > sizeof(g_log_buf)) log_flush();
+    memcpy(g_log_buf + g_log_len, line, n);
+    g_log_len += n;
 }
 
 /* printf-like into log (small, safe enough for our use) */
@@ -108,31 +445,119 @@ static int write_text_atomic(const char *temp, const char *final, const char *te
     return 1;
 }
 
-static void set_status(const char *state)
+/* MBX_NOSTATUS=1: STA.TXT is written at startup and exit only, not
+   RUNNING/READY around every job */
+static int g_status_quiet = 0;
+
+/* Heartbeat: while idle STA.TXT is rewritten every g_beat_ms (MBX_BEAT,
+   default 2000, 0 = off) with a rising counter, so the host can tell a
+   live idle server from a dead one by the file's age. The line reads
+   "<STATE> beat=<n> every=<ms> job=<claimed file or ->". */
+static long g_beat_ms = 0;
+static unsigned long g_beat = 0;
+static unsigned long g_beat_at = 0;  /* timer_now() of the last write */
+static char g_state[8] = "READY";
+static char g_job_id[16] = "-";
+
+static void write_status(void)
 {
+    char text[80];
+
+    if (g_beat_ms > 0)
+        sprintf(text, "%s beat=%lu every=%ld job=%s", g_state, ++g_beat, g_beat_ms,
+                strcmp(g_state, "RUNNING") == 0 ? g_job_id : "-");
+    else
+        strcpy(text, g_state);
+    g_beat_at = timer_now();
     /* Keep STA.TXT tiny and always replace */
-    if (!write_text_atomic("STA.NEW", STA_TXT, state)) {
+    if (!write_text_atomic(g_sta_new, g_sta_txt, text)) {
         /* If status write fails, at least log it */
         log_line("WARN: failed to write STA.TXT");
     }
 }
 
-/* Claim CMD.TXT by renaming to CMD.RUN with retries.
-   Returns 1 if claimed, 0 otherwise. */
+static void set_status(const char *state)
+{
+    strcpy(g_state, state);
+    if (g_status_quiet && (strcmp(state, "RUNNING") == 0 || strcmp(state, "READY") == 0)) {
+        static int started = 0;
+        if (started) return;
+        started = 1;
+    }
+    write_status();
+}
+
+/* Called from the idle loop; cheap unless a beat is due */
+static void heartbeat(void)
+{
+    if (g_beat_ms > 0 && (long)timer_ms(g_beat_at, timer_now()) >= g_beat_ms) write_status();
+}
+
+/* Claim CMD.TXT by renaming to CMD.RUN (CMDn.RUN for worker n) with
+   retries. Only one worker's rename can win. Returns 1 if claimed. */
 static int claim_cmd(void)
 {
     int tries;
-    remove(CMD_RUN); /* stale from crash */
 
     for (tries = 0; tries < 20; tries++) {
         if (!file_exists(CMD_TXT)) return 0;
-        if (rename(CMD_TXT, CMD_RUN) == 0) return 1;
+        if (rename(CMD_TXT, g_cmd_run) == 0) return 1;
         ms_sleep(50);
     }
     return 0;
 }
 
-/* Read first non-empty line from CMD.RUN into buf. Returns 1 on success. */
+static int is_directive(const char *line)
+{
+    return strnicmp(line, DIRECTIVE, sizeof(DIRECTIVE) - 1) == 0;
+}
+
+/* Options a job asks for through its :MBX directive lines */
+struct job_opts {
+    int batch;   /* emit per-command markers */
+    long chain;  /* bytes per chained part file; 0 = one MBXJOB.BAT */
+    long pack;   /* compress output of at least this many bytes; -1 = never */
+    char id[16]; /* request tag to echo in the RC file, "" = none */
+    int res;     /* reply with one RES.TXT */
+    long timeout;/* seconds the job may run, 0 = no limit */
+};
+
+/* Parse the leading :MBX lines of a CMD file. Unknown keys are ignored so
+   newer hosts can talk to older servers. */
+static void read_job_opts(const char *path, struct job_opts *o)
+{
+    FILE *f = fopen(path, "rt");
+    char line[MAX_LINE];
+    char *key;
+
+    memset(o, 0, sizeof(*o));
+    o->chain = env_long("MBX_CHAIN_KB", 0, 0, 16384) * 1024L;
+    o->pack = -1;
+    o->timeout = env_long("MBX_JOB_TIMEOUT", 0, 0, 86400L);
+    if (!f) return;
+
+    while (fgets(line, sizeof(line), f)) {
+        trim(line);
+        if (line[0] == 0) continue;
+        if (!is_directive(line)) break;
+        key = line + sizeof(DIRECTIVE) - 1;
+        while (*key == ' ') key++;
+        if (stricmp(key, "BATCH") == 0) o->batch = 1;
+        else if (strnicmp(key, "CHAIN ", 6) == 0) o->chain = atol(key + 6) * 1024L;
+        else if (stricmp(key, "PACK") == 0) o->pack = PACK_MIN;
+        else if (strnicmp(key, "PACK ", 5) == 0) o->pack = atol(key + 5);
+        else if (stricmp(key, "RES") == 0) o->res = g_res_ok;
+        else if (strnicmp(key, "TIMEOUT ", 8) == 0) o->timeout = atol(key + 8);
+        else if (strnicmp(key, "ID ", 3) == 0) {
+            strncpy(o->id, key + 3, sizeof(o->id) - 1);
+            trim(o->id);
+        }
+    }
+    fclose(f);
+}
+
+/* Read first non-empty, non-directive line from CMD.RUN into buf.
+   Returns 1 on success. */
 static int read_first_nonempty_line(const char *path, char *buf, size_t bufsz)
 {
     FILE *f = fopen(path, "rt");
@@ -142,248 +567,1982 @@ static int read_first_nonempty_line(const char *path, char *buf, size_t bufsz)
         size_t n = strlen(buf);
         while (n > 0 && (buf[n-1] == '\r' || buf[n-1] == '\n')) { buf[n-1]=0; n--; }
         trim(buf);
-        if (buf[0] != 0) { fclose(f); return 1; }
+        if (buf[0] != 0 && !is_directive(buf)) { fclose(f); return 1; }
     }
 
     fclose(f);
     return 0;
 }
 
-/* Copy CMD.RUN into JOB_BAT as a script, with wrapper + RC capture.
-   Returns 1 on success, 0 on failure. */
-static int build_job_bat_from_cmd(const char *cmd_path, int *out_payload_bytes)
+/* ---- Session mode ----
+   Jobs share one shell context. COMMAND.COM still starts per job, but the
+   wrapper re-enters the saved drive/directory first and dumps CD and SET
+   back into SES.CWD / SES.ENV at the end; we adopt both, so the next child
+   inherits them. Jobs made only of CD, drive changes and SET NAME=VALUE
+   are applied here without starting a shell at all. */
+
+static int  g_session = 0;
+static char g_home[80];       /* MBXSRV's own directory, e.g. Z:\MBX */
+static char g_cwd[80];        /* session directory, with drive */
+static char *g_env0 = NULL;   /* startup environment: NAME=VALUE\0...\0 */
+
+static void current_dir(char *buf, size_t cap)
 {
-    FILE *in, *out;
-    char line[MAX_LINE];
-    int total = 0;
+    char *p;
+    if (!getcwd(buf, cap)) { buf[0] = 0; return; }
+    if (buf[0] && buf[1] == ':') {
+        for (p = buf; *p; p++) if (*p == '/') *p = '\\'; /* DJGPP reports c:/x */
+    }
+}
 
-    remove(JOB_BAT);
-    remove(RC_NEW);
+/* Make a drive-qualified directory current. Returns 1 on success. */
+static int enter_dir(const char *path)
+{
+    unsigned ndrives;
+    if (path[0] && path[1] == ':')
+        _dos_setdrive((unsigned)(toupper((unsigned char)path[0]) - 'A' + 1), &ndrives);
+    return chdir(path) == 0;
+}
 
-    in = fopen(cmd_path, "rt");
-    if (!in) return 0;
+static void home_path(char *buf, const char *name)
+{
+    size_t n = strlen(g_home);
+    strcpy(buf, g_home);
+    if (n > 0 && buf[n - 1] != '\\') strcat(buf, "\\");
+    strcat(buf, name);
+}
 
-    out = fopen(JOB_BAT, "wt");
-    if (!out) { fclose(in); return 0; }
+/* Set, or with value "" remove, a variable in our environment */
+static void env_set(const char *name, const char *value)
+{
+#if defined(__WATCOMC__)
+    setenv(name, value[0] ? value : NULL, 1);
+#elif defined(__DJGPP__)
+    if (value[0]) setenv(name, value, 1); else unsetenv(name);
+#else
+    char *s = (char *)malloc(strlen(name) + strlen(value) + 2);
+    if (!s) return;
+    sprintf(s, "%s=%s", name, value);
+    putenv(s); /* the runtime keeps this string */
+#endif
+}
 
-    /* Wrapper */
-    fputs("@echo off\r\n", out);
-    fputs("rem MBXSRV job wrapper\r\n", out);
+/* Copy our environment into a NAME=VALUE\0...\0 block */
+static char *env_snapshot(void)
+{
+    char **e;
+    char *b, *p;
+    size_t n = 1;
 
-    /* Copy payload, line by line, enforcing MAX_PAYLOAD */
-    while (fgets(line, sizeof(line), in)) {
-        int len = (int)strlen(line);
-        if (total + len > MAX_PAYLOAD) {
-            fputs("rem ERROR: payload too large\r\n", out);
-            /* Force errorlevel-ish */
-            fputs("echo 1 > " RC_NEW "\r\n", out);
-            fclose(in);
-            fclose(out);
-            if (out_payload_bytes) *out_payload_bytes = total;
-            return 0;
-        }
-        fputs(line, out);
-        total += len;
+    for (e = environ; *e; e++) n += strlen(*e) + 1;
+    b = (char *)malloc(n);
+    if (!b) return NULL;
+    for (p = b, e = environ; *e; e++) { strcpy(p, *e); p += strlen(p) + 1; }
+    *p = 0;
+    return b;
+}
+
+static const char *env_block_get(const char *block, const char *name)
+{
+    size_t n = strlen(name);
+    for (; *block; block += strlen(block) + 1) {
+        if (strncmp(block, name, n) == 0 && block[n] == '=') return block + n + 1;
     }
+    return NULL;
+}
 
-    /* Always write return code file for host */
-    fputs("\r\nrem Capture ERRORLEVEL of last command\r\n", out);
-    fputs("echo %errorlevel% > " RC_NEW "\r\n", out);
+/* Make our environment match a NAME=VALUE\0...\0 block */
+static void env_sync(const char *block)
+{
+    char name[64];
+    const char *p, *eq, *cur;
+    char **e;
+    char *dead, *d;
+    size_t n = 1;
 
-    fclose(in);
-    fclose(out);
+    /* Collect names the block doesn't have before removing any, since
+       removal reshuffles environ */
+    for (e = environ; *e; e++) n += strlen(*e) + 1;
+    dead = (char *)malloc(n);
+    if (dead) {
+        d = dead;
+        for (e = environ; *e; e++) {
+            eq = strchr(*e, '=');
+            if (!eq || eq == *e || (size_t)(eq - *e) >= sizeof(name)) continue;
+            memcpy(name, *e, (size_t)(eq - *e));
+            name[eq - *e] = 0;
+            if (!env_block_get(block, name)) { strcpy(d, name); d += strlen(d) + 1; }
+        }
+        *d = 0;
+        for (d = dead; *d; d += strlen(d) + 1) env_set(d, "");
+        free(dead);
+    }
 
-    if (out_payload_bytes) *out_payload_bytes = total;
-    return 1;
+    for (p = block; *p; p += strlen(p) + 1) {
+        eq = strchr(p, '=');
+        if (!eq || eq == p || (size_t)(eq - p) >= sizeof(name)) continue;
+        memcpy(name, p, (size_t)(eq - p));
+        name[eq - p] = 0;
+        cur = getenv(name);
+        if (!cur || strcmp(cur, eq + 1) != 0) env_set(name, eq + 1);
+    }
 }
 
-/* Execute JOB_BAT, redirecting stdout to OUT_NEW.
-   Optional stderr capture if env MBX_STDERR=1 (works on FreeDOS/4DOS; not classic MS-DOS).
-   Returns system() result. */
-static int exec_job_to_out(void)
+/* Load SET output (one NAME=VALUE per line) as an environment block */
+static char *read_env_file(const char *path)
 {
-    const char *comspec = getenv("COMSPEC");
-    const char *stderr_opt = getenv("MBX_STDERR"); /* set to "1" if your shell supports 2>&1 */
-    char cmd[256];
+    FILE *f = fopen(path, "rt");
+    char line[MAX_LINE];
+    char *b, *p;
+    long size;
 
-    if (!comspec || !comspec[0]) comspec = "COMMAND.COM";
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    b = (size >= 0) ? (char *)malloc((size_t)size + 2) : NULL;
+    if (!b) { fclose(f); return NULL; }
 
-    remove(OUT_NEW);
+    p = b;
+    while (fgets(line, sizeof(line), f)) {
+        size_t n = strlen(line);
+        while (n > 0 && (line[n-1] == '\r' || line[n-1] == '\n')) line[--n] = 0;
+        if (n == 0 || !strchr(line, '=')) continue;
+        strcpy(p, line);
+        p += n + 1;
+    }
+    *p = 0;
+    fclose(f);
+    return b;
+}
 
-    /* Build: <COMSPEC> /C MBXJOB.BAT > OUT.NEW [2>&1] */
-    /* Keep it short for DOS command length limits. */
-    strcpy(cmd, comspec);
-    strcat(cmd, " /C ");
-    strcat(cmd, JOB_BAT);
-    strcat(cmd, " > ");
-    strcat(cmd, OUT_NEW);
+static void session_start(void)
+{
+    current_dir(g_home, sizeof(g_home));
+    strcpy(g_cwd, g_home);
+    g_env0 = env_snapshot();
+}
 
-    if (stderr_opt && stderr_opt[0] == '1') {
-        strcat(cmd, " 2>&1");
-    }
+static void session_reset(void)
+{
+    strcpy(g_cwd, g_home);
+    if (g_env0) env_sync(g_env0);
+}
 
-    return system(cmd);
+/* Wrapper lines that put the job in the session directory */
+static void session_prologue(FILE *out)
+{
+    if (g_cwd[0] && g_cwd[1] == ':') fprintf(out, "%c:\r\n", g_cwd[0]);
+    fprintf(out, "cd %s\r\n", g_cwd);
 }
 
-static void publish_results(int sys_rc)
+/* Wrapper lines that dump the job's final directory and environment */
+static void session_epilogue(FILE *out)
 {
-    char msg[160];
+    char p[96];
+    home_path(p, g_ses_cwd);
+    fprintf(out, "cd > %s\r\n", p);
+    home_path(p, g_ses_env);
+    fprintf(out, "set > %s\r\n", p);
+}
 
-    /* Ensure OUT_NEW exists; if not, create an error output */
-    if (!file_exists(OUT_NEW)) {
-        FILE *f = fopen(OUT_NEW, "wt");
-        if (f) {
-            fprintf(f, "ERROR: OUT.NEW missing (system rc=%d)\r\n", sys_rc);
-            fclose(f);
-        }
-    }
+/* After a job: get back home and adopt the state the job left behind */
+static void session_capture(void)
+{
+    char buf[80];
+    char *env;
+    FILE *f;
 
-    /* Publish OUT */
-    remove(OUT_TXT);
-    if (rename(OUT_NEW, OUT_TXT) != 0) {
-        /* If rename fails, try to at least log it */
-        sprintf(msg, "ERROR: failed to rename OUT.NEW -> OUT.TXT (errno=%d)", errno);
-        log_line(msg);
-    }
+    enter_dir(g_home);
 
-    /* Publish RC if present */
-    if (file_exists(RC_NEW)) {
-        remove(RC_TXT);
-        if (rename(RC_NEW, RC_TXT) != 0) {
-            sprintf(msg, "ERROR: failed to rename RC.NEW -> RC.TXT (errno=%d)", errno);
-            log_line(msg);
+    f = fopen(g_ses_cwd, "rt");
+    if (f) {
+        if (fgets(buf, sizeof(buf), f)) {
+            trim(buf);
+            if (buf[0]) strcpy(g_cwd, buf);
         }
-    } else {
-        /* Create RC.TXT to signal something happened */
-        FILE *f = fopen(RC_TXT, "wt");
-        if (f) { fputs("1\r\n", f); fclose(f); }
+        fclose(f);
     }
+
+    env = read_env_file(g_ses_env);
+    if (env) { env_sync(env); free(env); }
+
+    remove(g_ses_cwd);
+    remove(g_ses_env);
 }
 
-/* Write a clear error message into OUT.TXT (atomic-ish) */
-static void write_error_output(const char *what)
+enum { SB_NONE, SB_SKIP, SB_CD, SB_DRIVE, SB_SET };
+
+/* Classify a job line the session can apply without a shell.
+   On SB_CD/SB_DRIVE/SB_SET, *arg points at the operand inside line. */
+static int session_builtin(char *line, char **arg)
 {
-    FILE *f;
+    char *l;
+    size_t n;
 
-    remove(OUT_NEW);
-    f = fopen(OUT_NEW, "wt");
-    if (!f) return;
+    trim(line);
+    l = line;
+    if (*l == '@') l++;
+    n = strlen(l);
+    *arg = l + n;
 
-    fprintf(f, "ERROR: %s\r\n", what);
-    fprintf(f, "errno=%d\r\n", errno);
-    fclose(f);
+    if (n == 0 || stricmp(l, "echo off") == 0 || is_directive(l)) return SB_SKIP;
+    if (strnicmp(l, "rem", 3) == 0 && (l[3] == 0 || isspace((unsigned char)l[3]))) return SB_SKIP;
 
-    remove(OUT_TXT);
-    rename(OUT_NEW, OUT_TXT);
+    if (n == 2 && isalpha((unsigned char)l[0]) && l[1] == ':') { *arg = l; return SB_DRIVE; }
 
-    /* Also ensure RC is non-zero */
-    remove(RC_NEW);
-    f = fopen(RC_NEW, "wt");
-    if (f) { fputs("1\r\n", f); fclose(f); }
-    remove(RC_TXT);
-    rename(RC_NEW, RC_TXT);
-}
+    if (strnicmp(l, "chdir", 5) == 0 && (l[5] == 0 || strchr(" \\.", l[5]))) {
+        *arg = l + 5;
+    } else if (strnicmp(l, "cd", 2) == 0 && (l[2] == 0 || strchr(" \\.", l[2]))) {
+        *arg = l + 2;
+    } else if (strnicmp(l, "set ", 4) == 0 && strchr(l + 4, '=') && l[4] != '=') {
+        *arg = l + 4;
+        while (**arg == ' ') (*arg)++;
+        return (**arg != '=') ? SB_SET : SB_NONE;
+    } else {
+        return SB_NONE;
+    }
 
-static int is_exit_cmd(const char *s)
-{
-    return (stricmp(s, "EXIT") == 0 || stricmp(s, "QUIT") == 0);
+    while (**arg == ' ') (*arg)++;
+    return SB_CD;
 }
 
-int main(int argc, char **argv)
+/* Apply a job made only of session builtins. Returns 1 if it was handled
+   (OUT.NEW and RC.NEW written), 0 if the job needs a real shell. */
+static int session_run_builtins(const char *cmd_path)
 {
-    int idle_ms = 100;
-    char first[MAX_LINE];
-    char logbuf[200];
+    FILE *in, *out;
+    char line[MAX_LINE];
+    char buf[80];
+    char *arg, *eq, *c;
+    unsigned ndrives, drive;
+    int rc = 0;
 
-    /* Optional: allow polling interval as argv[1] */
-    if (argc >= 2) {
-        int v = atoi(argv[1]);
-        if (v >= 10 && v <= 2000) idle_ms = v;
+    in = fopen(cmd_path, "rt");
+    if (!in) return 0;
+    while (fgets(line, sizeof(line), in)) {
+        if (session_builtin(line, &arg) == SB_NONE) { fclose(in); return 0; }
     }
+    rewind(in);
 
-    log_line("MBXSRV starting");
-    set_status("READY");
-
-    /* Crash recovery: if CMD.RUN exists, process it */
-    if (file_exists(CMD_RUN)) {
-        log_line("Found stale CMD.RUN; will process it");
-    }
+    remove(g_out_new);
+    out = fopen(g_out_new, "wt");
+    if (!out) { fclose(in); return 0; }
 
-    for (;;) {
-        /* Let ESC stop the server locally */
-        if (kbhit()) {
-            int ch = getch();
-            if (ch == 27) { /* ESC */
-                log_line("ESC pressed; exiting");
-                set_status("BYE");
-                break;
+    enter_dir(g_cwd);
+    while (fgets(line, sizeof(line), in)) {
+        switch (session_builtin(line, &arg)) {
+        case SB_DRIVE:
+            drive = (unsigned)(toupper((unsigned char)arg[0]) - 'A' + 1);
+            _dos_setdrive(drive, &ndrives);
+            _dos_getdrive(&ndrives);
+            rc = (ndrives == drive) ? 0 : 1;
+            if (rc) fputs("Invalid drive specification\r\n", out);
+            break;
+        case SB_CD:
+            if (!arg[0]) {
+                current_dir(buf, sizeof(buf));
+                fprintf(out, "%s\r\n", buf);
+                rc = 0;
+            } else {
+                rc = (chdir(arg) == 0) ? 0 : 1;
+                if (rc) fputs("Invalid directory\r\n", out);
             }
+            break;
+        case SB_SET:
+            eq = strchr(arg, '=');
+            *eq = 0;
+            for (c = arg; *c; c++) *c = (char)toupper((unsigned char)*c);
+            env_set(arg, eq + 1);
+            rc = 0;
+            break;
         }
+    }
+    current_dir(g_cwd, sizeof(g_cwd));
+    enter_dir(g_home);
 
-        /* If no CMD.RUN, try to claim CMD.TXT */
-        if (!file_exists(CMD_RUN) && file_exists(CMD_TXT)) {
-            if (claim_cmd()) {
-                log_line("Claimed CMD.TXT -> CMD.RUN");
-            }
+    fclose(in);
+    fclose(out);
+
+    remove(g_rc_new);
+    out = fopen(g_rc_new, "wt");
+    if (out) { fprintf(out, "%d\r\n", rc); fclose(out); }
+    return 1;
+}
+
+static char g_job_buf[JOB_BUF];
+
+/* Remove chained parts left by an earlier job */
+static void remove_job_parts(void)
+{
+    struct find_t ft;
+    char names[32][13];
+    int i, n;
+
+    do {
+        n = 0;
+        if (_dos_findfirst(g_job_parts, _A_NORMAL, &ft) == 0) {
+            do {
+                if (n < 32) strcpy(names[n++], ft.name);
+            } while (_dos_findnext(&ft) == 0);
         }
+        for (i = 0; i < n; i++) remove(names[i]);
+    } while (n == 32);
+}
 
-        /* If we have CMD.RUN, process it */
-        if (file_exists(CMD_RUN)) {
-            int payload_bytes = 0;
-            int sys_rc;
-
-            set_status("RUNNING");
-
-            if (!read_first_nonempty_line(CMD_RUN, first, sizeof(first))) {
-                log_line("ERROR: CMD.RUN empty");
-                write_error_output("CMD file is empty");
-                remove(CMD_RUN);
-                set_status("READY");
-                ms_sleep((unsigned)idle_ms);
-                continue;
-            }
+/* Start chained part n: create it and CALL it from the wrapper */
+static FILE *open_job_part(FILE *wrapper, int n)
+{
+    char name[16], path[96];
+    FILE *f;
 
-            if (is_exit_cmd(first)) {
-                log_line("Received EXIT/QUIT");
-                write_text_atomic(OUT_NEW, OUT_TXT, "MBXSRV BYE");
-                write_text_atomic(RC_NEW, RC_TXT, "0");
-                remove(CMD_RUN);
-                set_status("BYE");
-                break;
-            }
+    sprintf(name, g_job_part, n);
+    f = fopen(name, "wt");
+    if (!f) return NULL;
+    if (g_session) home_path(path, name);
+    else strcpy(path, name);
+    fprintf(wrapper, "call %s\r\n", path);
+    return f;
+}
 
-            /* Build job bat */
-            if (!build_job_bat_from_cmd(CMD_RUN, &payload_bytes)) {
-                sprintf(logbuf, "ERROR: build_job_bat failed (payload=%d, errno=%d)", payload_bytes, errno);
-                log_line(logbuf);
-                write_error_output("Failed to build MBXJOB.BAT (payload too large or file error)");
-                remove(CMD_RUN);
-                set_status("READY");
-                ms_sleep((unsigned)idle_ms);
-                continue;
-            }
+/* Copy CMD.RUN into JOB_BAT as a script, with wrapper + RC capture.
+   The body streams through in JOB_BUF pieces (fgets stops at line ends,
+   so each piece is a line or part of a long one); directive lines are
+   dropped, batch jobs get a marker after each command line, and chained
+   jobs move to the next part file at the first line end past o->chain.
+   Returns 1 on success, 0 on failure. */
+static int build_job_bat_from_cmd(const char *cmd_path, const struct job_opts *o, long *out_payload_bytes)
+{
+    FILE *in, *out, *body;
+    long total = 0, part_bytes = 0;
+    int ncmd = 0, in_cmd = 0, at_bol = 1, nparts = 0;
+    int ok = 1;
 
-            sprintf(logbuf, "Executing job (payload=%d bytes)", payload_bytes);
-            log_line(logbuf);
+    remove(g_job_bat);
+    remove(g_rc_new);
+    remove_job_parts();
+
+    in = fopen(cmd_path, "rt");
+    if (!in) return 0;
 
-            /* Clean old published files to reduce confusion */
-            remove(OUT_TXT);
-            remove(RC_TXT);
+    out = fopen(g_job_bat, "wt");
+    if (!out) { fclose(in); return 0; }
+    setvbuf(in, NULL, _IOFBF, JOB_BUF);
+    setvbuf(out, NULL, _IOFBF, JOB_BUF);
+    body = out;
 
-            /* Execute */
-            sys_rc = exec_job_to_out();
-            sprintf(logbuf, "system() rc=%d", sys_rc);
-            log_line(logbuf);
+    /* Wrapper */
+    fputs("@echo off\r\n", out);
+    fputs("rem MBXSRV job wrapper\r\n", out);
+    if (g_session) session_prologue(out);
+
+    while (fgets(g_job_buf, sizeof(g_job_buf), in)) {
+        int len = (int)strlen(g_job_buf);
+        int eol = (len > 0 && g_job_buf[len - 1] == '\n');
 
-            publish_results(sys_rc);
+        /* Directives are for us, not for the shell */
+        if (at_bol && is_directive(g_job_buf)) {
+            at_bol = eol;
+            continue;
+        }
+
+        if (o->chain > 0 && at_bol && (body == out || part_bytes >= o->chain)) {
+            if (body != out) fclose(body);
+            body = (nparts < JOB_PART_MAX) ? open_job_part(out, ++nparts) : NULL;
+            if (!body) { body = out; ok = 0; break; }
+            part_bytes = 0;
+        }
 
-            remove(CMD_RUN);
-            set_status("READY");
+        if (fputs(g_job_buf, body) == EOF) { ok = 0; break; }
+        total += len;
+        part_bytes += len;
+
+        /* Batch: mark the end of each command line (long lines arrive in pieces) */
+        if (o->batch) {
+            char *p;
+            for (p = g_job_buf; *p; p++) if (!isspace((unsigned char)*p)) { in_cmd = 1; break; }
+            if (eol && in_cmd) {
+                fprintf(body, "echo " BATCH_MARK "%d %%errorlevel%%\r\n", ++ncmd);
+                in_cmd = 0;
+            }
+        }
+        at_bol = eol;
+    }
+    if (ok && in_cmd) fprintf(body, "\r\necho " BATCH_MARK "%d %%errorlevel%%\r\n", ++ncmd);
+    if (body != out) fclose(body);
+
+    if (!ok) {
+        fputs("rem ERROR: could not write the job\r\n", out);
+        fprintf(out, "echo 1 > %s\r\n", g_rc_new);
+        fclose(in);
+        fclose(out);
+        if (out_payload_bytes) *out_payload_bytes = total;
+        return 0;
+    }
+
+    /* Always write return code file for host */
+    fputs("\r\nrem Capture ERRORLEVEL of last command\r\n", out);
+    if (g_session) {
+        /* The job may have changed directory; use absolute paths from here */
+        char rc_path[96];
+        home_path(rc_path, g_rc_new);
+        fprintf(out, "echo %%errorlevel%% > %s\r\n", rc_path);
+        session_epilogue(out);
+    } else {
+        fprintf(out, "echo %%errorlevel%% > %s\r\n", g_rc_new);
+    }
+
+    fclose(in);
+    fclose(out);
+
+    if (out_payload_bytes) *out_payload_bytes = total;
+    return 1;
+}
+
+/* ---- Watchdog (:MBX TIMEOUT, CANCEL.TXT) ----
+   system() doesn't return until the job ends, so a hung job is stopped
+   from the timer tick (INT 1Ch), which is only hooked while a job runs.
+   Once the job is over its time, or CANCEL.TXT names it (checked about
+   once a second, and only while DOS is idle: InDOS and the critical error
+   flag both 0), the tick puts Ctrl-C into the BIOS keyboard buffer every
+   half second, then 'Y' for COMMAND.COM's "Terminate batch job (Y/N)?".
+   A program that never looks at the keyboard won't notice; real-mode
+   builds then end the current program with INT 21h/4Ch every WD_KILL_S
+   seconds until our own PSP is current again. DJGPP builds can't leave
+   a DPMI interrupt that way and stop at the keystrokes. */
+
+#define WD_TICKS_PER_10S 182  /* 18.2 Hz */
+#define WD_CHECK_TICKS 18     /* CANCEL.TXT check interval */
+#define WD_KICK_TICKS  9      /* keystroke interval */
+#define WD_KILL_S      5
+#define WD_TIMEOUT     1
+#define WD_CANCEL      2
+#define KEY_CTRL_C     0x2E03
+#define KEY_Y          0x1559
+#define RC_TIMEOUT     124
+#define RC_CANCEL      130
+
+static volatile struct {
+    unsigned long ticks;     /* since armed */
+    unsigned long limit;     /* ticks allowed, 0 = no limit */
+    unsigned long fired_at;  /* tick of the stop decision */
+    int armed;
+    int fired;               /* 0, WD_TIMEOUT or WD_CANCEL */
+    int kicks;
+    int in_dos;              /* a DOS call of ours is in progress */
+} g_wd;
+
+static int g_wd_on = 1;                  /* MBX_WATCHDOG=0: never hook */
+static char g_cancel_path[96];           /* absolute: jobs may change dir */
+static char g_wd_tag[16];                /* :MBX ID that CANCEL.TXT must hold */
+static char g_wd_buf[16];                /* CANCEL.TXT as read by the tick */
+
+static int cancel_names(const char *text, const char *tag)
+{
+    return strcmp(text, "*") == 0 || (tag[0] && stricmp(text, tag) == 0);
+}
+
+#ifdef __DJGPP__
+int _crt0_startup_flags = _CRT0_FLAG_LOCK_MEMORY; /* the tick touches our data */
+
+static unsigned long g_indos_lin;        /* linear address of the InDOS flag */
+static int g_wd_seg, g_wd_sel;           /* DOS block: path, then read buffer */
+static _go32_dpmi_seginfo g_old_1c, g_new_1c;
+
+#define BDA_PEEKW(off)    _farpeekw(_dos_ds, 0x400 + (off))
+#define BDA_POKEW(off, v) _farpokew(_dos_ds, 0x400 + (off), (unsigned short)(v))
+
+static int dos_idle(void)
+{
+    return !_farpeekb(_dos_ds, g_indos_lin) && !_farpeekb(_dos_ds, g_indos_lin - 1);
+}
+
+static void wd_platform_init(void)
+{
+    __dpmi_regs r;
+
+    memset(&r, 0, sizeof(r));
+    r.h.ah = 0x34;
+    __dpmi_int(0x21, &r);
+    g_indos_lin = (unsigned long)r.x.es * 16 + r.x.bx;
+    g_wd_seg = __dpmi_allocate_dos_memory(8, &g_wd_sel);
+    if (g_wd_seg == -1) g_wd_on = 0;
+    else dosmemput(g_cancel_path, strlen(g_cancel_path) + 1, (unsigned long)g_wd_seg * 16);
+}
+
+/* Open/read/close CANCEL.TXT through DOS, as the C library isn't ours to
+   call from an interrupt */
+static int wd_cancel_named(void)
+{
+    __dpmi_regs r;
+    unsigned n;
+
+    memset(&r, 0, sizeof(r));
+    r.x.ax = 0x3D00;
+    r.x.ds = (unsigned short)g_wd_seg;
+    r.x.dx = 0;
+    __dpmi_int(0x21, &r);
+    if (r.x.flags & 1) return 0;
+    r.x.bx = r.x.ax;
+    r.h.ah = 0x3F;
+    r.x.cx = sizeof(g_wd_buf) - 1;
+    r.x.ds = (unsigned short)g_wd_seg;
+    r.x.dx = 96;
+    __dpmi_int(0x21, &r);
+    n = (r.x.flags & 1) ? 0 : r.x.ax;
+    r.h.ah = 0x3E;
+    __dpmi_int(0x21, &r);
+    dosmemget((unsigned long)g_wd_seg * 16 + 96, n, g_wd_buf);
+    g_wd_buf[n] = 0;
+    trim(g_wd_buf);
+    return cancel_names(g_wd_buf, g_wd_tag);
+}
+
+static void wd_kill(void) { }
+
+static void wd_tick(void);
+static void wd_isr(void) { wd_tick(); }
+
+static void wd_hook(void)
+{
+    _go32_dpmi_get_protected_mode_interrupt_vector(0x1C, &g_old_1c);
+    g_new_1c.pm_offset = (unsigned long)wd_isr;
+    g_new_1c.pm_selector = _go32_my_cs();
+    _go32_dpmi_chain_protected_mode_interrupt_vector(0x1C, &g_new_1c);
+}
+
+static void wd_unhook(void)
+{
+    _go32_dpmi_set_protected_mode_interrupt_vector(0x1C, &g_old_1c);
+}
+#else
+#if defined(__WATCOMC__)
+typedef void (__interrupt __far *wd_vector)(void);
+#define WD_HANDLER void __interrupt __far
+#else
+typedef void interrupt (*wd_vector)(void);
+#define WD_HANDLER void interrupt
+#endif
+
+static unsigned char far *g_indos;
+static wd_vector g_old_1c;
+
+#define BDA_PEEKW(off)    (*(unsigned short far *)MK_FP(0x40, (off)))
+#define BDA_POKEW(off, v) (*(unsigned short far *)MK_FP(0x40, (off)) = (unsigned short)(v))
+
+static int dos_idle(void)
+{
+    return !g_indos[0] && !g_indos[-1];
+}
+
+static void wd_platform_init(void)
+{
+    union REGS r;
+    struct SREGS sr;
+
+    segread(&sr);
+    r.h.ah = 0x34;
+    intdosx(&r, &r, &sr);
+    g_indos = (unsigned char far *)MK_FP(sr.es, r.x.bx);
+}
+
+/* Open/read/close CANCEL.TXT through DOS. SS is still the interrupted
+   program's, and small-model near pointers resolve against DS, so
+   everything we pass by address -- the buffers and the register blocks --
+   is static. g_wd.in_dos keeps the next tick out meanwhile. */
+static int wd_cancel_named(void)
+{
+    static union REGS r;
+    static struct SREGS sr;
+    static unsigned n;
+
+    segread(&sr);
+    r.x.ax = 0x3D00;
+    sr.ds = FP_SEG((char far *)g_cancel_path);
+    r.x.dx = FP_OFF((char far *)g_cancel_path);
+    intdosx(&r, &r, &sr);
+    if (r.x.cflag) return 0;
+    r.x.bx = r.x.ax;
+    r.h.ah = 0x3F;
+    r.x.cx = sizeof(g_wd_buf) - 1;
+    sr.ds = FP_SEG((char far *)g_wd_buf);
+    r.x.dx = FP_OFF((char far *)g_wd_buf);
+    intdosx(&r, &r, &sr);
+    n = r.x.cflag ? 0 : r.x.ax;
+    r.h.ah = 0x3E;
+    intdos(&r, &r);
+    g_wd_buf[n] = 0;
+    trim(g_wd_buf);
+    return cancel_names(g_wd_buf, g_wd_tag);
+}
+
+/* End the current program, unless that is us again. We are inside the
+   BIOS tick, so acknowledge the timer interrupt first. `r` is static
+   for the same reason as in wd_cancel_named. */
+static void wd_kill(void)
+{
+    static union REGS r;
+
+    r.h.ah = 0x62;
+    intdos(&r, &r);
+    if (r.x.bx == _psp || !dos_idle()) return;
+    outp(0x20, 0x20);
+    r.x.ax = 0x4C00 | (RC_TIMEOUT & 0xFF);
+    intdos(&r, &r);
+}
+
+static void wd_tick(void);
+static WD_HANDLER wd_isr(void)
+{
+    g_old_1c();
+    wd_tick();
+}
+
+static void wd_hook(void)
+{
+    g_old_1c = _dos_getvect(0x1C);
+    _dos_setvect(0x1C, wd_isr);
+}
+
+static void wd_unhook(void)
+{
+    _dos_setvect(0x1C, g_old_1c);
+}
+#endif
+
+/* Put one key into the BIOS keyboard buffer, if it has room */
+static void wd_stuff(unsigned key)
+{
+    unsigned start = BDA_PEEKW(0x80), end = BDA_PEEKW(0x82);
+    unsigned tail = BDA_PEEKW(0x1C), next;
+
+    if (start == 0 || end <= start) { start = 0x1E; end = 0x3E; } /* pre-AT BIOS */
+    next = tail + 2;
+    if (next >= end) next = start;
+    if (next == BDA_PEEKW(0x1A)) return;
+    BDA_POKEW(tail, key);
+    BDA_POKEW(0x1C, next);
+}
+
+static void wd_tick(void)
+{
+    unsigned long since;
+
+    if (!g_wd.armed) return;
+    g_wd.ticks++;
+    if (!g_wd.fired) {
+        if (g_wd.limit && g_wd.ticks >= g_wd.limit) {
+            g_wd.fired = WD_TIMEOUT;
+        } else if (g_wd.ticks % WD_CHECK_TICKS == 0 && !g_wd.in_dos && dos_idle()) {
+            g_wd.in_dos = 1;
+            if (wd_cancel_named()) g_wd.fired = WD_CANCEL;
+            g_wd.in_dos = 0;
+        }
+        if (!g_wd.fired) return;
+        g_wd.fired_at = g_wd.ticks;
+    }
+
+    since = g_wd.ticks - g_wd.fired_at;
+    if (since % WD_KICK_TICKS == 0) wd_stuff((g_wd.kicks++ & 1) ? KEY_Y : KEY_CTRL_C);
+    if (since > 0 && since % (WD_KILL_S * WD_TICKS_PER_10S / 10) == 0) wd_kill();
+}
+
+/* Once at startup. The keystrokes may reach us too, so Ctrl-C must not
+   end MBXSRV itself. */
+static void wd_init(void)
+{
+    const char *opt = getenv("MBX_WATCHDOG");
+    size_t n;
+
+    signal(SIGINT, SIG_IGN);
+    current_dir(g_cancel_path, sizeof(g_cancel_path) - sizeof(CANCEL_TXT) - 1);
+    n = strlen(g_cancel_path);
+    if (n > 0 && g_cancel_path[n - 1] != '\\') strcat(g_cancel_path, "\\");
+    strcat(g_cancel_path, CANCEL_TXT);
+    if (opt && opt[0] == '0') { g_wd_on = 0; return; }
+    wd_platform_init();
+}
+
+/* Does CANCEL.TXT name the job tagged `tag`? Then it is ours to remove.
+   Other tags and "*" may be meant for a job another worker is running,
+   so they stay for its tick; the host clears a file nobody takes. */
+static int cancel_waiting(const char *tag)
+{
+    FILE *f = fopen(g_cancel_path, "rt");
+    char text[32];
+
+    if (!f) return 0;
+    if (!fgets(text, sizeof(text), f)) text[0] = 0;
+    fclose(f);
+    trim(text);
+    if (!tag[0] || stricmp(text, tag) != 0) return 0;
+    remove(g_cancel_path);
+    return 1;
+}
+
+/* Run `cmd` under the watchdog. Returns the system() result, or
+   RC_TIMEOUT / RC_CANCEL if the watchdog stopped it. */
+static int wd_system(const char *cmd, long timeout_s)
+{
+    int rc;
+
+    if (!g_wd_on) return system(cmd);
+
+    memset((void *)&g_wd, 0, sizeof(g_wd));
+    strcpy(g_wd_tag, g_req_id);
+    g_wd.limit = (unsigned long)timeout_s * WD_TICKS_PER_10S / 10;
+    if (timeout_s > 0 && g_wd.limit == 0) g_wd.limit = 1;
+    wd_hook();
+    g_wd.armed = 1;
+    rc = system(cmd);
+    g_wd.armed = 0;
+    wd_unhook();
+
+    if (!g_wd.fired) return rc;
+    /* Drop keystrokes the job didn't eat */
+    BDA_POKEW(0x1C, BDA_PEEKW(0x1A));
+    if (g_wd.fired == WD_CANCEL) remove(g_cancel_path);
+    return g_wd.fired == WD_TIMEOUT ? RC_TIMEOUT : RC_CANCEL;
+}
+
+/* A job the watchdog stopped: say so at the end of its output and give it
+   the distinct RC (its own "echo %errorlevel%" never ran, or ran late). */
+static void wd_report(int rc, long timeout_s)
+{
+    char path[96];
+    FILE *f;
+
+    if (g_session) home_path(path, g_out_new); else strcpy(path, g_out_new);
+    f = fopen(path, "at");
+    if (f) {
+        if (rc == RC_TIMEOUT) fprintf(f, "\r\n*** MBXSRV: job timed out after %ld s\r\n", timeout_s);
+        else fputs("\r\n*** MBXSRV: job cancelled\r\n", f);
+        fclose(f);
+    }
+    if (g_session) home_path(path, g_rc_new); else strcpy(path, g_rc_new);
+    remove(path);
+    f = fopen(path, "wt");
+    if (f) { fprintf(f, "%d\r\n", rc); fclose(f); }
+    log_line(rc == RC_TIMEOUT ? "Job timed out; stopped by the watchdog" : "Job cancelled by CANCEL.TXT");
+}
+
+/* Execute `bat` (MBXJOB.BAT, or a batch file plus arguments), redirecting
+   stdout to OUT_NEW.
+   Optional stderr capture if env MBX_STDERR=1 (works on FreeDOS/4DOS; not classic MS-DOS).
+   Returns system() result. */
+static int exec_job_to_out(const char *bat)
+{
+    const char *comspec = getenv("COMSPEC");
+    const char *stderr_opt = getenv("MBX_STDERR"); /* set to "1" if your shell supports 2>&1 */
+    char cmd[256];
+    char job[160], out[96];
+    int rc;
+
+    if (!comspec || !comspec[0]) comspec = "COMMAND.COM";
+
+    remove(g_out_new);
+
+    /* Session jobs leave the home directory, so name our files absolutely */
+    if (g_session) {
+        home_path(job, bat);
+        home_path(out, g_out_new);
+    } else {
+        strcpy(job, bat);
+        strcpy(out, g_out_new);
+    }
+
+    /* Build: <COMSPEC> /C MBXJOB.BAT > OUT.NEW [2>&1] */
+    /* Keep it short for DOS command length limits. */
+    strcpy(cmd, comspec);
+    strcat(cmd, " /C ");
+    strcat(cmd, job);
+    strcat(cmd, " > ");
+    strcat(cmd, out);
+
+    if (stderr_opt && stderr_opt[0] == '1') {
+        strcat(cmd, " 2>&1");
+    }
+
+    rc = wd_system(cmd, g_job_timeout);
+    if (g_wd.fired) wd_report(rc, g_job_timeout);
+    return rc;
+}
+
+/* Names a job is read from and published under */
+struct job_files {
+    char run[16];  /* claimed CMD file */
+    char out[16];  /* published output */
+    char rc[16];   /* published return code */
+    char res[16];  /* combined reply, "" if the job can't have one */
+    int queued;    /* 1 for CMD.nnn jobs */
+};
+
+static long file_size(const char *path)
+{
+    struct stat st;
+    return (stat(path, &st) == 0) ? (long)st.st_size : -1L;
+}
+
+/* Ensure OUT_NEW exists; if not, create an error output */
+static void ensure_out_new(int sys_rc)
+{
+    if (!file_exists(g_out_new)) {
+        FILE *f = fopen(g_out_new, "wt");
+        if (f) {
+            fprintf(f, "ERROR: OUT.NEW missing (system rc=%d)\r\n", sys_rc);
+            fclose(f);
+        }
+    }
+}
+
+static void publish_file(const char *temp, const char *final)
+{
+    char msg[160];
+
+    remove(final);
+    if (rename(temp, final) != 0) {
+        /* If rename fails, try to at least log it */
+        sprintf(msg, "ERROR: failed to rename %s -> %s (errno=%d)", temp, final, errno);
+        log_line(msg);
+    }
+}
+
+/* Finish RC.NEW: make sure it exists, then add the job's timings (and
+   its request tag on top, if it sent one) */
+static void finish_rc_new(void)
+{
+    FILE *f;
+    char rc[MAX_LINE];
+
+    if (!file_exists(g_rc_new)) {
+        /* Create RC file to signal something happened */
+        f = fopen(g_rc_new, "wt");
+        if (f) { fputs("1\r\n", f); fclose(f); }
+    }
+
+    if (g_req_id[0]) {
+        /* The job's batch wrote only the errorlevel line; rewrite it below
+           the tag */
+        strcpy(rc, "1");
+        f = fopen(g_rc_new, "rt");
+        if (f) {
+            if (!fgets(rc, sizeof(rc), f)) strcpy(rc, "1");
+            fclose(f);
+        }
+        trim(rc);
+        f = fopen(g_rc_new, "wt");
+        if (!f) return;
+        fprintf(f, "ID %s\r\n%s\r\n", g_req_id, rc);
+    } else {
+        f = fopen(g_rc_new, "at");
+        if (!f) return;
+    }
+    fprintf(f, "TIM claim=%lu build=%lu exec=%lu publish=%lu payload=%ld out=%ld packed=%ld res=%d\r\n",
+            g_tim.claim, g_tim.build, g_tim.exec, g_tim.publish,
+            g_tim.payload, g_tim.out, g_tim.packed, TIMER_RES_MS);
+    fclose(f);
+}
+
+/* :MBX RES: RC.NEW's lines, "LEN <n>" and an empty line, then OUT.NEW,
+   all in RES.NEW, which is published by itself with a single rename.
+   Returns 0 (files untouched) if RES.NEW can't be written. */
+static int publish_combined(const char *final)
+{
+    FILE *in, *out;
+    char line[MAX_LINE];
+    size_t n;
+    int ok = 1;
+
+    remove(g_res_new);
+    out = fopen(g_res_new, "wb");
+    if (!out) return 0;
+
+    in = fopen(g_rc_new, "rt");
+    if (in) {
+        while (fgets(line, sizeof(line), in)) {
+            trim(line);
+            if (line[0]) fprintf(out, "%s\r\n", line);
+        }
+        fclose(in);
+    }
+    fprintf(out, "LEN %ld\r\n\r\n", file_size(g_out_new));
+
+    in = fopen(g_out_new, "rb");
+    if (in) {
+        while ((n = fread(g_job_buf, 1, sizeof(g_job_buf), in)) > 0) {
+            if (fwrite(g_job_buf, 1, n, out) != n) { ok = 0; break; }
+        }
+        fclose(in);
+    }
+    if (fclose(out) != 0) ok = 0;
+    if (!ok) { remove(g_res_new); return 0; }
+
+    remove(g_out_new);
+    remove(g_rc_new);
+    publish_file(g_res_new, final);
+    return 1;
+}
+
+/* Queued jobs publish RC first, so the host can read both files as soon
+   as OUT.nnn appears. Classic jobs keep the OUT-then-RC order, or publish
+   one RES.TXT if they asked for it. The publish timing covers everything
+   after exec up to the last rename. */
+static void publish_results(int sys_rc, const struct job_files *jf)
+{
+    ensure_out_new(sys_rc);
+    if (!g_tim.packed) g_tim.out = file_size(g_out_new);
+
+    if (g_job_res && jf->res[0]) {
+        timing_lap(&g_tim.publish);
+        finish_rc_new();
+        if (publish_combined(jf->res)) return;
+        /* Out of disk space or the like: the classic files still work */
+        publish_file(g_out_new, jf->out);
+        publish_file(g_rc_new, jf->rc);
+        return;
+    }
+
+    if (!jf->queued) publish_file(g_out_new, jf->out);
+    timing_lap(&g_tim.publish);
+    finish_rc_new();
+    publish_file(g_rc_new, jf->rc);
+    if (jf->queued) publish_file(g_out_new, jf->out);
+}
+
+/* Write a clear error message into the job's OUT file (atomic-ish) */
+static void write_error_output(const char *what, const struct job_files *jf)
+{
+    FILE *f;
+
+    remove(g_out_new);
+    f = fopen(g_out_new, "wt");
+    if (!f) return;
+
+    fprintf(f, "ERROR: %s\r\n", what);
+    fprintf(f, "errno=%d\r\n", errno);
+    fclose(f);
+
+    /* Also ensure RC is non-zero */
+    remove(g_rc_new);
+    f = fopen(g_rc_new, "wt");
+    if (f) { fputs("1\r\n", f); fclose(f); }
+
+    publish_results(1, jf);
+}
+
+/* Sequence number of a "XXX.nnn" name, or 0 if the extension isn't numeric */
+static int queue_seq(const char *name)
+{
+    const char *dot = strchr(name, '.');
+    int i, v = 0;
+
+    if (!dot || strlen(dot + 1) != 3) return 0;
+    for (i = 1; i <= 3; i++) {
+        if (!isdigit((unsigned char)dot[i])) return 0;
+        v = v * 10 + (dot[i] - '0');
+    }
+    return (v <= QUEUE_MAX) ? v : 0;
+}
+
+/* Find the oldest pending CMD.nnn. Pending numbers form one contiguous
+   window that may wrap 999 -> 001, so the oldest is the one right after
+   the largest gap. Returns 0 when the queue is empty. */
+static int next_queued(void)
+{
+    static unsigned char seen[(QUEUE_MAX + 8) / 8];
+    struct find_t ft;
+    int n, first = 0, prev = 0, best = 0, best_gap = -1;
+
+    memset(seen, 0, sizeof(seen));
+    if (_dos_findfirst(QUEUE_PATTERN, _A_NORMAL, &ft) != 0) return 0;
+    do {
+        n = queue_seq(ft.name);
+        if (n > 0) seen[n >> 3] |= (unsigned char)(1 << (n & 7));
+    } while (_dos_findnext(&ft) == 0);
+
+    for (n = 1; n <= QUEUE_MAX; n++) {
+        if (!(seen[n >> 3] & (1 << (n & 7)))) continue;
+        if (!first) first = n;
+        else if (n - prev > best_gap) { best_gap = n - prev; best = n; }
+        prev = n;
+    }
+    if (!first) return 0;
+
+    /* Gap that wraps from the highest number back to the lowest */
+    if (first + QUEUE_MAX - prev >= best_gap) best = first;
+    return best;
+}
+
+/* Claim CMD.nnn by renaming to RUN.nnn (RUNn.nnn for worker n). Returns 1
+   if claimed, 0 if it is gone, e.g. another worker won the rename. */
+static int claim_queued(int seq, struct job_files *jf)
+{
+    char cmd_path[16];
+
+    sprintf(cmd_path, "CMD.%03d", seq);
+    sprintf(jf->run, "RUN%s.%03d", g_wid, seq);
+    sprintf(jf->out, "OUT.%03d", seq);
+    sprintf(jf->rc, "RC.%03d", seq);
+    jf->res[0] = 0;
+    jf->queued = 1;
+    return rename(cmd_path, jf->run) == 0;
+}
+
+/* Crash recovery: put our claimed-but-unfinished RUN.nnn back in the
+   queue. Each worker only looks at its own, so a restart never steals a
+   job another worker is running. */
+static void requeue_stale_runs(void)
+{
+    struct find_t ft;
+    char names[16][13];
+    char cmd_path[16];
+    int i, n = 0;
+
+    /* Collect first; renaming while enumerating confuses some DOS versions */
+    if (_dos_findfirst(g_qrun_pattern, _A_NORMAL, &ft) != 0) return;
+    do {
+        if (queue_seq(ft.name) > 0 && n < 16) strcpy(names[n++], ft.name);
+    } while (_dos_findnext(&ft) == 0);
+
+    for (i = 0; i < n; i++) {
+        sprintf(cmd_path, "CMD.%03d", queue_seq(names[i]));
+        if (rename(names[i], cmd_path) == 0) logf2("Requeued stale ", names[i]);
+    }
+}
+
+/* ---- File transfer (STAT / PUT / GET) ---- */
+
+static unsigned long g_crc_table[256];
+static unsigned char g_xfr_buf[XFR_BUF];
+
+static void crc32_init(void)
+{
+    unsigned long c;
+    int n, k;
+
+    for (n = 0; n < 256; n++) {
+        c = (unsigned long)n;
+        for (k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320UL ^ (c >> 1) : c >> 1;
+        g_crc_table[n] = c;
+    }
+}
+
+/* zlib-style running CRC32: start from 0, feed any number of blocks */
+static unsigned long crc32_update(unsigned long crc, const unsigned char *p, unsigned n)
+{
+    crc ^= 0xFFFFFFFFUL;
+    while (n--) crc = g_crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFUL;
+}
+
+/* Move up to len bytes (len < 0: to EOF) from `in` to `out` (NULL: just
+   read), folding them into *crc and, if given, *crc2. Returns the count. */
+static long xfr_copy(FILE *in, FILE *out, long len, unsigned long *crc, unsigned long *crc2)
+{
+    long done = 0;
+    size_t want, n;
+
+    while (len < 0 || done < len) {
+        want = XFR_BUF;
+        if (len >= 0 && len - done < (long)want) want = (size_t)(len - done);
+        n = fread(g_xfr_buf, 1, want, in);
+        if (n == 0) break;
+        *crc = crc32_update(*crc, g_xfr_buf, (unsigned)n);
+        if (crc2) *crc2 = crc32_update(*crc2, g_xfr_buf, (unsigned)n);
+        if (out && fwrite(g_xfr_buf, 1, n, out) != n) break;
+        done += (long)n;
+    }
+    return done;
+}
+
+/* CRC32 of a whole file, or 0 if it can't be read */
+static unsigned long file_crc(const char *path)
+{
+    unsigned long crc = 0;
+    FILE *f = fopen(path, "rb");
+
+    if (f) {
+        xfr_copy(f, NULL, -1L, &crc, NULL);
+        fclose(f);
+    }
+    return crc;
+}
+
+/* A PUT in progress lives next to its target with extension $$$ */
+static void partial_path(const char *path, char *buf)
+{
+    char *dot, *slash;
+
+    strcpy(buf, path);
+    dot = strrchr(buf, '.');
+    slash = strrchr(buf, '\\');
+    if (dot && (!slash || dot > slash)) strcpy(dot, ".$$$");
+    else strcat(buf, ".$$$");
+}
+
+static int xfr_stat(const char *args, FILE *out)
+{
+    char path[MAX_LINE], part[MAX_LINE];
+    long size;
+
+    if (sscanf(args, "%s", path) != 1) {
+        fputs("ERROR: usage STAT <path>\r\n", out);
+        return 1;
+    }
+    partial_path(path, part);
+    size = file_size(path);
+    fprintf(out, "STAT %ld %08lX %ld\r\n", size, size >= 0 ? file_crc(path) : 0UL,
+            file_exists(part) ? file_size(part) : 0L);
+    return 0;
+}
+
+static int xfr_put(FILE *cmd, const char *args, FILE *out)
+{
+    char path[MAX_LINE], part[MAX_LINE], line[MAX_LINE], chunk[16];
+    unsigned long want_crc, chunk_crc, crc = 0, got;
+    long size, from, len, moved;
+    int seq;
+    FILE *pf, *cf;
+
+    if (sscanf(args, "%ld %lx %ld %s", &size, &want_crc, &from, path) != 4 || from < 0) {
+        fputs("ERROR: usage PUT <size> <crc32> <from> <path>\r\n", out);
+        return 1;
+    }
+    partial_path(path, part);
+
+    if (from > 0 && file_size(part) != from) {
+        fprintf(out, "RESTART partial is %ld bytes, not %ld\r\n", file_size(part), from);
+        return 4;
+    }
+    pf = fopen(part, from > 0 ? "r+b" : "w+b");
+    if (!pf) {
+        fprintf(out, "ERROR: cannot write %s (errno=%d)\r\n", part, errno);
+        return 1;
+    }
+
+    /* The whole-file CRC covers what earlier attempts already wrote */
+    if (from > 0) xfr_copy(pf, NULL, from, &crc, NULL);
+    fseek(pf, from, SEEK_SET);
+
+    while (fgets(line, sizeof(line), cmd)) {
+        if (sscanf(line, "%d %ld %lx", &seq, &len, &chunk_crc) != 3) continue;
+        sprintf(chunk, "XFR.%03d", seq);
+        got = 0;
+        cf = fopen(chunk, "rb");
+        moved = cf ? xfr_copy(cf, pf, len, &got, &crc) : -1L;
+        if (cf) fclose(cf);
+        remove(chunk);
+
+        if (moved != len || got != chunk_crc) {
+            /* Drop the damaged tail so a retry resumes at this chunk */
+            fflush(pf);
+            chsize(fileno(pf), from);
+            fclose(pf);
+            fprintf(out, "BAD %d %ld\r\n", seq, from);
+            return 2;
+        }
+        from += len;
+        fprintf(out, "OK %d\r\n", seq);
+    }
+    fclose(pf);
+
+    if (from != size || crc != want_crc) {
+        remove(part);
+        fprintf(out, "BADFILE %ld %08lX\r\n", from, crc);
+        return 3;
+    }
+    remove(path);
+    if (rename(part, path) != 0) {
+        fprintf(out, "ERROR: cannot rename %s -> %s (errno=%d)\r\n", part, path, errno);
+        return 1;
+    }
+    fprintf(out, "DONE %ld %08lX\r\n", size, crc);
+    return 0;
+}
+
+static int xfr_get(const char *args, FILE *out)
+{
+    char path[MAX_LINE], chunk[16];
+    unsigned long have_crc, crc = 0, chunk_crc;
+    long chunk_len, from, have_size, size, len;
+    int seq;
+    FILE *f, *cf;
+
+    if (sscanf(args, "%ld %ld %ld %lx %s", &chunk_len, &from, &have_size, &have_crc, path) != 5 ||
+        chunk_len <= 0 || from < 0) {
+        fputs("ERROR: usage GET <chunk> <from> <have_size> <have_crc32> <path>\r\n", out);
+        return 1;
+    }
+    size = file_size(path);
+    f = fopen(path, "rb");
+    if (!f || size < 0) {
+        if (f) fclose(f);
+        fprintf(out, "ERROR: cannot read %s\r\n", path);
+        return 1;
+    }
+    if (from > size) {
+        fclose(f);
+        fprintf(out, "RESTART host has %ld bytes of a %ld byte file\r\n", from, size);
+        return 4;
+    }
+    if (have_size == size && from == 0) {
+        xfr_copy(f, NULL, -1L, &crc, NULL);
+        if (crc == have_crc) {
+            fclose(f);
+            fprintf(out, "SAME %ld %08lX\r\n", size, crc);
+            return 0;
+        }
+        crc = 0;
+        fseek(f, 0L, SEEK_SET);
+    }
+
+    if (from > 0) xfr_copy(f, NULL, from, &crc, NULL);
+    for (seq = 1; from < size; seq++) {
+        if (seq > XFR_MAX) {
+            fclose(f);
+            fprintf(out, "MORE %ld\r\n", from);
+            return 0;
+        }
+        sprintf(chunk, "XFR.%03d", seq);
+        cf = fopen(chunk, "wb");
+        if (!cf) {
+            fclose(f);
+            fprintf(out, "ERROR: cannot write %s (errno=%d)\r\n", chunk, errno);
+            return 1;
+        }
+        chunk_crc = 0;
+        len = xfr_copy(f, cf, chunk_len, &chunk_crc, &crc);
+        fclose(cf);
+        if (len <= 0) break;
+        fprintf(out, "CHUNK %d %ld %08lX\r\n", seq, len, chunk_crc);
+        from += len;
+    }
+    fclose(f);
+    fprintf(out, "FILE %ld %08lX\r\n", size, crc);
+    return 0;
+}
+
+static int is_xfer_cmd(const char *s)
+{
+    return strnicmp(s, "STAT ", 5) == 0 || strnicmp(s, "PUT ", 4) == 0 || strnicmp(s, "GET ", 4) == 0;
+}
+
+/* Run a STAT/PUT/GET job: the reply goes to OUT.NEW, the status to RC.NEW */
+static void run_transfer(const char *cmd_path, const char *first)
+{
+    char line[MAX_LINE];
+    FILE *cmd = fopen(cmd_path, "rt");
+    FILE *out = fopen(g_out_new, "wb");
+    FILE *rc;
+    int status = 1;
+
+    if (cmd && out) {
+        /* Skip to the verb line; PUT reads its chunk lines after it */
+        while (fgets(line, sizeof(line), cmd)) {
+            trim(line);
+            if (line[0] && !is_directive(line)) break;
+        }
+        if (strnicmp(first, "STAT ", 5) == 0) status = xfr_stat(first + 5, out);
+        else if (strnicmp(first, "PUT ", 4) == 0) status = xfr_put(cmd, first + 4, out);
+        else status = xfr_get(first + 4, out);
+    }
+    if (cmd) fclose(cmd);
+    if (out) fclose(out);
+
+    rc = fopen(g_rc_new, "wt");
+    if (rc) {
+        fprintf(rc, "%d\r\n", status);
+        fclose(rc);
+    }
+}
+
+/* ---- Output compression (:MBX PACK) ---- */
+
+/* LZSS over a sliding 4 KB window. The file is LZ_MAGIC, the plain size
+   and its CRC32 (both 4 bytes, little-endian), then groups of a flag byte
+   and eight items, low bit first: 0 = one literal byte, 1 = a match of two
+   bytes "dddddddd ddddllll" (distance-1, length-3). Length code 15 is
+   followed by one more byte of length, so runs of blank lines and padding
+   pack into few bytes. Positions are chained by a hash of their first
+   three bytes. */
+static unsigned char g_lz_buf[2 * LZ_WIN + LZ_MAX];
+static unsigned g_lz_head[LZ_HASH];  /* position + 1 of the latest entry, 0 = none */
+static unsigned g_lz_prev[LZ_WIN];   /* previous position + 1, by position % LZ_WIN */
+
+static unsigned lz_hash(const unsigned char *p)
+{
+    return (((unsigned)p[0] << 5) ^ ((unsigned)p[1] << 3) ^ p[2]) & (LZ_HASH - 1);
+}
+
+static void lz_insert(unsigned pos)
+{
+    unsigned h = lz_hash(g_lz_buf + pos);
+    g_lz_prev[pos & (LZ_WIN - 1)] = g_lz_head[h];
+    g_lz_head[h] = pos + 1;
+}
+
+/* Drop the oldest LZ_WIN bytes from the buffer */
+static void lz_slide(void)
+{
+    unsigned i;
+
+    memmove(g_lz_buf, g_lz_buf + LZ_WIN, sizeof(g_lz_buf) - LZ_WIN);
+    for (i = 0; i < LZ_HASH; i++)
+        g_lz_head[i] = (g_lz_head[i] > LZ_WIN) ? g_lz_head[i] - LZ_WIN : 0;
+    for (i = 0; i < LZ_WIN; i++)
+        g_lz_prev[i] = (g_lz_prev[i] > LZ_WIN) ? g_lz_prev[i] - LZ_WIN : 0;
+}
+
+/* Longest match for pos among earlier positions in the window */
+static unsigned lz_match(unsigned pos, unsigned avail, unsigned *dist)
+{
+    unsigned best = 0, cand, c, n, probes;
+    unsigned max = (avail < LZ_MAX) ? avail : LZ_MAX;
+
+    if (max < LZ_MIN) return 0;
+    cand = g_lz_head[lz_hash(g_lz_buf + pos)];
+    for (probes = 0; cand && probes < LZ_PROBES; probes++) {
+        c = cand - 1;
+        if (pos - c > LZ_WIN) break;
+        if (g_lz_buf[c + best] == g_lz_buf[pos + best]) {
+            for (n = 0; n < max && g_lz_buf[c + n] == g_lz_buf[pos + n]; n++) ;
+            if (n > best) {
+                best = n;
+                *dist = pos - c;
+                if (best == max) break;
+            }
+        }
+        /* Entries only ever point backwards; anything else is a stale slot */
+        if (g_lz_prev[c & (LZ_WIN - 1)] >= cand) break;
+        cand = g_lz_prev[c & (LZ_WIN - 1)];
+    }
+    return (best >= LZ_MIN) ? best : 0;
+}
+
+static void put_le32(unsigned char *p, unsigned long v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+/* Compress src into dst. Returns the packed size, or -1 on a file error. */
+static long lz_pack(const char *src, const char *dst)
+{
+    FILE *in, *out;
+    unsigned char group[1 + 8 * 3];
+    unsigned gl = 1, items = 0;
+    unsigned len = 0, pos = 0, n, m, dist = 0, code;
+    unsigned long crc = 0, size = 0;
+    long packed = LZ_HEAD;
+    int eof = 0, ok = 1;
+
+    in = fopen(src, "rb");
+    if (!in) return -1;
+    out = fopen(dst, "wb");
+    if (!out) { fclose(in); return -1; }
+    memset(g_lz_head, 0, sizeof(g_lz_head));
+    memset(group, 0, LZ_HEAD);
+    fwrite(group, 1, LZ_HEAD, out); /* header goes in at the end */
+    group[0] = 0;
+
+    for (;;) {
+        /* Keep LZ_MAX bytes of lookahead */
+        if (!eof && len - pos < LZ_MAX) {
+            if (pos >= 2 * LZ_WIN) { lz_slide(); pos -= LZ_WIN; len -= LZ_WIN; }
+            n = (unsigned)fread(g_lz_buf + len, 1, sizeof(g_lz_buf) - len, in);
+            if (n == 0) eof = 1;
+            crc = crc32_update(crc, g_lz_buf + len, n);
+            size += n;
+            len += n;
+            continue;
+        }
+        if (pos >= len) break;
+
+        m = lz_match(pos, len - pos, &dist);
+        if (m) {
+            code = m - LZ_MIN;
+            group[0] |= (unsigned char)(1 << items);
+            group[gl++] = (unsigned char)((dist - 1) >> 4);
+            group[gl++] = (unsigned char)((((dist - 1) & 15) << 4) | (code < 15 ? code : 15));
+            if (code >= 15) group[gl++] = (unsigned char)(code - 15);
+        } else {
+            group[gl++] = g_lz_buf[pos];
+            m = 1;
+        }
+        for (n = 0; n < m; n++, pos++)
+            if (pos + LZ_MIN <= len) lz_insert(pos);
+
+        if (++items == 8) {
+            if (fwrite(group, 1, gl, out) != gl) { ok = 0; break; }
+            packed += gl;
+            group[0] = 0;
+            gl = 1;
+            items = 0;
+        }
+    }
+    if (ok && items) {
+        if (fwrite(group, 1, gl, out) != gl) ok = 0;
+        packed += gl;
+    }
+
+    memcpy(group, LZ_MAGIC, 8);
+    put_le32(group + 8, size);
+    put_le32(group + 12, crc);
+    if (ok && (fseek(out, 0L, SEEK_SET) != 0 || fwrite(group, 1, LZ_HEAD, out) != LZ_HEAD)) ok = 0;
+    if (ferror(in)) ok = 0;
+    fclose(in);
+    if (fclose(out) != 0) ok = 0;
+    return ok ? packed : -1;
+}
+
+/* Replace OUT.NEW by its packed form when it is at least `min` bytes and
+   packing actually saves space */
+static void pack_output(long min)
+{
+    char logbuf[120];
+    long size = file_size(g_out_new), packed;
+
+    if (size < 0 || size < min) return;
+    packed = lz_pack(g_out_new, g_out_lz);
+    if (packed > 0 && packed < size) {
+        remove(g_out_new);
+        if (rename(g_out_lz, g_out_new) == 0) {
+            g_tim.out = size;
+            g_tim.packed = packed;
+            sprintf(logbuf, "Packed output %ld -> %ld bytes", size, packed);
+            log_line(logbuf);
+            return;
+        }
+    }
+    remove(g_out_lz);
+}
+
+/* ---- Templates (RUN name args) ---- */
+
+/* Templates are batch files the host leaves in TPL\ once; "RUN name args"
+   runs TPL\name.BAT with up to eight arguments. Outside session mode that
+   goes through MBXTPL.BAT, a fixed wrapper written at startup, so the job
+   itself costs no file writes. Session jobs (and command lines too long
+   for DOS) get a small MBXJOB.BAT that CALLs the template. */
+static int is_run_cmd(const char *s)
+{
+    return strnicmp(s, "RUN ", 4) == 0;
+}
+
+static int template_name_ok(const char *name)
+{
+    size_t i, n = strlen(name);
+
+    if (n == 0 || n > 8) return 0;
+    for (i = 0; i < n; i++)
+        if (!isalnum((unsigned char)name[i]) && name[i] != '_' && name[i] != '-') return 0;
+    return 1;
+}
+
+static int write_template_wrapper(void)
+{
+    FILE *f;
+
+    remove(g_tpl_bat);
+    f = fopen(g_tpl_bat, "wt");
+    if (!f) return 0;
+    fputs("@echo off\r\n", f);
+    fputs("rem MBXSRV template wrapper\r\n", f);
+    fprintf(f, "call %s\\%%1.BAT %%2 %%3 %%4 %%5 %%6 %%7 %%8 %%9\r\n", TPL_DIR);
+    fprintf(f, "echo %%errorlevel%% > %s\r\n", g_rc_new);
+    return fclose(f) == 0;
+}
+
+/* Session (or long) template job: cd, CALL, then capture like any job */
+static int build_template_job(const char *name, const char *args)
+{
+    char path[96], rc_path[96];
+    FILE *f;
+
+    remove(g_job_bat);
+    remove_job_parts();
+    f = fopen(g_job_bat, "wt");
+    if (!f) return 0;
+    fputs("@echo off\r\n", f);
+    fputs("rem MBXSRV template job\r\n", f);
+    if (g_session) session_prologue(f);
+    sprintf(path, "%s\\%s.BAT", TPL_DIR, name);
+    if (g_session) home_path(rc_path, path);
+    else strcpy(rc_path, path);
+    fprintf(f, "call %s %s\r\n", rc_path, args);
+    if (g_session) home_path(rc_path, g_rc_new);
+    else strcpy(rc_path, g_rc_new);
+    fprintf(f, "echo %%errorlevel%% > %s\r\n", rc_path);
+    if (g_session) session_epilogue(f);
+    return fclose(f) == 0;
+}
+
+/* Run "RUN name args". Returns the system() result, or -1 with an error
+   already written to OUT.NEW. */
+static int run_template(const char *line)
+{
+    char name[16], path[32], job[MAX_LINE];
+    const char *args = line + 4;
+    size_t n = 0;
+
+    while (*args == ' ') args++;
+    while (args[n] && args[n] != ' ' && n < sizeof(name) - 1) { name[n] = (char)toupper((unsigned char)args[n]); n++; }
+    name[n] = 0;
+    args += n;
+    while (*args == ' ') args++;
+
+    remove(g_rc_new);
+    sprintf(path, "%s\\%s.BAT", TPL_DIR, name);
+    if (!template_name_ok(name) || !file_exists(path)) {
+        FILE *f = fopen(g_out_new, "wt");
+        if (f) { fprintf(f, "ERROR: no template %s\r\n", path); fclose(f); }
+        f = fopen(g_rc_new, "wt");
+        if (f) { fputs("1\r\n", f); fclose(f); }
+        return -1;
+    }
+
+    /* DOS command tails stop at 126 bytes: " /C MBXTPL.BAT name args >
+       OUT.NEW 2>&1" has to fit */
+    if (g_session || 4 + strlen(g_tpl_bat) + strlen(name) + strlen(args) + 5 + strlen(g_out_new) + 5 > 126) {
+        if (!build_template_job(name, args)) return -1;
+        timing_lap(&g_tim.build);
+        return exec_job_to_out(g_job_bat);
+    }
+    if (!file_exists(g_tpl_bat) && !write_template_wrapper()) return -1;
+    sprintf(job, "%s %s %s", g_tpl_bat, name, args);
+    timing_lap(&g_tim.build);
+    return exec_job_to_out(job);
+}
+
+/* ---- Serial transport (MBX_COM) ---- */
+
+#define UART_DATA 0
+#define UART_IER  1
+#define UART_FCR  2
+#define UART_LCR  3
+#define UART_MCR  4
+#define UART_LSR  5
+#define LSR_DR    0x01
+#define LSR_THRE  0x20
+
+static unsigned g_com = 0;    /* UART base port; 0 = serial transport off */
+
+/* 115200 8N1, FIFOs on, polled (no interrupts) */
+static void com_open(int port)
+{
+    g_com = (port == 2) ? 0x2F8 : 0x3F8;
+    outp(g_com + UART_IER, 0);
+    outp(g_com + UART_LCR, 0x80);     /* DLAB: divisor follows */
+    outp(g_com + UART_DATA, 1);
+    outp(g_com + UART_IER, 0);
+    outp(g_com + UART_LCR, 0x03);
+    outp(g_com + UART_FCR, 0x07);
+    outp(g_com + UART_MCR, 0x03);     /* DTR + RTS */
+}
+
+static int com_ready(void)
+{
+    return g_com && (inp(g_com + UART_LSR) & LSR_DR);
+}
+
+/* Next byte, or -1 after COM_BYTE_MS of silence */
+static int com_getc(void)
+{
+    unsigned waited = 0;
+
+    while (!(inp(g_com + UART_LSR) & LSR_DR)) {
+        if (waited++ >= COM_BYTE_MS) return -1;
+        ms_sleep(1);
+    }
+    return inp(g_com + UART_DATA);
+}
+
+static void com_putc(int c)
+{
+    while (!(inp(g_com + UART_LSR) & LSR_THRE))
+        ;
+    outp(g_com + UART_DATA, c);
+}
+
+static void com_puts(const char *s)
+{
+    while (*s) com_putc((unsigned char)*s++);
+}
+
+/* Send a file as one frame; a missing file goes out empty */
+static void com_send_file(const char *kind, const char *path)
+{
+    char hdr[32];
+    FILE *f = fopen(path, "rb");
+    long len = 0;
+    int c;
+
+    if (f) {
+        fseek(f, 0L, SEEK_END);
+        len = ftell(f);
+        fseek(f, 0L, SEEK_SET);
+    }
+    sprintf(hdr, "%s %ld\n", kind, len);
+    com_puts(hdr);
+    while (len-- > 0) {
+        c = fgetc(f);
+        com_putc(c == EOF ? ' ' : c);   /* length is promised; pad if cut short */
+    }
+    if (f) fclose(f);
+}
+
+/* Read a frame header "<KIND> <len>\n". Returns 1 if it parsed. */
+static int com_read_header(char *kind, long *len)
+{
+    char line[40];
+    size_t n = 0;
+    int c;
+
+    while ((c = com_getc()) != -1 && c != '\n') {
+        if (n + 1 < sizeof(line)) line[n++] = (char)c;
+    }
+    line[n] = 0;
+    if (c == -1) return 0;
+    return sscanf(line, "%15s %ld", kind, len) == 2 && *len >= 0;
+}
+
+/* Take a frame off the port. Returns 1 when a CMD frame has been written
+   to jf->run; PING is answered here and anything else is dropped. */
+static int com_poll(const struct job_files *jf)
+{
+    char kind[16];
+    long len;
+    FILE *f;
+    int c;
+
+    if (!com_ready()) return 0;
+    if (!com_read_header(kind, &len)) {
+        log_line("ERROR: bad serial frame header; resyncing");
+        while (com_ready()) (void)inp(g_com + UART_DATA);
+        return 0;
+    }
+
+    f = (stricmp(kind, "CMD") == 0) ? fopen(jf->run, "wb") : NULL;
+    while (len > 0) {
+        if ((c = com_getc()) == -1) break;
+        if (f) fputc(c, f);
+        len--;
+    }
+    if (f) fclose(f);
+
+    if (len > 0) {
+        log_line("ERROR: serial frame truncated");
+        remove(jf->run);
+        return 0;
+    }
+    if (stricmp(kind, "PING") == 0) com_puts("PONG 0\n");
+    else if (!f) logf2("Ignored serial frame ", kind);
+    return f != NULL;
+}
+
+/* Send a finished serial job's reply and drop the local copies */
+static void com_reply(const struct job_files *jf)
+{
+    com_send_file("OUT", jf->out);
+    com_send_file("RC", jf->rc);
+    remove(jf->out);
+    remove(jf->rc);
+}
+
+/* Sleep between polls, but wake as soon as a serial frame starts */
+static void idle_wait(unsigned ms)
+{
+    if (!g_com) { ms_sleep(ms); return; }
+    while (ms-- > 0 && !com_ready()) ms_sleep(1);
+}
+
+static int is_exit_cmd(const char *s)
+{
+    return (stricmp(s, "EXIT") == 0 || stricmp(s, "QUIT") == 0);
+}
+
+static int is_reset_cmd(const char *s)
+{
+    return stricmp(s, "RESET") == 0;
+}
+
+/* Reply to a control command with a one-line OUT and RC 0 */
+static void write_control_reply(const char *text, const struct job_files *jf)
+{
+    char rc[32];
+
+    if (g_req_id[0]) sprintf(rc, "ID %s\r\n0", g_req_id);
+    else strcpy(rc, "0");
+
+    if (jf->queued) {
+        write_text_atomic(g_rc_new, jf->rc, rc);
+        write_text_atomic(g_out_new, jf->out, text);
+    } else {
+        write_text_atomic(g_out_new, jf->out, text);
+        write_text_atomic(g_rc_new, jf->rc, rc);
+    }
+}
+
+/* Run one claimed job end to end. Returns 1 if the guest should exit. */
+static int process_job(const struct job_files *jf)
+{
+    char first[MAX_LINE];
+    char logbuf[200];
+    struct job_opts opts;
+    long payload_bytes = 0;
+    int sys_rc;
+
+    strncpy(g_job_id, jf->run, sizeof(g_job_id) - 1);
+    set_status("RUNNING");
+    read_job_opts(jf->run, &opts);
+    strcpy(g_req_id, opts.id);
+    g_job_res = opts.res;
+    g_job_timeout = opts.timeout;
+
+    /* Cancelled before we got to it */
+    if (cancel_waiting(g_req_id)) {
+        remove(g_out_new);
+        wd_report(RC_CANCEL, 0);
+        publish_results(RC_CANCEL, jf);
+        remove(jf->run);
+        set_status("READY");
+        return 0;
+    }
+
+    if (!read_first_nonempty_line(jf->run, first, sizeof(first))) {
+        log_line("ERROR: CMD.RUN empty");
+        write_error_output("CMD file is empty", jf);
+        remove(jf->run);
+        set_status("READY");
+        return 0;
+    }
+
+    if (is_exit_cmd(first)) {
+        log_line("Received EXIT/QUIT");
+        write_control_reply("MBXSRV BYE", jf);
+        remove(jf->run);
+        set_status("BYE");
+        return 1;
+    }
+
+    if (is_reset_cmd(first)) {
+        log_line("Received RESET");
+        if (g_session) session_reset();
+        write_control_reply(g_session ? "MBXSRV session reset" : "MBXSRV session mode is off", jf);
+        remove(jf->run);
+        set_status("READY");
+        return 0;
+    }
+
+    if (is_xfer_cmd(first)) {
+        logf2("Transfer: ", first);
+        timing_lap(&g_tim.build);
+        run_transfer(jf->run, first);
+        timing_lap(&g_tim.exec);
+        publish_results(0, jf);
+        remove(jf->run);
+        set_status("READY");
+        return 0;
+    }
+
+    if (is_run_cmd(first)) {
+        logf2("Template: ", first);
+        g_tim.payload = (long)strlen(first);
+        sys_rc = run_template(first);
+        timing_lap(&g_tim.exec);
+        if (sys_rc >= 0 && g_session) session_capture();
+        if (sys_rc >= 0 && opts.pack >= 0) pack_output(opts.pack);
+        publish_results(sys_rc < 0 ? 1 : sys_rc, jf);
+        remove(jf->run);
+        set_status("READY");
+        return 0;
+    }
+
+    /* Session jobs that only CD/SET skip the shell entirely (batches need
+       the shell for their markers) */
+    if (g_session && !opts.batch && session_run_builtins(jf->run)) {
+        sprintf(logbuf, "Applied %s in session (cwd=%s)", jf->run, g_cwd);
+        log_line(logbuf);
+        publish_results(0, jf);
+        remove(jf->run);
+        set_status("READY");
+        return 0;
+    }
+
+    /* Build job bat */
+    if (!build_job_bat_from_cmd(jf->run, &opts, &payload_bytes)) {
+        g_tim.payload = payload_bytes;
+        sprintf(logbuf, "ERROR: build_job_bat failed (payload=%ld, errno=%d)", payload_bytes, errno);
+        log_line(logbuf);
+        write_error_output("Failed to build MBXJOB.BAT (file error or out of disk space)", jf);
+        remove(jf->run);
+        set_status("READY");
+        return 0;
+    }
+
+    g_tim.payload = payload_bytes;
+    timing_lap(&g_tim.build);
+
+    sprintf(logbuf, "Executing %s (payload=%ld bytes)", jf->run, payload_bytes);
+    log_line(logbuf);
+
+    /* Clean old published files to reduce confusion */
+    remove(jf->out);
+    remove(jf->rc);
+    if (jf->res[0]) remove(jf->res);
+
+    /* Execute */
+    sys_rc = exec_job_to_out(g_job_bat);
+    timing_lap(&g_tim.exec);
+    sprintf(logbuf, "system() rc=%d", sys_rc);
+    log_line(logbuf);
+
+    if (opts.pack >= 0) pack_output(opts.pack);
+
+    if (g_session) session_capture();
+
+    publish_results(sys_rc, jf);
+
+    remove(jf->run);
+    set_status("READY");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    long poll_max = env_long("MBX_POLL_MAX", POLL_MAX_MS, 10, 2000);
+    long poll_min = env_long("MBX_POLL_MIN", POLL_MIN_MS, 1, 2000);
+    long poll_decay = env_long("MBX_POLL_DECAY", POLL_DECAY_PCT, 101, 1000);
+    long poll_ms;
+    char logbuf[120];
+    struct job_files classic;
+    struct job_files qjob;
+    struct job_files sjob;
+    int seq;
+
+    /* Optional: allow polling interval as argv[1] */
+    if (argc >= 2) {
+        int v = atoi(argv[1]);
+        if (v >= 10 && v <= 2000) poll_max = v;
+    }
+    if (poll_min > poll_max) poll_min = poll_max;
+    poll_ms = poll_max;
+
+    worker_init();
+    strcpy(classic.run, g_cmd_run);
+    strcpy(classic.out, OUT_TXT);
+    strcpy(classic.rc, RC_TXT);
+    strcpy(classic.res, RES_TXT);
+    classic.queued = 0;
+
+    strcpy(sjob.run, g_ser_run);
+    strcpy(sjob.out, g_ser_out);
+    strcpy(sjob.rc, g_ser_rc);
+    sjob.res[0] = 0;
+    sjob.queued = 0;
+
+    {
+        const char *opt = getenv("MBX_SESSION");
+        g_session = (opt && opt[0] == '1');
+        opt = getenv("MBX_COM");
+        if (opt && (opt[0] == '1' || opt[0] == '2')) com_open(opt[0] - '0');
+        opt = getenv("MBX_RES");
+        g_res_ok = !(opt && opt[0] == '0');
+        opt = getenv("MBX_NOSTATUS");
+        g_status_quiet = (opt && opt[0] == '1');
+        /* A heartbeat needs true states, so MBX_BEAT overrides MBX_NOSTATUS */
+        g_beat_ms = env_long("MBX_BEAT", g_status_quiet ? 0 : 2000, 0, 60000);
+        if (g_beat_ms > 0) g_status_quiet = 0;
+        if (g_beat_ms > 0 && g_beat_ms < poll_max) g_beat_ms = poll_max; /* we only beat between polls */
+    }
+    log_open();
+
+    crc32_init();
+    wd_init();
+    write_template_wrapper();
+    log_line("MBXSRV starting");
+    if (g_wid[0]) logf2("Worker ", g_wid);
+    if (g_session) {
+        session_start();
+        logf2("Session mode on; home=", g_home);
+    }
+    if (g_com) {
+        sprintf(logbuf, "Serial transport on port %03Xh", g_com);
+        log_line(logbuf);
+    }
+    set_status("READY");
+
+    /* Crash recovery: if our CMD.RUN exists, process it */
+    if (file_exists(g_cmd_run)) {
+        logf2("Found stale claim; will process ", g_cmd_run);
+    }
+    requeue_stale_runs();
+
+    sprintf(logbuf, "Poll interval %ld..%ld ms (+%ld%% per idle tick)", poll_min, poll_max, poll_decay - 100);
+    log_line(logbuf);
+
+    for (;;) {
+        /* Let ESC stop the server locally */
+        if (kbhit()) {
+            int ch = getch();
+            if (ch == 27) { /* ESC */
+                log_line("ESC pressed; exiting");
+                set_status("BYE");
+                break;
+            }
+        }
+
+        /* If no CMD.RUN, try to claim CMD.TXT */
+        timing_start();
+        if (!file_exists(g_cmd_run) && file_exists(CMD_TXT)) {
+            if (claim_cmd()) {
+                timing_lap(&g_tim.claim);
+                logf2("Claimed CMD.TXT -> ", g_cmd_run);
+            }
+        }
+
+        /* If we have CMD.RUN, process it */
+        if (file_exists(g_cmd_run)) {
+            if (process_job(&classic)) break;
+            poll_ms = poll_min;
+        } else if ((seq = next_queued()) != 0 && claim_queued(seq, &qjob)) {
+            /* Queued job; go straight back for the next one */
+            timing_lap(&g_tim.claim);
+            if (process_job(&qjob)) break;
+            poll_ms = poll_min;
+            continue;
+        } else if (seq != 0) {
+            /* Another worker took it; there may be more right behind */
+            poll_ms = poll_min;
+        } else if (com_poll(&sjob)) {
+            int stop;
+
+            timing_lap(&g_tim.claim);
+            stop = process_job(&sjob);
+            com_reply(&sjob);
+            if (stop) break;
+            poll_ms = poll_min;
+            continue;
+        } else if (poll_ms < poll_max) {
+            /* Idle: back off toward the long interval */
+            poll_ms = poll_ms * poll_decay / 100;
+            if (poll_ms <= poll_min) poll_ms = poll_min + 1;
+            if (poll_ms >= poll_max) {
+                poll_ms = poll_max;
+                sprintf(logbuf, "Idle; poll interval %ld ms", poll_ms);
+                log_line(logbuf);
+            }
         }
 
-        ms_sleep((unsigned)idle_ms);
+        /* Nothing to do this tick: a good moment for the log write */
+        log_flush();
+        heartbeat();
+        idle_wait((unsigned)poll_ms);
     }
 
     log_line("MBXSRV stopped");
+    log_flush();
     return 0;
 }
@@ -0,0 +1,3131 @@
+// host-lib.cpp - implementation of host-lib.h.
+#include "host-lib.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <regex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#pragma comment(lib, "ws2_32.lib")
+#elif defined(__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+#define MBX_HAVE_KQUEUE 1
+#include <fcntl.h>
+#include <sys/event.h>
+#include <unistd.h>
+#endif
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+extern char** environ;
+#endif
+
+namespace mbx {
+
+// Mailbox files are small and read or written whole, so they go through
+// unbuffered stdio: one read()/write() per call and no stream buffer to
+// allocate, which matters in the wait loop.
+static std::FILE* openRaw(const fs::path& p, bool write) {
+#if defined(_WIN32)
+    std::FILE* f = _wfopen(p.c_str(), write ? L"wb" : L"rb");
+#else
+    std::FILE* f = std::fopen(p.c_str(), write ? "wb" : "rb");
+#endif
+    if (f) std::setvbuf(f, nullptr, _IONBF, 0);
+    return f;
+}
+
+static bool seekRaw(std::FILE* f, std::uintmax_t offset) {
+#if defined(_WIN32)
+    return _fseeki64(f, static_cast<__int64>(offset), SEEK_SET) == 0;
+#else
+    return fseeko(f, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+}
+
+// Up to `cap` bytes from the start of `p`, or -1 if it can't be opened.
+static long readHead(const fs::path& p, char* buf, size_t cap) {
+    std::FILE* f = openRaw(p, false);
+    if (!f) return -1;
+    const size_t n = std::fread(buf, 1, cap, f);
+    std::fclose(f);
+    return static_cast<long>(n);
+}
+
+std::string readFileText(const fs::path& p) {
+    std::FILE* f = openRaw(p, false);
+    if (!f) throw std::runtime_error("Failed to open: " + p.string());
+    // Sized from one stat; the loop only runs if the file grew meanwhile.
+    std::error_code ec;
+    const auto size = fs::file_size(p, ec);
+    std::string s(ec ? 0 : static_cast<size_t>(size), '\0');
+    size_t n = std::fread(s.data(), 1, s.size(), f);
+    s.resize(n);
+    if (n == static_cast<size_t>(size) || ec) {
+        char more[4096];
+        while ((n = std::fread(more, 1, sizeof(more), f)) > 0) s.append(more, n);
+    }
+    std::fclose(f);
+    return s;
+}
+
+void writeFileText(const fs::path& p, const std::string& s) {
+    std::FILE* f = openRaw(p, true);
+    if (!f) throw std::runtime_error("Failed to write: " + p.string());
+    const bool ok = std::fwrite(s.data(), 1, s.size(), f) == s.size();
+    if (std::fclose(f) != 0 || !ok) throw std::runtime_error("Failed while writing: " + p.string());
+}
+
+std::optional<fs::file_time_type> mtimeIfExists(const fs::path& p) {
+    std::error_code ec;
+    if (!fs::exists(p, ec) || ec) return std::nullopt;
+    auto t = fs::last_write_time(p, ec);
+    if (ec) return std::nullopt;
+    return t;
+}
+
+void safeRemove(const fs::path& p) {
+    std::error_code ec;
+    fs::remove(p, ec);
+}
+
+void safeRename(const fs::path& from, const fs::path& to) {
+    // Cross-platform atomic-ish rename semantics:
+    // - POSIX: rename over existing is atomic.
+    // - Windows: rename fails if destination exists.
+    std::error_code ec;
+
+#if defined(_WIN32)
+    // Remove destination first (Windows friendliness)
+    fs::remove(to, ec); // ignore errors
+#endif
+
+    fs::rename(from, to, ec);
+    if (ec) {
+        // If rename failed, try a copy+remove fallback (less ideal, but robust).
+        ec.clear();
+        fs::copy_file(from, to, fs::copy_options::overwrite_existing, ec);
+        if (ec) throw std::runtime_error("Failed to move " + from.string() + " -> " + to.string() +
+                                         " (rename/copy failed)");
+        fs::remove(from, ec); // ignore
+    }
+}
+
+class DirWatcher::Impl {
+public:
+    explicit Impl(const fs::path& dir) {
+#if defined(_WIN32)
+        h_ = CreateFileW(dir.wstring().c_str(), FILE_LIST_DIRECTORY,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                         OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+        if (h_ == INVALID_HANDLE_VALUE) return;
+        ev_ = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        if (!ev_ || !arm()) close();
+#elif defined(__linux__)
+        fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd_ < 0) return;
+        if (inotify_add_watch(fd_, dir.c_str(), IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB) < 0) close();
+#elif defined(MBX_HAVE_KQUEUE)
+#ifdef O_EVTONLY
+        dfd_ = open(dir.c_str(), O_EVTONLY);
+#else
+        dfd_ = open(dir.c_str(), O_RDONLY);
+#endif
+        if (dfd_ < 0) return;
+        fd_ = kqueue();
+        if (fd_ < 0) { close(); return; }
+        struct kevent kev;
+        EV_SET(&kev, dfd_, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE | NOTE_ATTRIB, 0, nullptr);
+        if (kevent(fd_, &kev, 1, nullptr, 0, nullptr) < 0) close();
+#else
+        (void)dir;
+#endif
+    }
+
+    ~Impl() { close(); }
+
+    bool active() const {
+#if defined(_WIN32)
+        return h_ != INVALID_HANDLE_VALUE;
+#else
+        return fd_ >= 0;
+#endif
+    }
+
+    bool wait(std::chrono::milliseconds d) {
+        if (!active()) {
+            std::this_thread::sleep_for(d);
+            return false;
+        }
+#if defined(_WIN32)
+        if (WaitForSingleObject(ev_, static_cast<DWORD>(d.count())) != WAIT_OBJECT_0) return false;
+        DWORD n = 0;
+        GetOverlappedResult(h_, &ov_, &n, FALSE);
+        if (!arm()) close();
+        return true;
+#elif defined(__linux__)
+        struct pollfd pfd = {fd_, POLLIN, 0};
+        if (poll(&pfd, 1, static_cast<int>(d.count())) <= 0) return false;
+        // Drain; the caller re-checks the files it cares about.
+        alignas(struct inotify_event) char buf[4096];
+        while (read(fd_, buf, sizeof(buf)) > 0) {}
+        return true;
+#elif defined(MBX_HAVE_KQUEUE)
+        struct timespec ts;
+        ts.tv_sec = static_cast<time_t>(d.count() / 1000);
+        ts.tv_nsec = static_cast<long>((d.count() % 1000) * 1000000);
+        struct kevent out;
+        return kevent(fd_, nullptr, 0, &out, 1, &ts) > 0;
+#else
+        return false;
+#endif
+    }
+
+private:
+#if defined(_WIN32)
+    bool arm() {
+        ResetEvent(ev_);
+        ZeroMemory(&ov_, sizeof(ov_));
+        ov_.hEvent = ev_;
+        return ReadDirectoryChangesW(h_, buf_, sizeof(buf_), FALSE,
+                                     FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE,
+                                     nullptr, &ov_, nullptr) != 0;
+    }
+
+    void close() {
+        if (h_ != INVALID_HANDLE_VALUE) { CancelIo(h_); CloseHandle(h_); h_ = INVALID_HANDLE_VALUE; }
+        if (ev_) { CloseHandle(ev_); ev_ = nullptr; }
+    }
+
+    HANDLE h_ = INVALID_HANDLE_VALUE;
+    HANDLE ev_ = nullptr;
+    OVERLAPPED ov_{};
+    DWORD buf_[1024];
+#else
+    void close() {
+        if (fd_ >= 0) { ::close(fd_); fd_ = -1; }
+#if defined(MBX_HAVE_KQUEUE)
+        if (dfd_ >= 0) { ::close(dfd_); dfd_ = -1; }
+#endif
+    }
+
+    int fd_ = -1;
+#if defined(MBX_HAVE_KQUEUE)
+    int dfd_ = -1;
+#endif
+#endif
+};
+
+DirWatcher::DirWatcher(const fs::path& dir) : impl_(std::make_unique<Impl>(dir)) {}
+DirWatcher::~DirWatcher() = default;
+bool DirWatcher::active() const { return impl_->active(); }
+bool DirWatcher::wait(std::chrono::milliseconds d) { return impl_->wait(d); }
+
+class MappedFile::Impl {
+public:
+    Impl(const fs::path& p, bool removeAfter) {
+#if defined(_WIN32)
+        file_ = CreateFileW(p.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN | (removeAfter ? FILE_FLAG_DELETE_ON_CLOSE : 0),
+                            nullptr);
+        if (file_ == INVALID_HANDLE_VALUE) throw std::runtime_error("Failed to open: " + p.string());
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file_, &size)) { close(); throw std::runtime_error("Failed to stat: " + p.string()); }
+        size_ = static_cast<size_t>(size.QuadPart);
+        if (size_ == 0) return;
+        map_ = CreateFileMappingW(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (map_) data_ = static_cast<const char*>(MapViewOfFile(map_, FILE_MAP_READ, 0, 0, 0));
+        if (!data_) { close(); throw std::runtime_error("Failed to map: " + p.string()); }
+#else
+        fd_ = open(p.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd_ < 0) throw std::runtime_error("Failed to open: " + p.string());
+        if (removeAfter) unlink(p.c_str());
+        struct stat st;
+        if (fstat(fd_, &st) != 0) { close(); throw std::runtime_error("Failed to stat: " + p.string()); }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ == 0) return;
+        void* v = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+        if (v == MAP_FAILED) { close(); throw std::runtime_error("Failed to map: " + p.string()); }
+        data_ = static_cast<const char*>(v);
+        madvise(v, size_, MADV_SEQUENTIAL);
+#endif
+    }
+
+    ~Impl() { close(); }
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+    std::uintmax_t writeToStdout() const {
+        std::fflush(stdout);
+        size_t done = 0;
+#if defined(_WIN32)
+        HANDLE out = GetStdHandle(STD_OUTPUT_HANDLE);
+        while (done < size_) {
+            // Consoles reject very large writes, so go in kStreamChunk pieces.
+            DWORD n = 0;
+            const DWORD want = static_cast<DWORD>(std::min(size_ - done, kStreamChunk));
+            if (!WriteFile(out, data_ + done, want, &n, nullptr) || n == 0) {
+                throw std::runtime_error("Failed to write to stdout");
+            }
+            done += n;
+        }
+#else
+#if defined(__linux__)
+        off_t off = 0;
+        while (done < size_) {
+            const ssize_t n = sendfile(STDOUT_FILENO, fd_, &off, size_ - done);
+            if (n <= 0) break; // e.g. EINVAL for an O_APPEND stdout; write() the rest
+            done += static_cast<size_t>(n);
+        }
+#endif
+        while (done < size_) {
+            const ssize_t n = write(STDOUT_FILENO, data_ + done, size_ - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) throw std::runtime_error("Failed to write to stdout");
+            done += static_cast<size_t>(n);
+        }
+#endif
+        return done;
+    }
+
+private:
+    void close() {
+#if defined(_WIN32)
+        if (data_) UnmapViewOfFile(data_);
+        if (map_) CloseHandle(map_);
+        if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+        file_ = INVALID_HANDLE_VALUE;
+        map_ = nullptr;
+#else
+        if (data_) munmap(const_cast<char*>(data_), size_);
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = -1;
+#endif
+        data_ = nullptr;
+    }
+
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+#if defined(_WIN32)
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE map_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+};
+
+MappedFile::MappedFile() = default;
+MappedFile::MappedFile(const fs::path& p, bool removeAfter) : impl_(std::make_unique<Impl>(p, removeAfter)) {}
+MappedFile::~MappedFile() = default;
+MappedFile::MappedFile(MappedFile&&) noexcept = default;
+MappedFile& MappedFile::operator=(MappedFile&&) noexcept = default;
+const char* MappedFile::data() const { return impl_ ? impl_->data() : nullptr; }
+size_t MappedFile::size() const { return impl_ ? impl_->size() : 0; }
+std::uintmax_t MappedFile::writeToStdout() const { return impl_ ? impl_->writeToStdout() : 0; }
+
+MailboxPaths pathsFromDir(const fs::path& dir) {
+    MailboxPaths m;
+    m.dir = dir;
+    m.cmd_new = dir / "CMD.NEW";
+    m.cmd_txt = dir / "CMD.TXT";
+    m.out_new = dir / "OUT.NEW";
+    m.out_txt = dir / "OUT.TXT";
+    m.rc_txt  = dir / "RC.TXT";
+    m.res_txt = dir / "RES.TXT";
+    m.sta_txt = dir / "STA.TXT";
+    m.cancel_txt = dir / "CANCEL.TXT";
+    return m;
+}
+
+void appendJobDirectives(std::string& text, const MailboxPaths& m) {
+    if (m.job_timeout.count() <= 0) return;
+    char num[24];
+    const auto end = std::to_chars(num, num + sizeof(num), m.job_timeout.count()).ptr;
+    text.append(kTimeoutDirective).append(" ").append(num, end).append("\r\n");
+}
+
+void cancelJob(const MailboxPaths& m, std::string_view tag) {
+    const fs::path staging = m.dir / "CANCEL.NEW";
+    writeFileText(staging, std::string(tag) + "\r\n");
+    safeRename(staging, m.cancel_txt);
+}
+
+bool awaitCancel(const MailboxPaths& m, std::chrono::milliseconds wait, std::chrono::milliseconds poll) {
+    const auto deadline = std::chrono::steady_clock::now() + wait;
+    std::error_code ec;
+    while (fs::exists(m.cancel_txt, ec)) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+            safeRemove(m.cancel_txt);
+            return false;
+        }
+        std::this_thread::sleep_for(poll);
+    }
+    return true;
+}
+
+static bool isBlank(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+
+std::optional<int> parseReturnCode(std::string_view s) {
+    // RC.TXT is expected to contain a number, possibly with whitespace/newlines.
+    if (s.compare(0, 3, "ID ") == 0) {
+        const size_t nl = s.find('\n');
+        if (nl == std::string_view::npos) return std::nullopt;
+        s.remove_prefix(nl + 1);
+    }
+    size_t i = 0;
+    while (i < s.size() && isBlank(s[i])) i++;
+    if (i < s.size() && s[i] == '+') i++;
+    int v;
+    const auto [end, err] = std::from_chars(s.data() + i, s.data() + s.size(), v);
+    if (err != std::errc() || end == s.data() + i) return std::nullopt;
+    return v;
+}
+
+// The tag of "ID <tag>", as a view into s.
+static std::optional<std::string_view> requestIdOf(std::string_view s) {
+    if (s.compare(0, 3, "ID ") != 0) return std::nullopt;
+    const size_t end = s.find_first_of(" \r\n", 3);
+    return s.substr(3, end == std::string_view::npos ? std::string_view::npos : end - 3);
+}
+
+std::optional<std::string> parseRequestId(std::string_view s) {
+    if (auto id = requestIdOf(s)) return std::string(*id);
+    return std::nullopt;
+}
+
+std::optional<GuestTiming> parseGuestTiming(std::string_view s) {
+    const size_t at = s.find("TIM ");
+    if (at == std::string_view::npos) return std::nullopt;
+
+    GuestTiming t;
+    std::string_view line = s.substr(at + 4);
+    line = line.substr(0, line.find_first_of("\r\n"));
+    while (!line.empty()) {
+        size_t n = 0;
+        while (n < line.size() && !isBlank(line[n])) n++;
+        const std::string_view kv = line.substr(0, n);
+        line.remove_prefix(n < line.size() ? n + 1 : n);
+        const size_t eq = kv.find('=');
+        if (eq == std::string_view::npos) continue;
+        const std::string_view key = kv.substr(0, eq);
+        long v = 0;
+        std::from_chars(kv.data() + eq + 1, kv.data() + kv.size(), v);
+        if (key == "claim") t.claim_ms = v;
+        else if (key == "build") t.build_ms = v;
+        else if (key == "exec") t.exec_ms = v;
+        else if (key == "publish") t.publish_ms = v;
+        else if (key == "payload") t.payload = v;
+        else if (key == "out") t.out = v;
+        else if (key == "packed") t.packed = v;
+        else if (key == "res") t.res_ms = v;
+    }
+    return t;
+}
+
+bool isPacked(const std::string& head) {
+    return head.compare(0, sizeof(kPackMagic) - 1, kPackMagic) == 0;
+}
+
+// LZSS as written by MBXSRV: a flag byte per eight items (low bit first),
+// 0 = literal byte, 1 = "dddddddd ddddllll" with distance-1 over a 4 KB
+// window and length-3, where length code 15 takes one more length byte.
+std::uintmax_t unpack(std::istream& in, const OutputSink& sink) {
+    constexpr size_t kWindow = 4096;
+    unsigned char head[kPackHeader];
+    if (!in.read(reinterpret_cast<char*>(head), kPackHeader) ||
+        !isPacked(std::string(reinterpret_cast<const char*>(head), sizeof(kPackMagic) - 1))) {
+        throw std::runtime_error("Packed output: bad header");
+    }
+    auto le32 = [&](size_t at) {
+        return std::uint32_t(head[at]) | std::uint32_t(head[at + 1]) << 8 | std::uint32_t(head[at + 2]) << 16 |
+               std::uint32_t(head[at + 3]) << 24;
+    };
+    const std::uintmax_t size = le32(8);
+    const std::uint32_t want = le32(12);
+
+    // Decoded bytes collect behind the last kWindow bytes of history and go
+    // to the sink whenever the buffer fills.
+    std::vector<char> out(kWindow + kStreamChunk);
+    size_t n = 0, sent = 0;
+    std::uintmax_t total = 0;
+    std::uint32_t crc = 0;
+    auto emit = [&] {
+        if (n == sent) return;
+        crc = crc32(out.data() + sent, n - sent, crc);
+        sink(out.data() + sent, n - sent);
+        sent = n;
+    };
+    auto put = [&](char c) {
+        if (n == out.size()) {
+            emit();
+            std::copy(out.end() - kWindow, out.end(), out.begin());
+            n = sent = kWindow;
+        }
+        out[n++] = c;
+        total++;
+    };
+    auto* sb = in.rdbuf();
+    auto get = [&] {
+        const auto c = sb->sbumpc();
+        if (c == std::char_traits<char>::eof()) throw std::runtime_error("Packed output: truncated");
+        return static_cast<unsigned>(static_cast<unsigned char>(c));
+    };
+
+    while (total < size) {
+        const unsigned flags = get();
+        for (int bit = 0; bit < 8 && total < size; bit++) {
+            if (!(flags & (1u << bit))) {
+                put(static_cast<char>(get()));
+                continue;
+            }
+            const unsigned b0 = get(), b1 = get();
+            const size_t dist = ((b0 << 4) | (b1 >> 4)) + 1;
+            size_t len = (b1 & 15) + 3;
+            if ((b1 & 15) == 15) len += get();
+            if (dist > n) throw std::runtime_error("Packed output: bad match distance");
+            while (len-- > 0 && total < size) put(out[n - dist]);
+        }
+    }
+    emit();
+    if (crc != want) throw std::runtime_error("Packed output: CRC mismatch");
+    return size;
+}
+
+// Read a published OUT file into r.out (or `sink`), unpacking it if needed.
+static void readOutput(const fs::path& p, std::uintmax_t offset, Reply& r, const OutputSink& sink) {
+    std::ifstream in(p, std::ios::binary);
+    if (!in) throw std::runtime_error("Failed to open: " + p.string());
+    in.seekg(static_cast<std::streamoff>(offset));
+    char head[sizeof(kPackMagic) - 1];
+    in.read(head, sizeof(head));
+    const auto got = static_cast<size_t>(in.gcount());
+    in.clear();
+    in.seekg(static_cast<std::streamoff>(offset));
+    if (isPacked(std::string(head, got))) {
+        if (sink) unpack(in, sink);
+        else unpack(in, [&](const char* data, size_t len) { r.out.append(data, len); });
+        return;
+    }
+    if (sink) {
+        std::vector<char> buf(kStreamChunk);
+        while (in.read(buf.data(), static_cast<std::streamsize>(buf.size())) || in.gcount() > 0) {
+            sink(buf.data(), static_cast<size_t>(in.gcount()));
+        }
+        return;
+    }
+    std::ostringstream ss;
+    ss << in.rdbuf();
+    r.out = ss.str();
+}
+
+static void parseRcText(std::string_view text, Reply& r) {
+    r.rc = parseReturnCode(text);
+    r.guest = parseGuestTiming(text);
+}
+
+static void readReturnCode(const fs::path& p, Reply& r) {
+    parseRcText(readFileText(p), r);
+}
+
+// A tag for one classic job: random per process, so a reply left over from
+// another mbxhost run can't match, then counting up.
+static std::string nextRequestId() {
+    static std::atomic<std::uint32_t> next{[] {
+        std::random_device rd;
+        return static_cast<std::uint32_t>(rd());
+    }()};
+    char tag[9];
+    std::snprintf(tag, sizeof(tag), "%08X", static_cast<unsigned>(next++));
+    return tag;
+}
+
+// What the wait loop reads each tick: the start of RC.TXT or RES.TXT, which
+// for most replies is the whole file.
+constexpr size_t kReplyHead = 4096;
+
+// If `p` starts with our tag, parse it into `r` and return the bytes read
+// (the whole of any normal RC.TXT). The guest publishes it with a rename, so
+// a file we can read is complete.
+static long readTaggedRc(const fs::path& p, std::string_view id, char* buf, Reply& r) {
+    const long n = readHead(p, buf, kReplyHead);
+    if (n <= 0 || requestIdOf({buf, static_cast<size_t>(n)}) != id) return 0;
+    parseRcText({buf, static_cast<size_t>(n)}, r);
+    return n;
+}
+
+// Like readTaggedRc for RES.TXT: parses its header and returns the header's
+// size; `whole` is set if the output is in `buf` too (the file was shorter
+// than kReplyHead).
+static std::uintmax_t readTaggedRes(const fs::path& p, std::string_view id, char* buf, Reply& r,
+                                    std::optional<std::string_view>& whole) {
+    const long n = readHead(p, buf, kReplyHead);
+    if (n <= 0) return 0;
+    const std::string_view text(buf, static_cast<size_t>(n));
+    if (requestIdOf(text) != id || text.find("\nLEN ") == std::string_view::npos) return 0;
+    size_t end = text.find("\n\r\n");
+    if (end != std::string_view::npos) end += 3;
+    else if ((end = text.find("\n\n")) != std::string_view::npos) end += 2;
+    else return 0;
+    parseRcText(text.substr(0, end), r);
+    if (static_cast<size_t>(n) < kReplyHead) whole = text.substr(end);
+    return end;
+}
+
+// Forward bytes [offset, EOF) of `p` to `sink` through `buf`; returns the new
+// offset. The file is reopened on every call, so we never hold a handle that
+// would block the guest's rename on Windows.
+static std::uintmax_t streamFileFrom(const fs::path& p, std::uintmax_t offset,
+                                     const OutputSink& sink, std::vector<char>& buf) {
+    std::error_code ec;
+    const auto size = fs::file_size(p, ec);
+    if (ec || size == offset) return offset;
+    // Shorter than what we've sent: not the file we were tailing, start over.
+    if (size < offset) offset = 0;
+    std::FILE* f = openRaw(p, false);
+    if (!f) return offset;
+    if (seekRaw(f, offset)) {
+        size_t n;
+        while ((n = std::fread(buf.data(), 1, buf.size(), f)) > 0) {
+            sink(buf.data(), n);
+            offset += n;
+        }
+    }
+    std::fclose(f);
+    return offset;
+}
+
+// Counts a round trip that ends in an exception as a failure in Metrics,
+// unless it was settled first (a reply, or a timeout counted as such).
+struct Tally {
+    const fs::path& mailbox;
+    bool settled = false;
+    ~Tally() {
+        if (!settled) Metrics::global().failed(mailbox);
+    }
+    void replied(const Reply& r) {
+        settled = true;
+        Metrics::global().replied(mailbox, r);
+    }
+    void timedOut() {
+        settled = true;
+        Metrics::global().timedOut(mailbox);
+    }
+};
+
+// One classic round trip. `tail`, if set, gets OUT.NEW as it grows; once
+// RC.TXT (or RES.TXT) shows our tag, `collect(r, from, offset, whole)` takes
+// the published output: `from` is OUT.TXT or RES.TXT, `offset` where the
+// output starts there plus the bytes already tailed, and `whole`, if set,
+// the rest of a RES.TXT already read. Each tick costs a stat of CMD.TXT
+// until it is claimed and one small read of the reply file, without heap
+// allocations.
+template <typename Collect>
+static Reply roundTrip(const MailboxPaths& m,
+                       const std::string& job,
+                       std::chrono::milliseconds timeout,
+                       std::chrono::milliseconds poll,
+                       DirWatcher* watch,
+                       const OutputSink& tail,
+                       const Collect& collect) {
+    // With a watcher we sleep until the folder changes; without one, poll.
+    const bool watching = watch && watch->active();
+    auto pause = [&](std::chrono::milliseconds d) {
+        if (watching) watch->wait(d);
+        else std::this_thread::sleep_for(d);
+    };
+
+    Tally tally{m.dir};
+
+    // Don't wait out the timeout on a guest that is evidently gone.
+    if (auto why = guestDown(m)) throw GuestDown(*why);
+
+    const auto t0 = std::chrono::steady_clock::now();
+    HostTiming timing;
+
+    // Clean stale CMD files (host-side). Be conservative: remove only CMD.NEW.
+    safeRemove(m.cmd_new);
+
+    // Write CMD.NEW then rename to CMD.TXT
+    const std::string id = nextRequestId();
+    std::string text;
+    text.reserve(std::char_traits<char>::length(kIdDirective) + id.size() +
+                 std::char_traits<char>::length(kResDirective) +
+                 std::char_traits<char>::length(kTimeoutDirective) + 24 + job.size() + 8);
+    text.append(kIdDirective).append(" ").append(id).append("\r\n");
+    if (m.combined) text.append(kResDirective).append("\r\n");
+    appendJobDirectives(text, m);
+    text.append(job).append("\r\n");
+    writeFileText(m.cmd_new, text);
+    safeRename(m.cmd_new, m.cmd_txt);
+    Metrics::global().sent(m.dir, text.size());
+
+    auto start = std::chrono::steady_clock::now();
+    timing.write = start - t0;
+
+    std::vector<char> buf;
+    std::uintmax_t sent = 0;
+    bool claimed = false;
+    auto checked = start;
+    if (tail) buf.resize(kStreamChunk);
+    char head[kReplyHead];
+    Reply r;
+
+    // Wait for OUT.TXT (and optionally RC.TXT) to update
+    while (true) {
+        if (!claimed) {
+            std::error_code ec;
+            claimed = !fs::exists(m.cmd_txt, ec);
+            if (claimed) timing.claim = std::chrono::steady_clock::now() - t0 - timing.write;
+        }
+
+        // Until the job is claimed, a guest that stops beating won't take it.
+        if (!claimed && std::chrono::steady_clock::now() - checked >= kWatchRecheck) {
+            checked = std::chrono::steady_clock::now();
+            if (auto why = guestDown(m)) {
+                std::error_code ec;
+                if (fs::remove(m.cmd_txt, ec)) throw GuestDown(*why);
+            }
+        }
+
+        // Tail the in-progress output once the guest has claimed the job.
+        if (tail) {
+            if (claimed) {
+                const auto before = sent;
+                sent = streamFileFrom(m.out_new, sent, tail, buf);
+                if (sent != before) start = std::chrono::steady_clock::now();
+            }
+        }
+
+        if (m.combined) {
+            std::optional<std::string_view> whole;
+            if (const auto at = readTaggedRes(m.res_txt, id, head, r, whole)) {
+                if (whole && sent) whole->remove_prefix(std::min<size_t>(whole->size(), sent));
+                collect(r, m.res_txt, at + sent, whole);
+                r.host = timing;
+                r.host.total = std::chrono::steady_clock::now() - t0;
+                tally.replied(r);
+                return r;
+            }
+        }
+
+        // RC.TXT is published last; once it carries our tag, OUT.TXT is ours too.
+        if (readTaggedRc(m.rc_txt, id, head, r)) {
+            collect(r, m.out_txt, sent, std::optional<std::string_view>());
+            r.host = timing;
+            r.host.total = std::chrono::steady_clock::now() - t0;
+            tally.replied(r);
+            return r;
+        }
+
+        if (std::chrono::steady_clock::now() - start > timeout) {
+            // Don't leave the job behind: withdraw it, or have the guest stop it.
+            static const char* const why = "Timeout waiting for OUT.TXT. Is MBXSRV running in the shared folder?";
+            std::error_code ec;
+            tally.timedOut();
+            if (fs::remove(m.cmd_txt, ec)) throw Withdrawn(why);
+            cancelJob(m, id);
+            throw std::runtime_error(why);
+        }
+
+        // Output growth doesn't raise folder events, so tail at the poll rate.
+        pause(watching && !tail ? kWatchRecheck : poll);
+    }
+}
+
+Reply sendCommandAndWait(const MailboxPaths& m,
+                         const std::string& command,
+                         std::chrono::milliseconds timeout,
+                         std::chrono::milliseconds poll,
+                         DirWatcher* watch,
+                         const OutputSink& sink,
+                         bool pack) {
+    if (pack) {
+        // No tailing: OUT.NEW may yet be replaced by its packed form.
+        return roundTrip(m, std::string(kPackDirective) + "\r\n" + command, timeout, poll, watch, nullptr,
+                         [&](Reply& r, const fs::path& from, std::uintmax_t offset, std::optional<std::string_view>) {
+                             readOutput(from, offset, r, sink);
+                         });
+    }
+    return roundTrip(m, command, timeout, poll, watch, sink,
+                     [&](Reply& r, const fs::path& from, std::uintmax_t offset,
+                         std::optional<std::string_view> whole) {
+                         if (whole) {
+                             if (sink) { if (!whole->empty()) sink(whole->data(), whole->size()); }
+                             else r.out.assign(*whole);
+                         } else if (offset == 0 && !sink) {
+                             r.out = readFileText(from);
+                         } else {
+                             std::vector<char> buf(kStreamChunk);
+                             if (sink) streamFileFrom(from, offset, sink, buf);
+                             else streamFileFrom(from, offset, [&](const char* data, size_t len) { r.out.append(data, len); },
+                                                 buf);
+                         }
+                     });
+}
+
+// Words that mark the lines worth keeping in a build or test log.
+constexpr const char* kErrorPattern = "(^|[^a-z])(error|warning|fatal|fail|failed|failure)([^a-z]|$)";
+
+class OutputFilter::Impl {
+public:
+    Impl(const FilterOptions& o, OutputSink pass) : pass_(std::move(pass)) {
+        auto flags = std::regex::ECMAScript | std::regex::optimize;
+        if (o.icase) flags |= std::regex::icase;
+        auto compile = [&](std::vector<std::regex>& to, const std::vector<std::string>& from) {
+            for (const auto& p : from) {
+                try {
+                    to.emplace_back(p, flags);
+                } catch (const std::regex_error& e) {
+                    throw std::runtime_error("Bad filter pattern: " + p + " (" + e.what() + ")");
+                }
+            }
+        };
+        compile(include_, o.include);
+        compile(exclude_, o.exclude);
+        if (o.errors) include_.emplace_back(kErrorPattern, std::regex::ECMAScript | std::regex::optimize | std::regex::icase);
+
+        // Share each limit out between the two ends.
+        auto split = [&](std::uintmax_t limit, std::uintmax_t& head, std::uintmax_t& tail) {
+            if (limit == 0) {
+                head = tail = std::numeric_limits<std::uintmax_t>::max();
+                return;
+            }
+            head = o.keep == FilterOptions::Keep::Head ? limit : o.keep == FilterOptions::Keep::Tail ? 0 : (limit + 1) / 2;
+            tail = limit - head;
+        };
+        split(o.max_lines, headLines_, tailLines_);
+        split(o.max_bytes, headBytes_, tailBytes_);
+    }
+
+    void feed(const char* data, size_t len) {
+        bytes_ += len;
+        while (len) {
+            const auto* nl = static_cast<const char*>(std::memchr(data, '\n', len));
+            size_t take = nl ? static_cast<size_t>(nl - data) + 1 : len;
+            const size_t room = kStreamChunk - pending_.size();
+            const bool ends = (nl && take <= room) || take >= room;
+            take = std::min(take, room);
+            if (!ends) {
+                pending_.append(data, take);
+            } else if (pending_.empty()) {
+                line(data, take); // the usual case: straight from the caller's buffer
+            } else {
+                pending_.append(data, take);
+                line(pending_.data(), pending_.size());
+                pending_.clear();
+            }
+            data += take;
+            len -= take;
+        }
+    }
+
+    std::string finish() {
+        if (!pending_.empty()) {
+            line(pending_.data(), pending_.size());
+            pending_.clear();
+        }
+        std::string rest;
+        if (omittedLines_) {
+            rest = "[... " + std::to_string(omittedLines_) + " lines, " + std::to_string(omittedBytes_) +
+                   " bytes omitted ...]\r\n";
+        }
+        for (const auto& l : tail_) rest += l;
+        kept_ += tail_.size();
+        tail_.clear();
+        if (pass_) {
+            if (!rest.empty()) pass_(rest.data(), rest.size());
+            return {};
+        }
+        return head_ + rest;
+    }
+
+    size_t lines_ = 0, kept_ = 0, omittedLines_ = 0;
+    std::uintmax_t bytes_ = 0;
+
+private:
+    bool wanted(const char* p, const char* end) const {
+        bool keep = include_.empty();
+        for (const auto& re : include_) {
+            if (std::regex_search(p, end, re)) {
+                keep = true;
+                break;
+            }
+        }
+        if (!keep) return false;
+        for (const auto& re : exclude_) {
+            if (std::regex_search(p, end, re)) return false;
+        }
+        return true;
+    }
+
+    void line(const char* p, size_t n) {
+        lines_++;
+        size_t text = n;
+        while (text && (p[text - 1] == '\n' || p[text - 1] == '\r')) text--;
+        if (!wanted(p, p + text)) return;
+
+        if (headOpen_ && headLinesUsed_ < headLines_ && headBytesUsed_ + n <= headBytes_) {
+            headLinesUsed_++;
+            headBytesUsed_ += n;
+            kept_++;
+            if (pass_) pass_(p, n);
+            else head_.append(p, n);
+            return;
+        }
+        headOpen_ = false; // later lines can only make the tail
+        if (tailLines_ == 0 || n > tailBytes_) {
+            omittedLines_++;
+            omittedBytes_ += n;
+            return;
+        }
+        tail_.emplace_back(p, n);
+        tailBytesUsed_ += n;
+        while (tail_.size() > tailLines_ || tailBytesUsed_ > tailBytes_) {
+            omittedLines_++;
+            omittedBytes_ += tail_.front().size();
+            tailBytesUsed_ -= tail_.front().size();
+            tail_.pop_front();
+        }
+    }
+
+    OutputSink pass_;
+    std::vector<std::regex> include_, exclude_;
+    std::uintmax_t headLines_ = 0, tailLines_ = 0, headBytes_ = 0, tailBytes_ = 0;
+    bool headOpen_ = true;
+    std::uintmax_t headLinesUsed_ = 0, headBytesUsed_ = 0, tailBytesUsed_ = 0, omittedBytes_ = 0;
+    std::string pending_, head_;
+    std::deque<std::string> tail_;
+};
+
+OutputFilter::OutputFilter(const FilterOptions& o, OutputSink pass)
+    : impl_(std::make_unique<Impl>(o, std::move(pass))) {}
+OutputFilter::~OutputFilter() = default;
+
+void OutputFilter::feed(const char* data, size_t len) { impl_->feed(data, len); }
+std::string OutputFilter::finish() { return impl_->finish(); }
+size_t OutputFilter::lines() const { return impl_->lines_; }
+size_t OutputFilter::kept() const { return impl_->kept_; }
+size_t OutputFilter::omitted() const { return impl_->omittedLines_; }
+std::uintmax_t OutputFilter::bytes() const { return impl_->bytes_; }
+
+MappedReply sendCommandMapped(const MailboxPaths& m,
+                              const std::string& command,
+                              std::chrono::milliseconds timeout,
+                              std::chrono::milliseconds poll,
+                              DirWatcher* watch,
+                              bool keep) {
+    static std::atomic<unsigned> counter{0};
+    // The view must be the whole file, so this always takes OUT.TXT.
+    MailboxPaths plain = m;
+    plain.combined = false;
+    MappedReply mr;
+    Reply r = roundTrip(plain, command, timeout, poll, watch, nullptr,
+                        [&](Reply&, const fs::path&, std::uintmax_t, std::optional<std::string_view>) {
+        if (keep) {
+            mr.out = MappedFile(m.out_txt);
+            return;
+        }
+        // Take the file over, so the next job can publish OUT.TXT (on Windows
+        // it couldn't replace a mapped file) and the view stays ours.
+        const auto tag = std::chrono::steady_clock::now().time_since_epoch().count();
+        const fs::path mine = m.dir / ("OUT-" + std::to_string(tag) + "-" + std::to_string(counter++) + ".MAP");
+        safeRename(m.out_txt, mine);
+        mr.out = MappedFile(mine, true);
+    });
+    mr.rc = r.rc;
+    mr.host = r.host;
+    mr.guest = r.guest;
+    return mr;
+}
+
+class SerialLink::Impl {
+public:
+#if defined(_WIN32)
+    using Socket = SOCKET;
+    static constexpr Socket kNoSocket = INVALID_SOCKET;
+#else
+    using Socket = int;
+    static constexpr Socket kNoSocket = -1;
+#endif
+
+    Impl(const std::string& addr, std::chrono::milliseconds timeout) : addr_(addr) {
+#if defined(_WIN32)
+        WSADATA wsa;
+        if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) throw std::runtime_error("WSAStartup failed");
+#endif
+        const size_t colon = addr.rfind(':');
+        const std::string host = colon == std::string::npos ? "127.0.0.1" : addr.substr(0, colon);
+        const std::string port = colon == std::string::npos ? addr : addr.substr(colon + 1);
+
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* res = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || !res) {
+            throw std::runtime_error("cannot resolve " + addr);
+        }
+        for (addrinfo* ai = res; ai && fd_ == kNoSocket; ai = ai->ai_next) {
+            fd_ = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd_ == kNoSocket) continue;
+            if (connect(fd_, ai->ai_addr, static_cast<int>(ai->ai_addrlen)) != 0) closeSocket();
+        }
+        freeaddrinfo(res);
+        if (fd_ == kNoSocket) throw std::runtime_error("cannot connect to " + addr);
+
+        int one = 1;
+        setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&one), sizeof(one));
+
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        sendAll("PING 0\n");
+        std::string kind;
+        size_t len = 0;
+        if (!readHeader(kind, len, deadline) || kind != "PONG") {
+            closeSocket();
+            throw std::runtime_error("no MBXSRV answering on " + addr);
+        }
+    }
+
+    ~Impl() {
+        closeSocket();
+#if defined(_WIN32)
+        WSACleanup();
+#endif
+    }
+
+    const std::string& address() const { return addr_; }
+
+    Reply send(const std::string& command, std::chrono::milliseconds timeout, const OutputSink& sink, bool pack) {
+        const auto t0 = std::chrono::steady_clock::now();
+        const auto deadline = t0 + timeout;
+        const std::string payload = (pack ? std::string(kPackDirective) + "\r\n" : std::string()) + command + "\r\n";
+
+        Tally tally{label_};
+        Reply r;
+        sendAll("CMD " + std::to_string(payload.size()) + "\n" + payload);
+        Metrics::global().sent(label_, payload.size());
+        r.host.write = std::chrono::steady_clock::now() - t0;
+
+        std::string kind;
+        size_t len = 0;
+        while (true) {
+            if (!readHeader(kind, len, deadline)) break;
+            std::string body = readBytes(len, deadline);
+            if (kind == "OUT" && isPacked(body)) {
+                std::istringstream in(body);
+                if (sink) unpack(in, sink);
+                else unpack(in, [&](const char* data, size_t n) { r.out.append(data, n); });
+            } else if (kind == "OUT") {
+                if (sink) sink(body.data(), body.size());
+                else r.out = std::move(body);
+            } else if (kind == "RC") {
+                r.rc = parseReturnCode(body);
+                r.guest = parseGuestTiming(body);
+                r.host.total = std::chrono::steady_clock::now() - t0;
+                tally.replied(r);
+                return r;
+            }
+        }
+        tally.timedOut();
+        throw std::runtime_error("Timeout waiting for a reply on serial link " + addr_ +
+                                 ". Is MBXSRV running with MBX_COM set?");
+    }
+
+private:
+    void closeSocket() {
+        if (fd_ == kNoSocket) return;
+#if defined(_WIN32)
+        closesocket(fd_);
+#else
+        close(fd_);
+#endif
+        fd_ = kNoSocket;
+    }
+
+    void sendAll(const std::string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            const auto n = ::send(fd_, data.data() + sent, static_cast<int>(data.size() - sent), 0);
+            if (n <= 0) throw std::runtime_error("serial link " + addr_ + ": send failed");
+            sent += static_cast<size_t>(n);
+        }
+    }
+
+    // Append whatever arrives before `deadline` to buf_; false on timeout.
+    bool fill(std::chrono::steady_clock::time_point deadline) {
+        const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now());
+        if (left.count() <= 0) return false;
+#if defined(_WIN32)
+        WSAPOLLFD pfd{fd_, POLLRDNORM, 0};
+        if (WSAPoll(&pfd, 1, static_cast<INT>(left.count())) <= 0) return false;
+#else
+        pollfd pfd{fd_, POLLIN, 0};
+        if (poll(&pfd, 1, static_cast<int>(left.count())) <= 0) return false;
+#endif
+        char chunk[4096];
+        const auto n = recv(fd_, chunk, sizeof(chunk), 0);
+        if (n <= 0) throw std::runtime_error("serial link " + addr_ + " closed");
+        buf_.append(chunk, static_cast<size_t>(n));
+        return true;
+    }
+
+    bool readHeader(std::string& kind, size_t& len, std::chrono::steady_clock::time_point deadline) {
+        size_t nl;
+        while ((nl = buf_.find('\n')) == std::string::npos) {
+            if (!fill(deadline)) return false;
+        }
+        std::istringstream iss(buf_.substr(0, nl));
+        buf_.erase(0, nl + 1);
+        kind.clear();
+        len = 0;
+        iss >> kind >> len;
+        return !kind.empty();
+    }
+
+    std::string readBytes(size_t len, std::chrono::steady_clock::time_point deadline) {
+        while (buf_.size() < len) {
+            if (!fill(deadline)) {
+                throw std::runtime_error("serial link " + addr_ + ": reply truncated");
+            }
+        }
+        std::string body = buf_.substr(0, len);
+        buf_.erase(0, len);
+        return body;
+    }
+
+    std::string addr_;
+    fs::path label_ = "serial:" + addr_; // its Metrics mailbox
+    Socket fd_ = kNoSocket;
+    std::string buf_;
+};
+
+SerialLink::SerialLink(const std::string& addr, std::chrono::milliseconds timeout)
+    : impl_(std::make_unique<Impl>(addr, timeout)) {}
+SerialLink::~SerialLink() = default;
+const std::string& SerialLink::address() const { return impl_->address(); }
+Reply SerialLink::send(const std::string& command, std::chrono::milliseconds timeout, const OutputSink& sink,
+                       bool pack) {
+    return impl_->send(command, timeout, sink, pack);
+}
+
+std::vector<Reply> splitBatchOutput(const std::string& out, size_t count) {
+    std::vector<Reply> replies(count);
+    const size_t markerLen = std::char_traits<char>::length(kBatchMarker);
+    size_t pos = 0, start = 0, done = 0;
+
+    while ((pos = out.find(kBatchMarker, pos)) != std::string::npos) {
+        size_t eol = out.find('\n', pos);
+        if (eol == std::string::npos) eol = out.size();
+
+        // Only a marker line, and only the next command's: a command's own
+        // output may contain "@MBX@ n rc" too, and must not move replies.
+        std::istringstream iss(out.substr(pos + markerLen, eol - pos - markerLen));
+        int n, rc;
+        if ((pos > 0 && out[pos - 1] != '\n') || !(iss >> n >> rc) || static_cast<size_t>(n) != done + 1) {
+            pos += markerLen;
+            continue;
+        }
+
+        // Everything since the previous marker is command n's output.
+        Reply& r = replies[n - 1];
+        r.out.append(out, start, pos - start);
+        r.rc = rc;
+        start = pos = (eol < out.size()) ? eol + 1 : eol;
+        done = static_cast<size_t>(n);
+    }
+
+    // Output after the last marker (the job stopped early) belongs to the next command.
+    if (start < out.size() && done < count) replies[done].out.append(out, start, std::string::npos);
+    return replies;
+}
+
+std::vector<Reply> submitBatch(const MailboxPaths& m,
+                               const std::vector<std::string>& commands,
+                               std::chrono::milliseconds timeout,
+                               std::chrono::milliseconds poll,
+                               DirWatcher* watch) {
+    if (commands.empty()) return {};
+
+    std::string job = kBatchDirective;
+    for (const auto& c : commands) {
+        if (c.empty() || c.find_first_of("\r\n") != std::string::npos) {
+            throw std::runtime_error("Batch commands must be single, non-empty lines");
+        }
+        job += "\r\n";
+        job += c;
+    }
+
+    auto r = sendCommandAndWait(m, job, timeout, poll, watch);
+    return splitBatchOutput(r.out, commands.size());
+}
+
+fs::path queueFile(const MailboxPaths& m, const char* stem, int seq) {
+    char name[16];
+    std::snprintf(name, sizeof(name), "%s.%03d", stem, seq);
+    return m.dir / name;
+}
+
+CommandQueue::~CommandQueue() {
+    for (const auto& [seq, job] : inflight_) {
+        std::error_code ec;
+        fs::remove(queueFile(m_, "CMD", seq), ec);
+    }
+}
+
+int CommandQueue::submit(const std::string& command) {
+    if (auto why = guestDown(m_)) throw GuestDown(*why);
+    const int seq = next_;
+    next_ = next_ % kQueueMax + 1;
+    const auto t0 = std::chrono::steady_clock::now();
+
+    // Replies are removed once read; anything left is from an old session.
+    safeRemove(queueFile(m_, "OUT", seq));
+    safeRemove(queueFile(m_, "RC", seq));
+
+    const fs::path staging = m_.dir / "CMDQ.NEW";
+    safeRemove(staging);
+    std::string id = nextRequestId();
+    std::string text;
+    text.append(kIdDirective).append(" ").append(id).append("\r\n");
+    appendJobDirectives(text, m_);
+    writeFileText(staging, text.append(command).append("\r\n"));
+    safeRename(staging, queueFile(m_, "CMD", seq));
+    Metrics::global().sent(m_.dir, text.size());
+    inflight_[seq] = {t0, std::chrono::steady_clock::now() - t0, std::move(id)};
+    return seq;
+}
+
+Reply CommandQueue::wait(int seq, std::chrono::milliseconds timeout, std::chrono::milliseconds poll) {
+    const fs::path out = queueFile(m_, "OUT", seq);
+    const fs::path rc = queueFile(m_, "RC", seq);
+    const bool watching = watch_ && watch_->active();
+    const auto start = std::chrono::steady_clock::now();
+
+    while (true) {
+        std::error_code ec;
+        if (fs::exists(out, ec)) {
+            Reply r;
+            readOutput(out, 0, r, nullptr);
+            if (fs::exists(rc, ec)) readReturnCode(rc, r);
+            safeRemove(out);
+            safeRemove(rc);
+            // Queued jobs aren't watched for their claim; total includes time spent queued.
+            auto it = inflight_.find(seq);
+            if (it != inflight_.end()) {
+                r.host.write = it->second.write;
+                r.host.total = std::chrono::steady_clock::now() - it->second.start;
+                inflight_.erase(it);
+            }
+            Metrics::global().replied(m_.dir, r);
+            return r;
+        }
+
+        if (std::chrono::steady_clock::now() - start > timeout) {
+            // As in roundTrip: take the job back, or have the guest stop it,
+            // so a reused sequence number can't pick up its reply later.
+            auto it = inflight_.find(seq);
+            if (!fs::remove(queueFile(m_, "CMD", seq), ec) && it != inflight_.end()) cancelJob(m_, it->second.id);
+            if (it != inflight_.end()) inflight_.erase(it);
+            Metrics::global().timedOut(m_.dir);
+            throw std::runtime_error("Timeout waiting for " + out.filename().string() +
+                                     ". Is MBXSRV running in the shared folder?");
+        }
+
+        if (watching) watch_->wait(kWatchRecheck);
+        else std::this_thread::sleep_for(poll);
+    }
+}
+
+static std::string templateName(const std::string& name) {
+    const bool ok = !name.empty() && name.size() <= 8 &&
+                    std::all_of(name.begin(), name.end(), [](unsigned char c) {
+                        return std::isalnum(c) || c == '_' || c == '-';
+                    });
+    if (!ok) throw std::runtime_error("Bad template name (1-8 letters, digits, _ or -): " + name);
+    std::string up = name;
+    for (auto& c : up) c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+    return up;
+}
+
+// A script as stored in TPL\: CR LF line ends, and a final one.
+static std::string templateText(const std::string& script) {
+    std::string bat;
+    for (size_t i = 0; i < script.size(); i++) {
+        if (script[i] == '\n' && (i == 0 || script[i - 1] != '\r')) bat += '\r';
+        bat += script[i];
+    }
+    if (!bat.empty() && bat.back() != '\n') bat += "\r\n";
+    return bat;
+}
+
+void registerTemplate(const MailboxPaths& m, const std::string& name, const std::string& script) {
+    const std::string up = templateName(name);
+    const std::string bat = templateText(script);
+
+    const fs::path dir = m.dir / "TPL";
+    fs::create_directories(dir);
+    const fs::path tmp = dir / (up + ".NEW");
+    writeFileText(tmp, bat);
+    safeRename(tmp, dir / (up + ".BAT"));
+}
+
+std::string templateCommand(const std::string& name, const std::vector<std::string>& args) {
+    if (args.size() > kTemplateArgsMax) {
+        throw std::runtime_error("Template " + name + ": at most " + std::to_string(kTemplateArgsMax) + " arguments");
+    }
+    std::string cmd = "RUN " + templateName(name);
+    for (const auto& a : args) {
+        if (a.empty() || a.find_first_of(" \t\r\n") != std::string::npos) {
+            throw std::runtime_error("Template " + name + ": arguments must be single words");
+        }
+        cmd += " " + a;
+    }
+    return cmd;
+}
+
+std::string guestState(const MailboxPaths& m) {
+    std::ifstream in(m.dir / "STA.TXT", std::ios::binary);
+    std::string state;
+    if (in) in >> state;
+    return state;
+}
+
+GuestStatus guestStatus(const MailboxPaths& m) {
+    GuestStatus st;
+    fs::path other;
+    const fs::path& p = m.sta_txt.empty() ? (other = m.dir / "STA.TXT") : m.sta_txt;
+    char buf[256];
+    const long n = readHead(p, buf, sizeof(buf));
+    if (n <= 0) return st;
+
+    std::string_view text(buf, static_cast<size_t>(n));
+    bool first = true;
+    while (!text.empty()) {
+        size_t k = 0;
+        while (k < text.size() && isBlank(text[k])) k++;
+        text.remove_prefix(k);
+        k = 0;
+        while (k < text.size() && !isBlank(text[k])) k++;
+        const std::string_view word = text.substr(0, k);
+        text.remove_prefix(k);
+        if (word.empty()) break;
+        if (first) { st.state = word; first = false; continue; }
+        const size_t eq = word.find('=');
+        if (eq == std::string_view::npos) continue;
+        const std::string_view key = word.substr(0, eq), value = word.substr(eq + 1);
+        long v = 0;
+        std::from_chars(value.data(), value.data() + value.size(), v);
+        if (key == "beat") st.beat = v;
+        else if (key == "every") st.every = std::chrono::milliseconds(v);
+        else if (key == "job") st.job = value;
+    }
+    std::error_code ec;
+    const auto t = fs::last_write_time(p, ec);
+    if (!ec) st.age = std::chrono::duration_cast<std::chrono::milliseconds>(fs::file_time_type::clock::now() - t);
+    return st;
+}
+
+std::optional<std::string> guestDown(const MailboxPaths& m) {
+    const GuestStatus st = guestStatus(m);
+    if (st.state == "BYE") return "MBXSRV has stopped (STA.TXT says BYE)";
+    if (st.state == "READY" && st.beat >= 0 && st.every.count() > 0 &&
+        st.age > kBeatMisses * st.every + kBeatSlack) {
+        return "MBXSRV heartbeat stalled (STA.TXT last written " + std::to_string(st.age.count()) +
+               " ms ago, every " + std::to_string(st.every.count()) + " ms expected)";
+    }
+    return std::nullopt;
+}
+
+std::string bootConfig(const MailboxPaths& m, const ProvisionOptions& o) {
+    std::string conf = "# Written by mbxhost --provision; replaced on every run.\n";
+    for (const auto& line : o.config) conf += line + "\n";
+    conf += "\n[autoexec]\n";
+    conf += "mount c \"" + fs::absolute(m.dir).string() + "\"\n";
+    conf += "c:\n";
+    for (const auto& line : o.autoexec) conf += line + "\n";
+    conf += "MBXSRV\n";
+    conf += "exit\n";
+    return conf;
+}
+
+namespace {
+
+// A DOSBox-X we started. It is left running when mbxhost exits.
+struct GuestProcess {
+#if defined(_WIN32)
+    HANDLE handle = nullptr;
+    DWORD pid = 0;
+#else
+    pid_t pid = 0;
+#endif
+    std::chrono::steady_clock::time_point start;
+    std::chrono::nanoseconds launch{};
+
+    GuestProcess() = default;
+    GuestProcess(const GuestProcess&) = delete;
+    GuestProcess& operator=(const GuestProcess&) = delete;
+    GuestProcess(GuestProcess&& o) noexcept { *this = std::move(o); }
+    GuestProcess& operator=(GuestProcess&& o) noexcept {
+#if defined(_WIN32)
+        std::swap(handle, o.handle);
+#endif
+        std::swap(pid, o.pid);
+        start = o.start;
+        launch = o.launch;
+        return *this;
+    }
+    ~GuestProcess() {
+#if defined(_WIN32)
+        if (handle) CloseHandle(handle);
+#endif
+    }
+
+    // False once the process has exited; `status` then holds its exit code.
+    bool running(int& status) {
+#if defined(_WIN32)
+        if (WaitForSingleObject(handle, 0) != WAIT_OBJECT_0) return true;
+        DWORD code = 0;
+        GetExitCodeProcess(handle, &code);
+        status = static_cast<int>(code);
+        return false;
+#else
+        int st = 0;
+        if (waitpid(pid, &st, WNOHANG) != pid) return true;
+        status = WIFEXITED(st) ? WEXITSTATUS(st) : 128 + WTERMSIG(st);
+        return false;
+#endif
+    }
+};
+
+bool hasMbxsrv(const fs::path& dir) {
+    std::error_code ec;
+    for (const auto& e : fs::directory_iterator(dir, ec)) {
+        std::string name = e.path().filename().string();
+        for (auto& c : name) c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+        if (name == "MBXSRV.EXE") return true;
+    }
+    return false;
+}
+
+// Write the config and start DOSBox-X on it, in its own process group so a
+// Ctrl-C meant for mbxhost doesn't reach it.
+GuestProcess launchGuest(const MailboxPaths& m, const ProvisionOptions& o) {
+    GuestProcess gp;
+    gp.start = std::chrono::steady_clock::now();
+
+    const GuestStatus st = guestStatus(m);
+    if (st.state == "RUNNING" || (st.state == "READY" && st.beat >= 0 && !guestDown(m))) {
+        throw std::runtime_error("A guest already serves " + m.dir.string() + " (STA.TXT says " + st.state +
+                                 "; remove it if that guest is gone)");
+    }
+    if (!o.mbxsrv.empty()) {
+        fs::copy_file(o.mbxsrv, m.dir / "MBXSRV.EXE", fs::copy_options::overwrite_existing);
+    } else if (!hasMbxsrv(m.dir)) {
+        throw std::runtime_error("No MBXSRV.EXE in " + m.dir.string() + " (copy it there, or pass it to provision)");
+    }
+
+    // READY must come from the guest we start, not a stale status file.
+    safeRemove(m.sta_txt);
+    safeRemove(m.cmd_txt);
+    const fs::path conf = m.dir / "MBXBOOT.CONF";
+    const fs::path log = m.dir / "MBXBOOT.LOG";
+    writeFileText(conf, bootConfig(m, o));
+
+    std::vector<std::string> argv{o.dosbox, "-conf", fs::absolute(conf).string()};
+    argv.insert(argv.end(), o.args.begin(), o.args.end());
+
+#if defined(_WIN32)
+    std::wstring cmdline;
+    for (const auto& a : argv) {
+        if (!cmdline.empty()) cmdline += L' ';
+        cmdline += L'"' + fs::path(a).wstring() + L'"';
+    }
+    SECURITY_ATTRIBUTES sa{sizeof(sa), nullptr, TRUE};
+    HANDLE out = CreateFileW(log.c_str(), GENERIC_WRITE, FILE_SHARE_READ, &sa, CREATE_ALWAYS,
+                             FILE_ATTRIBUTE_NORMAL, nullptr);
+    STARTUPINFOW si{};
+    si.cb = sizeof(si);
+    if (out != INVALID_HANDLE_VALUE) {
+        si.dwFlags = STARTF_USESTDHANDLES;
+        si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+        si.hStdOutput = si.hStdError = out;
+    }
+    PROCESS_INFORMATION pi{};
+    const BOOL ok = CreateProcessW(nullptr, cmdline.data(), nullptr, nullptr, TRUE, CREATE_NEW_PROCESS_GROUP,
+                                   nullptr, nullptr, &si, &pi);
+    if (out != INVALID_HANDLE_VALUE) CloseHandle(out);
+    if (!ok) throw std::runtime_error("Cannot start " + o.dosbox + " (error " + std::to_string(GetLastError()) + ")");
+    CloseHandle(pi.hThread);
+    gp.handle = pi.hProcess;
+    gp.pid = pi.dwProcessId;
+#else
+    std::vector<char*> args;
+    for (auto& a : argv) args.push_back(a.data());
+    args.push_back(nullptr);
+
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&fa, 1, log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    posix_spawn_file_actions_adddup2(&fa, 1, 2);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+    const int err = posix_spawnp(&gp.pid, o.dosbox.c_str(), &fa, &attr, args.data(), environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+    if (err != 0) throw std::runtime_error("Cannot start " + o.dosbox + ": " + std::strerror(err));
+#endif
+    gp.launch = std::chrono::steady_clock::now() - gp.start;
+    return gp;
+}
+
+ProvisionResult awaitGuest(const MailboxPaths& m, const ProvisionOptions& o, GuestProcess& gp) {
+    ProvisionResult r;
+    r.pid = static_cast<long>(gp.pid);
+    r.launch = gp.launch;
+
+    const auto deadline = gp.start + gp.launch + o.timeout;
+    while (guestState(m) != "READY") {
+        int status = 0;
+        if (!gp.running(status)) {
+            throw std::runtime_error(o.dosbox + " exited with status " + std::to_string(status) + " before " +
+                                     m.dir.string() + " was READY (see MBXBOOT.LOG there)");
+        }
+        if (std::chrono::steady_clock::now() > deadline) {
+            throw std::runtime_error("Timeout waiting for READY in " + m.dir.string() +
+                                     ". Does MBXBOOT.CONF start MBXSRV?");
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    r.ready = std::chrono::steady_clock::now() - gp.start;
+
+    if (!o.init.empty()) {
+        // Kept in TPL\ between runs; only an edited script is written again.
+        const fs::path tpl = m.dir / "TPL" / "INIT.BAT";
+        std::error_code ec;
+        if (!fs::exists(tpl, ec) || readFileText(tpl) != templateText(o.init)) registerTemplate(m, "INIT", o.init);
+        const auto t0 = std::chrono::steady_clock::now();
+        const Reply reply = sendCommandAndWait(m, templateCommand("INIT"), o.timeout);
+        r.init = std::chrono::steady_clock::now() - t0;
+        r.init_rc = reply.rc;
+    }
+    return r;
+}
+
+} // namespace
+
+ProvisionResult provisionGuest(const MailboxPaths& m, const ProvisionOptions& o) {
+    GuestProcess gp = launchGuest(m, o);
+    return awaitGuest(m, o, gp);
+}
+
+std::vector<ProvisionResult> provisionGuests(const std::vector<MailboxPaths>& guests, const ProvisionOptions& o) {
+    std::vector<GuestProcess> procs;
+    for (const auto& m : guests) procs.push_back(launchGuest(m, o));
+
+    // Boots overlap; each guest is waited for (and its INIT run) on its own thread.
+    std::vector<ProvisionResult> results(guests.size());
+    std::vector<std::exception_ptr> errors(guests.size());
+    std::vector<std::thread> waiters;
+    for (size_t i = 0; i < guests.size(); i++) {
+        waiters.emplace_back([&, i] {
+            try {
+                results[i] = awaitGuest(guests[i], o, procs[i]);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    for (auto& t : waiters) t.join();
+    for (auto& e : errors) {
+        if (e) std::rethrow_exception(e);
+    }
+    return results;
+}
+
+std::uint32_t crc32(const void* data, size_t len, std::uint32_t crc) {
+    static const auto table = [] {
+        std::vector<std::uint32_t> t(256);
+        for (std::uint32_t n = 0; n < 256; n++) {
+            std::uint32_t c = n;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+    const auto* p = static_cast<const unsigned char*>(data);
+    crc ^= 0xFFFFFFFFu;
+    while (len--) crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// CRC32 of the first `len` bytes of `p` (all of it if len is -1).
+static std::uint32_t fileCrc(const fs::path& p, std::intmax_t len = -1) {
+    std::ifstream in(p, std::ios::binary);
+    if (!in) throw std::runtime_error("Failed to open: " + p.string());
+    std::vector<char> buf(kStreamChunk);
+    std::uint32_t crc = 0;
+    while (len != 0 && in) {
+        auto want = static_cast<std::streamsize>(buf.size());
+        if (len > 0 && len < want) want = static_cast<std::streamsize>(len);
+        in.read(buf.data(), want);
+        const auto n = in.gcount();
+        if (n <= 0) break;
+        crc = crc32(buf.data(), static_cast<size_t>(n), crc);
+        if (len > 0) len -= n;
+    }
+    return crc;
+}
+
+static std::string hex32(std::uint32_t v) {
+    char s[9];
+    std::snprintf(s, sizeof(s), "%08X", static_cast<unsigned>(v));
+    return s;
+}
+
+// Lines of a transfer reply, split into words.
+static std::vector<std::vector<std::string>> replyLines(const std::string& out) {
+    std::vector<std::vector<std::string>> lines;
+    std::istringstream in(out);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream words(line);
+        std::vector<std::string> w;
+        std::string word;
+        while (words >> word) w.push_back(word);
+        if (!w.empty()) lines.push_back(std::move(w));
+    }
+    return lines;
+}
+
+static std::runtime_error transferError(const std::string& verb, const Reply& r) {
+    std::string msg = r.out;
+    while (!msg.empty() && (msg.back() == '\n' || msg.back() == '\r')) msg.pop_back();
+    return std::runtime_error(verb + " failed (rc " + (r.rc ? std::to_string(*r.rc) : "?") + "): " + msg);
+}
+
+static void removeChunks(const MailboxPaths& m, int count) {
+    for (int seq = 1; seq <= count; seq++) safeRemove(queueFile(m, "XFR", seq));
+}
+
+// Smallest chunk size >= o.chunk that fits `bytes` into kQueueMax chunk files.
+static std::uintmax_t chunkSize(const TransferOptions& o, std::uintmax_t bytes) {
+    const std::uintmax_t fit = (bytes + kQueueMax - 1) / kQueueMax;
+    return std::max<std::uintmax_t>(std::max<size_t>(o.chunk, 1), fit);
+}
+
+TransferResult putFile(const MailboxPaths& m, const fs::path& local, const std::string& guestPath,
+                       const TransferOptions& o) {
+    TransferResult res;
+    res.size = fs::file_size(local);
+    res.crc = fileCrc(local);
+
+    auto st = sendCommandAndWait(m, "STAT " + guestPath, o.timeout, o.poll, o.watch);
+    const auto stat = replyLines(st.out);
+    if (st.rc.value_or(1) != 0 || stat.empty() || stat[0].size() < 4 || stat[0][0] != "STAT") {
+        throw transferError("STAT " + guestPath, st);
+    }
+    const std::intmax_t guestSize = std::stoll(stat[0][1]);
+    if (guestSize == static_cast<std::intmax_t>(res.size) && std::stoul(stat[0][2], nullptr, 16) == res.crc) {
+        res.skipped = true;
+        return res;
+    }
+    std::uintmax_t from = std::stoull(stat[0][3]);
+    if (from > res.size) from = 0;
+
+    std::ifstream in(local, std::ios::binary);
+    if (!in) throw std::runtime_error("Failed to open: " + local.string());
+    std::vector<char> buf;
+
+    while (true) {
+        // Stage XFR.001.. for [from, size) and list them in the PUT job.
+        const std::uintmax_t chunk = chunkSize(o, res.size - from);
+        buf.resize(static_cast<size_t>(std::min<std::uintmax_t>(chunk, res.size - from)));
+        std::string job = "PUT " + std::to_string(res.size) + " " + hex32(res.crc) + " " +
+                          std::to_string(from) + " " + guestPath;
+        int count = 0;
+        in.clear();
+        in.seekg(static_cast<std::streamoff>(from));
+        for (std::uintmax_t off = from; off < res.size; off += chunk) {
+            const auto len = static_cast<size_t>(std::min<std::uintmax_t>(chunk, res.size - off));
+            in.read(buf.data(), static_cast<std::streamsize>(len));
+            if (static_cast<size_t>(in.gcount()) != len) throw std::runtime_error("Short read: " + local.string());
+            writeFileText(queueFile(m, "XFR", ++count), std::string(buf.data(), len));
+            job += "\r\n" + std::to_string(count) + " " + std::to_string(len) + " " + hex32(crc32(buf.data(), len));
+        }
+
+        Reply r;
+        try {
+            r = sendCommandAndWait(m, job, o.timeout, o.poll, o.watch);
+        } catch (...) {
+            removeChunks(m, count);
+            throw;
+        }
+        removeChunks(m, count);
+
+        std::uintmax_t resume = 0;
+        bool retry = false;
+        for (const auto& w : replyLines(r.out)) {
+            if (w[0] == "OK") {
+                res.chunks++;
+            } else if (w[0] == "DONE" && r.rc.value_or(1) == 0) {
+                res.moved += res.size - from;
+                return res;
+            } else if (w[0] == "BAD" && w.size() >= 3) {
+                resume = std::stoull(w[2]);
+                retry = true;
+            } else if (w[0] == "BADFILE" || w[0] == "RESTART") {
+                resume = 0;
+                retry = true;
+            }
+        }
+        if (!retry || res.retries >= o.retries) throw transferError("PUT " + guestPath, r);
+        res.moved += resume > from ? resume - from : 0;
+        res.retries++;
+        from = resume;
+    }
+}
+
+TransferResult getFile(const MailboxPaths& m, const std::string& guestPath, const fs::path& local,
+                       const TransferOptions& o) {
+    TransferResult res;
+    fs::path part = local;
+    part += ".part";
+
+    std::error_code ec;
+    std::intmax_t haveSize = -1;
+    std::uint32_t haveCrc = 0;
+    if (fs::exists(local, ec)) {
+        haveSize = static_cast<std::intmax_t>(fs::file_size(local));
+        haveCrc = fileCrc(local);
+    }
+    std::uintmax_t from = fs::exists(part, ec) ? fs::file_size(part) : 0;
+
+    while (true) {
+        if (from == 0) safeRemove(part);
+        const std::string job = "GET " + std::to_string(o.chunk) + " " + std::to_string(from) + " " +
+                                std::to_string(from == 0 ? haveSize : -1) + " " + hex32(haveCrc) + " " + guestPath;
+        Reply r = sendCommandAndWait(m, job, o.timeout, o.poll, o.watch);
+        const auto lines = replyLines(r.out);
+
+        int count = 0;
+        for (const auto& w : lines) if (w[0] == "CHUNK") count++;
+
+        bool restart = false, bad = false, more = false, done = false;
+        {
+            std::ofstream out(part, std::ios::binary | std::ios::app);
+            if (!out) {
+                removeChunks(m, count);
+                throw std::runtime_error("Failed to write: " + part.string());
+            }
+            for (const auto& w : lines) {
+                if (w[0] == "SAME" && w.size() >= 3) {
+                    res.skipped = true;
+                    res.size = std::stoull(w[1]);
+                    res.crc = static_cast<std::uint32_t>(std::stoul(w[2], nullptr, 16));
+                } else if (w[0] == "CHUNK" && w.size() >= 4 && !bad) {
+                    const fs::path chunk = queueFile(m, "XFR", std::stoi(w[1]));
+                    const std::string data = fs::exists(chunk, ec) ? readFileText(chunk) : std::string();
+                    if (data.size() != std::stoull(w[2]) ||
+                        crc32(data.data(), data.size()) != std::stoul(w[3], nullptr, 16)) {
+                        bad = true; // keep what we have; the next GET resumes here
+                        continue;
+                    }
+                    out.write(data.data(), static_cast<std::streamsize>(data.size()));
+                    from += data.size();
+                    res.moved += data.size();
+                    res.chunks++;
+                } else if (w[0] == "MORE") {
+                    more = true;
+                } else if (w[0] == "FILE" && w.size() >= 3) {
+                    res.size = std::stoull(w[1]);
+                    res.crc = static_cast<std::uint32_t>(std::stoul(w[2], nullptr, 16));
+                    done = true;
+                } else if (w[0] == "RESTART") {
+                    restart = true;
+                }
+            }
+        }
+        removeChunks(m, count);
+
+        if (res.skipped) {
+            safeRemove(part);
+            return res;
+        }
+        if (done && !bad) {
+            if (fs::file_size(part) == res.size && fileCrc(part) == res.crc) {
+                safeRename(part, local);
+                return res;
+            }
+            restart = true;
+        }
+        if (more && !bad) continue;
+        if (!(bad || restart) || res.retries >= o.retries) throw transferError("GET " + guestPath, r);
+        res.retries++;
+        if (restart) from = 0;
+    }
+}
+
+namespace {
+
+constexpr const char* kSyncManifest = "MBXSYNC.MAN";
+constexpr const char* kSyncManifestNew = "MBXSYNC.NEW";
+
+struct SyncFile {
+    std::string rel; // as on disk, '/'-separated
+    std::uintmax_t size = 0;
+    long long mtime = 0;
+};
+
+// One manifest line: the state both sides agreed on after the last sync.
+struct SyncEntry {
+    std::string local, shared;
+    std::uintmax_t size = 0;
+    long long lmtime = 0, smtime = 0;
+    std::uint32_t crc = 0;
+};
+
+std::string upperCase(std::string s) {
+    for (auto& c : s) c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+    return s;
+}
+
+long long ticks(fs::file_time_type t) {
+    return static_cast<long long>(t.time_since_epoch().count());
+}
+
+std::string parentOf(const std::string& rel) {
+    const size_t slash = rel.rfind('/');
+    return slash == std::string::npos ? std::string() : rel.substr(0, slash);
+}
+
+std::string leafOf(const std::string& rel) {
+    const size_t slash = rel.rfind('/');
+    return slash == std::string::npos ? rel : rel.substr(slash + 1);
+}
+
+std::string joinRel(const std::string& dir, const std::string& name) {
+    return dir.empty() ? name : dir + "/" + name;
+}
+
+// Copies in flight are staged as ~MSnnnnn.TMP beside their target.
+bool syncStaging(const std::string& name) {
+    return name.size() == 12 && name.compare(0, 3, "~MS") == 0 && name.compare(8, 4, ".TMP") == 0;
+}
+
+std::map<std::string, SyncFile> scanTree(const fs::path& root, bool shared) {
+    std::map<std::string, SyncFile> files;
+    std::error_code ec;
+    fs::recursive_directory_iterator it(root, fs::directory_options::skip_permission_denied, ec), end;
+    for (; !ec && it != end; it.increment(ec)) {
+        std::error_code fec;
+        if (!it->is_regular_file(fec)) continue;
+        SyncFile f;
+        f.rel = it->path().lexically_relative(root).generic_string();
+        if (syncStaging(leafOf(f.rel))) continue;
+        if (shared && (upperCase(f.rel) == kSyncManifest || upperCase(f.rel) == kSyncManifestNew)) continue;
+        f.size = it->file_size(fec);
+        f.mtime = ticks(it->last_write_time(fec));
+        if (fec) continue;
+        // Shared paths are matched the way the guest sees them: ignoring case.
+        std::string key = shared ? upperCase(f.rel) : f.rel;
+        files.emplace(std::move(key), std::move(f));
+    }
+    return files;
+}
+
+std::vector<SyncEntry> loadManifest(const fs::path& p) {
+    std::vector<SyncEntry> entries;
+    std::error_code ec;
+    if (!fs::exists(p, ec)) return entries;
+    std::istringstream in(readFileText(p));
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        // <size> <local mtime> <shared mtime> <crc> <local path>\t<shared path>
+        std::istringstream ls(line);
+        SyncEntry e;
+        std::string crc;
+        if (!(ls >> e.size >> e.lmtime >> e.smtime >> crc)) continue;
+        ls.get();
+        std::string rest;
+        std::getline(ls, rest);
+        const size_t tab = rest.find('\t');
+        if (tab == std::string::npos || tab == 0 || tab + 1 == rest.size()) continue;
+        e.crc = static_cast<std::uint32_t>(std::stoul(crc, nullptr, 16));
+        e.local = rest.substr(0, tab);
+        e.shared = rest.substr(tab + 1);
+        entries.push_back(std::move(e));
+    }
+    return entries;
+}
+
+void saveManifest(const fs::path& shared, std::vector<SyncEntry> entries) {
+    std::sort(entries.begin(), entries.end(), [](const SyncEntry& a, const SyncEntry& b) { return a.local < b.local; });
+    std::string text;
+    for (const auto& e : entries) {
+        text += std::to_string(e.size) + " " + std::to_string(e.lmtime) + " " + std::to_string(e.smtime) + " " +
+                hex32(e.crc) + " " + e.local + "\t" + e.shared + "\n";
+    }
+    writeFileText(shared / kSyncManifestNew, text);
+    safeRename(shared / kSyncManifestNew, shared / kSyncManifest);
+}
+
+bool dosChar(unsigned char c) {
+    return c < 0x80 && (std::isalnum(c) || std::strchr("!#$%&'()-@^_`{}~", c) != nullptr);
+}
+
+// Whether DOS can use `name` as it is, case aside.
+bool isShortName(const std::string& name) {
+    const size_t dot = name.find('.');
+    const size_t base = std::min(dot, name.size());
+    const size_t ext = dot == std::string::npos ? 0 : name.size() - dot - 1;
+    if (base == 0 || base > 8 || ext > 3 || (dot != std::string::npos && ext == 0)) return false;
+    for (size_t i = 0; i < name.size(); i++) {
+        if (i != dot && !dosChar(static_cast<unsigned char>(name[i]))) return false;
+    }
+    return true;
+}
+
+// Work out the shared (8.3) name of every local path and back. Names are
+// unique per shared directory, and chosen once: the manifest keeps them.
+class SyncNames {
+public:
+    // A pair from the manifest; its names are taken as they are.
+    void claim(const std::string& local, const std::string& shared) {
+        std::string l = local, s = shared;
+        while (!s.empty()) {
+            claimed_[upperCase(parentOf(s))].insert(upperCase(leafOf(s)));
+            if (!l.empty() && l != local) link(l, s);
+            l = parentOf(l);
+            s = parentOf(s);
+        }
+    }
+
+    // A file that exists in the shared tree; long names must steer clear of it.
+    void occupy(const std::string& shared) {
+        for (std::string s = shared; !s.empty(); s = parentOf(s)) {
+            occupied_[upperCase(parentOf(s))].emplace(upperCase(leafOf(s)), leafOf(s));
+        }
+    }
+
+    std::string sharedFor(const std::string& local) {
+        const std::string dir = sharedDir(parentOf(local));
+        return joinRel(dir, assign(dir, leafOf(local)));
+    }
+
+    // Files the guest created keep their names on the host.
+    std::string localFor(const std::string& shared) {
+        return joinRel(localDir(parentOf(shared)), leafOf(shared));
+    }
+
+private:
+    void link(const std::string& local, const std::string& shared) {
+        toShared_.emplace(local, shared);
+        toLocal_.emplace(upperCase(shared), local);
+    }
+
+    std::string sharedDir(const std::string& local) {
+        if (local.empty()) return local;
+        if (auto it = toShared_.find(local); it != toShared_.end()) return it->second;
+        const std::string parent = sharedDir(parentOf(local));
+        const std::string shared = joinRel(parent, assign(parent, leafOf(local)));
+        link(local, shared);
+        return shared;
+    }
+
+    std::string localDir(const std::string& shared) {
+        if (shared.empty()) return shared;
+        if (auto it = toLocal_.find(upperCase(shared)); it != toLocal_.end()) return it->second;
+        const std::string local = joinRel(localDir(parentOf(shared)), leafOf(shared));
+        claimed_[upperCase(parentOf(shared))].insert(upperCase(leafOf(shared)));
+        link(local, shared);
+        return local;
+    }
+
+    // A short name for `name` in shared directory `dir`: the name itself
+    // in upper case if that is valid 8.3, else BASE~N.EXT.
+    std::string assign(const std::string& dir, const std::string& name) {
+        auto& used = claimed_[upperCase(dir)];
+        auto& seen = occupied_[upperCase(dir)];
+        const std::string up = upperCase(name);
+        if (isShortName(name) && used.insert(up).second) {
+            // Match a file already there under any case.
+            auto it = seen.find(up);
+            return it != seen.end() ? it->second : up;
+        }
+
+        const size_t dot = name.rfind('.');
+        const bool hasExt = dot != std::string::npos && dot != 0;
+        std::string base, ext;
+        for (size_t i = 0; i < (hasExt ? dot : name.size()); i++) {
+            if (dosChar(static_cast<unsigned char>(name[i]))) base += up[i];
+        }
+        for (size_t i = hasExt ? dot + 1 : name.size(); i < name.size() && ext.size() < 3; i++) {
+            if (dosChar(static_cast<unsigned char>(name[i]))) ext += up[i];
+        }
+        if (base.empty()) base = "_";
+        for (int n = 1;; n++) {
+            const std::string tail = "~" + std::to_string(n);
+            std::string cand = base.substr(0, 8 - tail.size()) + tail;
+            if (!ext.empty()) cand += "." + ext;
+            if (!seen.count(cand) && used.insert(cand).second) return cand;
+        }
+    }
+
+    std::map<std::string, std::string> toShared_; // local dir -> shared dir
+    std::map<std::string, std::string> toLocal_;  // upper-case shared dir -> local dir
+    std::map<std::string, std::set<std::string>> claimed_;                     // names given out, per shared dir
+    std::map<std::string, std::map<std::string, std::string>> occupied_;      // upper-case -> on-disk name
+};
+
+enum class SyncAction { Unchanged, Push, Pull, DeleteLocal, DeleteShared, Drop };
+
+struct SyncPair {
+    SyncEntry e;          // names to use; the old state if `known`
+    bool known = false;
+    const SyncFile* l = nullptr;
+    const SyncFile* s = nullptr;
+
+    // Filled in by the worker that handles the pair.
+    SyncAction action = SyncAction::Unchanged;
+    bool conflict = false, failed = false;
+    std::uintmax_t bytes = 0;
+};
+
+// Copy `from` over `to` through a staging file beside it, keeping the
+// mtime; returns the CRC32 of what was copied.
+std::uint32_t syncCopy(const fs::path& from, const fs::path& to, size_t id) {
+    std::error_code ec;
+    fs::create_directories(to.parent_path(), ec);
+    char name[16];
+    std::snprintf(name, sizeof(name), "~MS%05u.TMP", static_cast<unsigned>(id % 100000));
+    const fs::path tmp = to.parent_path() / name;
+
+    std::uint32_t crc = 0;
+    {
+        std::ifstream in(from, std::ios::binary);
+        if (!in) throw std::runtime_error("Failed to open: " + from.string());
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out) throw std::runtime_error("Failed to write: " + tmp.string());
+        std::vector<char> buf(kStreamChunk);
+        while (in) {
+            in.read(buf.data(), static_cast<std::streamsize>(buf.size()));
+            const auto n = in.gcount();
+            if (n <= 0) break;
+            crc = crc32(buf.data(), static_cast<size_t>(n), crc);
+            out.write(buf.data(), n);
+        }
+        if (in.bad() || !out.flush()) {
+            out.close();
+            safeRemove(tmp);
+            throw std::runtime_error("Failed while copying: " + from.string() + " -> " + to.string());
+        }
+    }
+    fs::last_write_time(tmp, fs::last_write_time(from), ec);
+    safeRename(tmp, to);
+    return crc;
+}
+
+void syncPair(SyncPair& p, size_t id, const fs::path& localRoot, const fs::path& sharedRoot, bool dryRun) {
+    const fs::path lp = localRoot / fs::path(p.e.local);
+    const fs::path sp = sharedRoot / fs::path(p.s ? p.s->rel : p.e.shared);
+    SyncEntry& e = p.e;
+
+    // A side has changed if its size or mtime moved since the last sync;
+    // a touched file of the old size is checked against the old CRC.
+    auto changed = [&](const SyncFile* f, long long seen, const fs::path& path) {
+        if (!p.known || f->size != e.size) return true;
+        return f->mtime != seen && fileCrc(path) != e.crc;
+    };
+    const bool lc = p.l && changed(p.l, e.lmtime, lp);
+    const bool sc = p.s && changed(p.s, e.smtime, sp);
+
+    if (p.l && p.s) {
+        if (lc && sc) {
+            if (p.l->size == p.s->size && fileCrc(lp) == fileCrc(sp)) {
+                e.crc = fileCrc(lp); // same bytes on both sides: adopt them
+                p.action = SyncAction::Unchanged;
+            } else {
+                p.conflict = true; // the newer side wins
+                p.action = p.l->mtime >= p.s->mtime ? SyncAction::Push : SyncAction::Pull;
+            }
+        } else {
+            p.action = lc ? SyncAction::Push : sc ? SyncAction::Pull : SyncAction::Unchanged;
+        }
+    } else if (p.l) {
+        p.action = p.known && !lc ? SyncAction::DeleteLocal : SyncAction::Push;
+    } else if (p.s) {
+        p.action = p.known && !sc ? SyncAction::DeleteShared : SyncAction::Pull;
+    } else {
+        p.action = SyncAction::Drop;
+    }
+    if (dryRun) {
+        if (p.action == SyncAction::Push) p.bytes = p.l->size;
+        if (p.action == SyncAction::Pull) p.bytes = p.s->size;
+        return;
+    }
+
+    std::error_code ec;
+    switch (p.action) {
+    case SyncAction::Unchanged:
+        e.size = p.l->size;
+        e.lmtime = p.l->mtime;
+        e.smtime = p.s->mtime;
+        break;
+    case SyncAction::Push:
+        e.crc = syncCopy(lp, sp, id);
+        e.size = p.bytes = p.l->size;
+        e.lmtime = p.l->mtime;
+        e.smtime = ticks(fs::last_write_time(sp));
+        e.shared = fs::path(sp).lexically_relative(sharedRoot).generic_string();
+        break;
+    case SyncAction::Pull:
+        e.crc = syncCopy(sp, lp, id);
+        e.size = p.bytes = p.s->size;
+        e.smtime = p.s->mtime;
+        e.lmtime = ticks(fs::last_write_time(lp));
+        break;
+    case SyncAction::DeleteLocal:
+        fs::remove(lp, ec);
+        if (ec) throw std::runtime_error("Failed to remove: " + lp.string());
+        break;
+    case SyncAction::DeleteShared:
+        fs::remove(sp, ec);
+        if (ec) throw std::runtime_error("Failed to remove: " + sp.string());
+        break;
+    case SyncAction::Drop:
+        break;
+    }
+}
+
+} // namespace
+
+SyncResult syncTree(const fs::path& local, const fs::path& shared, const SyncOptions& o) {
+    if (!fs::is_directory(local)) throw std::runtime_error("Not a directory: " + local.string());
+    if (!o.dry_run) fs::create_directories(shared);
+
+    const auto entries = loadManifest(shared / kSyncManifest);
+    const auto localFiles = scanTree(local, false);
+    const auto sharedFiles = scanTree(shared, true);
+
+    // Pair every file with its other side; naming is decided here, before
+    // any copying, so it doesn't depend on which thread gets there first.
+    SyncNames names;
+    for (const auto& e : entries) names.claim(e.local, e.shared);
+    for (const auto& [key, f] : sharedFiles) names.occupy(f.rel);
+
+    SyncResult res;
+    std::vector<SyncPair> pairs;
+    std::set<std::string> pairedLocal, pairedShared;
+    auto add = [&](SyncPair p) {
+        if (auto it = localFiles.find(p.e.local); it != localFiles.end()) p.l = &it->second;
+        if (auto it = sharedFiles.find(upperCase(p.e.shared)); it != sharedFiles.end()) p.s = &it->second;
+        pairedLocal.insert(p.e.local);
+        pairedShared.insert(upperCase(p.e.shared));
+        pairs.push_back(std::move(p));
+    };
+    for (const auto& e : entries) {
+        if (pairedLocal.count(e.local) || pairedShared.count(upperCase(e.shared))) continue;
+        SyncPair p;
+        p.e = e;
+        p.known = true;
+        add(std::move(p));
+    }
+    for (const auto& [rel, f] : localFiles) {
+        if (pairedLocal.count(rel)) continue;
+        SyncPair p;
+        p.e.local = rel;
+        p.e.shared = names.sharedFor(rel);
+        add(std::move(p));
+    }
+    for (const auto& [key, f] : sharedFiles) {
+        if (pairedShared.count(key)) continue;
+        SyncPair p;
+        p.e.local = names.localFor(f.rel);
+        p.e.shared = f.rel;
+        if (pairedLocal.count(p.e.local)) {
+            res.conflicts++; // its host name is taken by a file mapped elsewhere
+            continue;
+        }
+        add(std::move(p));
+    }
+
+    // Hashing and copying run on a few I/O threads.
+    const size_t threads = std::min<size_t>(
+        std::max<size_t>(pairs.size(), 1),
+        o.threads ? o.threads : std::max(1u, std::min(8u, std::thread::hardware_concurrency())));
+    std::atomic<size_t> next{0};
+    std::mutex errorMu;
+    std::exception_ptr error;
+    auto work = [&] {
+        for (size_t i; (i = next.fetch_add(1)) < pairs.size();) {
+            try {
+                syncPair(pairs[i], i, local, shared, o.dry_run);
+            } catch (...) {
+                pairs[i].failed = true;
+                std::lock_guard<std::mutex> lock(errorMu);
+                if (!error) error = std::current_exception();
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < threads; t++) pool.emplace_back(work);
+    work();
+    for (auto& t : pool) t.join();
+
+    std::vector<SyncEntry> manifest;
+    for (const auto& p : pairs) {
+        if (p.failed) {
+            if (p.known) manifest.push_back(p.e);
+            continue;
+        }
+        res.scanned++;
+        res.bytes += p.bytes;
+        if (p.conflict) res.conflicts++;
+        switch (p.action) {
+        case SyncAction::Unchanged: res.unchanged++; break;
+        case SyncAction::Push: res.pushed++; break;
+        case SyncAction::Pull: res.pulled++; break;
+        case SyncAction::DeleteLocal: res.deleted_local++; break;
+        case SyncAction::DeleteShared: res.deleted_shared++; break;
+        case SyncAction::Drop: res.scanned--; break;
+        }
+        if (p.action == SyncAction::Unchanged || p.action == SyncAction::Push || p.action == SyncAction::Pull) {
+            manifest.push_back(p.e);
+        }
+    }
+    if (!o.dry_run) saveManifest(shared, std::move(manifest));
+    if (error) std::rethrow_exception(error);
+    return res;
+}
+
+ResultCache::ResultCache(const fs::path& dir, std::uintmax_t maxBytes) : dir_(dir), maxBytes_(maxBytes) {
+    fs::create_directories(dir_);
+}
+
+bool ResultCache::cacheable(const std::string& command) {
+    std::istringstream iss(command);
+    std::string verb;
+    if (!(iss >> verb) || verb.compare(0, 5, ":MBX ") == 0) return false;
+    for (char& c : verb) c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+    return verb != "EXIT" && verb != "QUIT" && verb != "RESET" && verb != "STAT" && verb != "PUT" &&
+           verb != "GET";
+}
+
+// 64-bit FNV-1a; keys only need to be stable and well spread, not secret.
+static void fnv(std::uint64_t& h, const void* data, size_t len) {
+    const auto* p = static_cast<const unsigned char*>(data);
+    while (len--) {
+        h ^= *p++;
+        h *= 0x100000001B3ull;
+    }
+}
+
+static void fnv(std::uint64_t& h, const std::string& s) {
+    fnv(h, s.data(), s.size() + 1); // include the NUL so fields can't run together
+}
+
+std::string ResultCache::key(const MailboxPaths& m, const std::string& command,
+                             const std::vector<std::string>& inputs) const {
+    std::uint64_t h = 0xCBF29CE484222325ull;
+    std::error_code ec;
+    fnv(h, fs::weakly_canonical(m.dir, ec).string());
+    fnv(h, command);
+
+    // A template job also depends on its script, as registerTemplate stored it.
+    std::vector<std::string> all = inputs;
+    std::istringstream iss(command);
+    std::string verb, tpl;
+    if (iss >> verb >> tpl) {
+        for (char& c : verb) c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+        for (char& c : tpl) c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+        if (verb == "RUN") all.push_back("TPL/" + tpl + ".BAT");
+    }
+
+    for (const auto& in : all) {
+        const fs::path p = m.dir / in;
+        std::vector<fs::path> files;
+        if (fs::is_directory(p, ec)) {
+            for (const auto& e : fs::recursive_directory_iterator(p, ec)) {
+                if (e.is_regular_file(ec)) files.push_back(e.path());
+            }
+            std::sort(files.begin(), files.end());
+        } else {
+            files.push_back(p);
+        }
+
+        fnv(h, in);
+        for (const auto& f : files) {
+            fnv(h, f.lexically_relative(m.dir).generic_string());
+            if (!fs::exists(f, ec)) {
+                fnv(h, "-");
+                continue;
+            }
+            fnv(h, std::to_string(fs::file_size(f)) + " " + hex32(fileCrc(f)));
+        }
+    }
+
+    char name[17];
+    std::snprintf(name, sizeof(name), "%016llX", static_cast<unsigned long long>(h));
+    return name;
+}
+
+fs::path ResultCache::entry(const std::string& key) const { return dir_ / (key + ".res"); }
+
+// Entry format: "rc <n|?>\n" followed by the output bytes.
+std::optional<Reply> ResultCache::lookup(const std::string& key) {
+    const auto t0 = std::chrono::steady_clock::now();
+    const fs::path p = entry(key);
+    std::error_code ec;
+    if (!fs::exists(p, ec)) {
+        misses_++;
+        return std::nullopt;
+    }
+
+    const std::string text = readFileText(p);
+    const size_t nl = text.find('\n');
+    if (nl == std::string::npos || text.compare(0, 3, "rc ") != 0) {
+        safeRemove(p);
+        misses_++;
+        return std::nullopt;
+    }
+    Reply r;
+    r.rc = parseReturnCode(text.substr(3, nl - 3));
+    r.out = text.substr(nl + 1);
+    fs::last_write_time(p, fs::file_time_type::clock::now(), ec);
+    hits_++;
+    r.host.total = std::chrono::steady_clock::now() - t0;
+    return r;
+}
+
+void ResultCache::store(const std::string& key, const Reply& r) {
+    const fs::path tmp = dir_ / (key + ".new");
+    writeFileText(tmp, "rc " + (r.rc ? std::to_string(*r.rc) : std::string("?")) + "\n" + r.out);
+    safeRename(tmp, entry(key));
+    evict();
+}
+
+size_t ResultCache::entries() const {
+    size_t n = 0;
+    std::error_code ec;
+    for (const auto& e : fs::directory_iterator(dir_, ec)) n += e.path().extension() == ".res" ? 1 : 0;
+    return n;
+}
+
+std::uintmax_t ResultCache::bytes() const {
+    std::uintmax_t total = 0;
+    std::error_code ec;
+    for (const auto& e : fs::directory_iterator(dir_, ec)) {
+        if (e.path().extension() == ".res") total += e.file_size(ec);
+    }
+    return total;
+}
+
+void ResultCache::evict() {
+    struct Entry {
+        fs::file_time_type used;
+        std::uintmax_t size;
+        fs::path path;
+    };
+    std::vector<Entry> all;
+    std::uintmax_t total = 0;
+    std::error_code ec;
+    for (const auto& e : fs::directory_iterator(dir_, ec)) {
+        if (e.path().extension() != ".res") continue;
+        all.push_back({e.last_write_time(ec), e.file_size(ec), e.path()});
+        total += all.back().size;
+    }
+    if (total <= maxBytes_) return;
+
+    std::sort(all.begin(), all.end(), [](const Entry& a, const Entry& b) { return a.used < b.used; });
+    for (const auto& e : all) {
+        if (total <= maxBytes_) break;
+        safeRemove(e.path);
+        total -= e.size;
+    }
+}
+
+const char* priorityName(Priority p) {
+    switch (p) {
+    case Priority::Interactive: return "interactive";
+    case Priority::Normal: return "normal";
+    case Priority::Bulk: return "bulk";
+    }
+    return "?";
+}
+
+std::optional<Priority> parsePriority(std::string_view name) {
+    for (size_t c = 0; c < kPriorities; c++) {
+        if (name == priorityName(static_cast<Priority>(c))) return static_cast<Priority>(c);
+    }
+    return std::nullopt;
+}
+
+LatencyStats summarizeLatency(std::vector<std::chrono::nanoseconds>& samples) {
+    LatencyStats st;
+    st.count = samples.size();
+    if (samples.empty()) return st;
+    std::sort(samples.begin(), samples.end());
+    auto pct = [&](double q) {
+        const size_t k = static_cast<size_t>(q * static_cast<double>(samples.size()) + 0.999999);
+        return samples[std::min(samples.size(), std::max<size_t>(k, 1)) - 1];
+    };
+    st.p50 = pct(0.50);
+    st.p95 = pct(0.95);
+    st.max = samples.back();
+    return st;
+}
+
+class AsyncClient::Impl {
+public:
+    explicit Impl(std::chrono::milliseconds poll) : poll_(poll), reactor_([this] { run(); }) {}
+
+    ~Impl() {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        reactor_.join();
+
+        std::vector<Completion> done;
+        for (auto& box : boxes_) {
+            for (auto& lane : box->backlog) {
+                for (auto& j : lane) fail(done, j, std::make_exception_ptr(Cancelled()));
+            }
+            for (auto& j : box->inflight) {
+                safeRemove(queueFile(box->m, "CMD", j.seq));
+                if (!j.cancelled) fail(done, j, std::make_exception_ptr(Cancelled()));
+            }
+        }
+        deliver(done);
+    }
+
+    size_t addMailbox(const fs::path& dir) {
+        std::lock_guard<std::mutex> lock(mu_);
+        boxes_.push_back(std::make_unique<Box>());
+        boxes_.back()->m = pathsFromDir(dir);
+        return boxes_.size() - 1;
+    }
+
+    AsyncJob submit(size_t mb, const std::string& command, std::chrono::milliseconds timeout, Callback done,
+                    Priority prio) {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (mb >= boxes_.size()) throw std::out_of_range("AsyncClient: no mailbox " + std::to_string(mb));
+
+        Job j;
+        j.id = nextId_++;
+        j.command = command;
+        j.prio = prio;
+        j.start = std::chrono::steady_clock::now();
+        j.deadline = j.start + timeout;
+        j.done = std::move(done);
+
+        AsyncJob handle{j.id, j.promise.get_future().share()};
+        boxes_[mb]->backlog[static_cast<size_t>(prio)].push_back(std::move(j));
+        cv_.notify_all();
+        return handle;
+    }
+
+    bool cancel(std::uint64_t id) {
+        std::vector<Completion> done;
+        Box* owner = nullptr;
+        int seq = 0;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            for (auto& box : boxes_) {
+                for (auto& lane : box->backlog) {
+                    for (auto it = lane.begin(); done.empty() && it != lane.end(); ++it) {
+                        if (it->id != id) continue;
+                        fail(done, *it, std::make_exception_ptr(Cancelled()));
+                        lane.erase(it);
+                        break;
+                    }
+                }
+                if (!done.empty()) break;
+                for (auto& j : box->inflight) {
+                    if (j.id != id || j.cancelled) continue;
+                    fail(done, j, std::make_exception_ptr(Cancelled()));
+                    j.cancelled = true;
+                    owner = box.get();
+                    seq = j.seq;
+                    break;
+                }
+                if (owner) break;
+            }
+        }
+        deliver(done);
+        if (!owner) return !done.empty();
+
+        // Unclaimed jobs can be taken back; the guest is asked to stop a
+        // claimed one still running, and its reply is dropped when it
+        // arrives. With the box's I/O held, nobody else writes or withdraws
+        // CMD.nnn, so if the job still has its number, the file is its own.
+        std::lock_guard<std::mutex> io(owner->io);
+        std::string tag;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            auto it = find(*owner, id, seq);
+            if (it == owner->inflight.end()) return false;
+            tag = it->tag;
+        }
+        std::error_code ec;
+        if (!fs::remove(queueFile(owner->m, "CMD", seq), ec)) {
+            if (!fs::exists(queueFile(owner->m, "OUT", seq), ec)) stop(*owner, tag);
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mu_);
+        auto it = find(*owner, id, seq);
+        if (it != owner->inflight.end()) owner->inflight.erase(it);
+        return true;
+    }
+
+    size_t outstanding() const {
+        std::lock_guard<std::mutex> lock(mu_);
+        size_t n = 0;
+        for (const auto& box : boxes_) {
+            for (const auto& lane : box->backlog) n += lane.size();
+            for (const auto& j : box->inflight) n += j.cancelled ? 0 : 1;
+        }
+        return n;
+    }
+
+    LatencyStats latency(Priority prio) const {
+        std::vector<std::chrono::nanoseconds> samples;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            samples = latency_[static_cast<size_t>(prio)];
+        }
+        return summarizeLatency(samples);
+    }
+
+private:
+    struct Job {
+        std::uint64_t id = 0;
+        std::string command;
+        Priority prio = Priority::Normal;
+        std::chrono::steady_clock::time_point start, deadline;
+        std::chrono::nanoseconds write{};
+        int seq = 0;            // CMD.nnn once dispatched
+        std::string tag;        // its :MBX ID, for cancelJob
+        bool cancelled = false; // future already failed; discard the reply
+        std::promise<Reply> promise;
+        Callback done;
+    };
+
+    struct Box {
+        MailboxPaths m;
+        int next = 1;
+        std::array<std::deque<Job>, kPriorities> backlog; // waiting for room, one lane per Priority
+        std::vector<Job> inflight; // written as CMD.nnn, oldest first
+        std::chrono::steady_clock::time_point checked{}; // last guestDown() look
+        std::mutex io; // held for this box's mailbox I/O; taken before mu_, never while holding it
+    };
+
+    struct Completion {
+        std::uint64_t id;
+        std::promise<Reply> promise;
+        Callback done;
+        std::optional<Reply> reply;
+        std::exception_ptr error;
+    };
+
+    static void fail(std::vector<Completion>& out, Job& j, std::exception_ptr e) {
+        out.push_back({j.id, std::move(j.promise), std::move(j.done), std::nullopt, e});
+    }
+
+    // Run callbacks and settle futures; called without the lock held.
+    static void deliver(std::vector<Completion>& list) {
+        for (auto& c : list) {
+            if (c.done) {
+                try {
+                    c.done(c.id, c.reply ? &*c.reply : nullptr, c.error);
+                } catch (...) {
+                    // A throwing callback must not take the reactor down.
+                }
+            }
+            if (c.reply) c.promise.set_value(std::move(*c.reply));
+            else c.promise.set_exception(c.error);
+        }
+        list.clear();
+    }
+
+    static std::vector<Job>::iterator find(Box& box, std::uint64_t id, int seq) {
+        return std::find_if(box.inflight.begin(), box.inflight.end(),
+                            [&](const Job& j) { return j.id == id && j.seq == seq; });
+    }
+
+    // A sweep of one box runs in three steps -- defer, dispatch, reap -- and
+    // each only holds mu_ to plan and to apply what the mailbox I/O found.
+    // The I/O itself runs under the box's own `io` mutex, so submit(),
+    // outstanding() and latency() never wait on a slow shared folder.
+    struct Slot {
+        std::uint64_t id;
+        int seq;
+    };
+
+    // Take back the newest unclaimed CMD.nnn of a class below the best one
+    // waiting, so that goes out first; they return to the head of their lane.
+    // Only the tail of the window is withdrawn (and its numbers reused), so
+    // pending jobs stay contiguous and the guest still runs them oldest first.
+    static std::vector<Slot> deferrable(const Box& box) {
+        size_t top = 0;
+        while (top < kPriorities && box.backlog[top].empty()) top++;
+        std::vector<Slot> tail;
+        for (auto it = box.inflight.rbegin(); it != box.inflight.rend(); ++it) {
+            if (static_cast<size_t>(it->prio) <= top || it->cancelled) break;
+            tail.push_back({it->id, it->seq});
+        }
+        return tail;
+    }
+
+    // Unlocked: remove them newest first, up to the first the guest has claimed.
+    static size_t withdraw(const Box& box, const std::vector<Slot>& tail) {
+        size_t n = 0;
+        std::error_code ec;
+        while (n < tail.size() && fs::remove(queueFile(box.m, "CMD", tail[n].seq), ec)) n++;
+        return n;
+    }
+
+    static void deferred(Box& box, const std::vector<Slot>& tail, size_t n) {
+        for (size_t k = 0; k < n; k++) {
+            auto it = find(box, tail[k].id, tail[k].seq);
+            if (it == box.inflight.end()) continue;
+            box.next = it->seq;
+            if (!it->cancelled) box.backlog[static_cast<size_t>(it->prio)].push_front(std::move(*it));
+            box.inflight.erase(it);
+        }
+    }
+
+    struct Outgoing {
+        std::uint64_t id;
+        int seq;
+        std::string text;
+        std::chrono::nanoseconds write{};
+        std::exception_ptr error;
+    };
+
+    // Move the best backlog jobs into the window, numbered, with their job text.
+    static std::vector<Outgoing> take(Box& box) {
+        std::vector<Outgoing> out;
+        while (box.inflight.size() < static_cast<size_t>(kQueueDepthMax)) {
+            auto lane = std::find_if(box.backlog.begin(), box.backlog.end(), [](const auto& l) { return !l.empty(); });
+            if (lane == box.backlog.end()) break;
+            Job j = std::move(lane->front());
+            lane->pop_front();
+            j.seq = box.next;
+            box.next = box.next % kQueueMax + 1;
+            j.tag = nextRequestId();
+            std::string text;
+            text.append(kIdDirective).append(" ").append(j.tag).append("\r\n");
+            appendJobDirectives(text, box.m);
+            out.push_back({j.id, j.seq, std::move(text.append(j.command).append("\r\n")), {}, nullptr});
+            box.inflight.push_back(std::move(j));
+        }
+        return out;
+    }
+
+    // Unlocked: write each as CMD.nnn (see CommandQueue::submit).
+    static void write(const Box& box, std::vector<Outgoing>& jobs) {
+        for (auto& o : jobs) {
+            try {
+                const auto t0 = std::chrono::steady_clock::now();
+                safeRemove(queueFile(box.m, "OUT", o.seq));
+                safeRemove(queueFile(box.m, "RC", o.seq));
+                const fs::path staging = box.m.dir / "CMDQ.NEW";
+                safeRemove(staging);
+                writeFileText(staging, o.text);
+                safeRename(staging, queueFile(box.m, "CMD", o.seq));
+                Metrics::global().sent(box.m.dir, o.text.size());
+                o.write = std::chrono::steady_clock::now() - t0;
+            } catch (...) {
+                o.error = std::current_exception();
+            }
+        }
+    }
+
+    static void written(Box& box, std::vector<Outgoing>& jobs, std::vector<Completion>& done) {
+        for (auto& o : jobs) {
+            auto it = find(box, o.id, o.seq);
+            if (it == box.inflight.end()) continue;
+            if (!o.error) {
+                it->write = o.write;
+                continue;
+            }
+            if (!it->cancelled) fail(done, *it, o.error);
+            box.inflight.erase(it);
+        }
+    }
+
+    void sample(Priority prio, std::chrono::nanoseconds total) {
+        auto& s = latency_[static_cast<size_t>(prio)];
+        auto& next = latencyNext_[static_cast<size_t>(prio)];
+        if (s.size() < AsyncClient::kLatencyWindow) s.push_back(total);
+        else s[next] = total;
+        next = (next + 1) % AsyncClient::kLatencyWindow;
+    }
+
+    struct Waiting {
+        std::uint64_t id;
+        int seq;
+        std::string tag;
+        bool cancelled;
+        std::chrono::steady_clock::time_point start, deadline;
+        // What reap() found: a reply, or an error; neither while still waiting.
+        std::optional<Reply> reply;
+        std::exception_ptr error;
+    };
+
+    // Unlocked: have the guest stop the claimed job tagged `tag`.
+    static void stop(const Box& box, const std::string& tag) {
+        try {
+            cancelJob(box.m, tag);
+        } catch (...) {
+            // Best effort: without CANCEL.TXT the job runs to its end.
+        }
+    }
+
+    // Collect whatever `box` has finished or timed out. If the guest is down,
+    // jobs it hasn't claimed fail with GuestDown right away.
+    static void reap(const Box& box, bool checkDown, std::chrono::steady_clock::time_point now,
+                     std::vector<Waiting>& jobs) {
+        const std::optional<std::string> down = checkDown ? guestDown(box.m) : std::nullopt;
+        for (auto& w : jobs) {
+            const fs::path out = queueFile(box.m, "OUT", w.seq);
+            const fs::path rc = queueFile(box.m, "RC", w.seq);
+            std::error_code ec;
+
+            if (w.cancelled && fs::exists(out, ec)) {
+                safeRemove(out); // nobody wants it
+                safeRemove(rc);
+                w.error = std::make_exception_ptr(Cancelled());
+            } else if (fs::exists(out, ec)) {
+                try {
+                    Reply r;
+                    readOutput(out, 0, r, nullptr);
+                    if (fs::exists(rc, ec)) readReturnCode(rc, r);
+                    r.host.total = now - w.start;
+                    Metrics::global().replied(box.m.dir, r);
+                    w.reply = std::move(r);
+                } catch (...) {
+                    Metrics::global().failed(box.m.dir);
+                    w.error = std::current_exception();
+                }
+                safeRemove(out);
+                safeRemove(rc);
+            } else if (down && fs::remove(queueFile(box.m, "CMD", w.seq), ec)) {
+                Metrics::global().failed(box.m.dir);
+                w.error = std::make_exception_ptr(GuestDown(*down));
+            } else if (now > w.deadline) {
+                // As in CommandQueue::wait: take it back, or have the guest
+                // stop it (cancel() already asked if it was cancelled).
+                if (!fs::remove(queueFile(box.m, "CMD", w.seq), ec) && !w.cancelled) stop(box, w.tag);
+                Metrics::global().timedOut(box.m.dir);
+                w.error = std::make_exception_ptr(std::runtime_error(
+                    "Timeout waiting for " + out.filename().string() + ". Is MBXSRV running in the shared folder?"));
+            }
+        }
+    }
+
+    void reaped(Box& box, std::vector<Waiting>& jobs, std::vector<Completion>& done) {
+        for (auto& w : jobs) {
+            if (!w.reply && !w.error) continue;
+            auto it = find(box, w.id, w.seq);
+            if (it == box.inflight.end()) continue;
+            if (!it->cancelled && w.reply) {
+                w.reply->host.write = it->write;
+                sample(it->prio, w.reply->host.total);
+                done.push_back({it->id, std::move(it->promise), std::move(it->done), std::move(w.reply), nullptr});
+            } else if (!it->cancelled) {
+                fail(done, *it, w.error);
+            }
+            box.inflight.erase(it);
+        }
+    }
+
+    // One sweep of `box`; `lock` holds mu_ on entry and exit.
+    void sweep(Box& box, std::unique_lock<std::mutex>& lock, std::vector<Completion>& done) {
+        auto unlocked = [&](auto&& io) {
+            lock.unlock();
+            {
+                std::lock_guard<std::mutex> guard(box.io);
+                io();
+            }
+            lock.lock();
+        };
+
+        const auto tail = deferrable(box);
+        if (!tail.empty()) {
+            size_t n = 0;
+            unlocked([&] { n = withdraw(box, tail); });
+            deferred(box, tail, n);
+        }
+
+        auto out = take(box);
+        if (!out.empty()) {
+            unlocked([&] { write(box, out); });
+            written(box, out, done);
+        }
+
+        if (box.inflight.empty()) return;
+        const auto now = std::chrono::steady_clock::now();
+        const bool checkDown = now - box.checked >= kWatchRecheck;
+        if (checkDown) box.checked = now;
+        std::vector<Waiting> waiting;
+        waiting.reserve(box.inflight.size());
+        for (const auto& j : box.inflight) {
+            waiting.push_back({j.id, j.seq, j.tag, j.cancelled, j.start, j.deadline, {}, nullptr});
+        }
+        unlocked([&] { reap(box, checkDown, now, waiting); });
+        reaped(box, waiting, done);
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mu_);
+        std::vector<Completion> done;
+        while (!stop_) {
+            bool busy = false;
+            for (size_t b = 0; b < boxes_.size(); b++) {
+                Box& box = *boxes_[b]; // boxes are never removed, and stay put when boxes_ grows
+                sweep(box, lock, done);
+                busy = busy || !box.inflight.empty() ||
+                       std::any_of(box.backlog.begin(), box.backlog.end(), [](const auto& l) { return !l.empty(); });
+            }
+
+            if (!done.empty()) {
+                lock.unlock();
+                deliver(done);
+                lock.lock();
+                continue;
+            }
+            if (busy) cv_.wait_for(lock, poll_);
+            else cv_.wait(lock);
+        }
+    }
+
+    const std::chrono::milliseconds poll_;
+    mutable std::mutex mu_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+    std::uint64_t nextId_ = 1;
+    std::vector<std::unique_ptr<Box>> boxes_;
+    std::array<std::vector<std::chrono::nanoseconds>, kPriorities> latency_; // ring of kLatencyWindow
+    std::array<size_t, kPriorities> latencyNext_{};
+    std::thread reactor_; // last: starts running once everything above exists
+};
+
+AsyncClient::AsyncClient(std::chrono::milliseconds poll) : impl_(std::make_unique<Impl>(poll)) {}
+AsyncClient::~AsyncClient() = default;
+
+size_t AsyncClient::addMailbox(const fs::path& dir) { return impl_->addMailbox(dir); }
+
+AsyncJob AsyncClient::submit(size_t mb, const std::string& command, std::chrono::milliseconds timeout,
+                             Callback done, Priority prio) {
+    return impl_->submit(mb, command, timeout, std::move(done), prio);
+}
+
+bool AsyncClient::cancel(std::uint64_t id) { return impl_->cancel(id); }
+
+size_t AsyncClient::outstanding() const { return impl_->outstanding(); }
+
+LatencyStats AsyncClient::latency(Priority prio) const { return impl_->latency(prio); }
+
+Metrics& Metrics::global() {
+    static Metrics m;
+    return m;
+}
+
+void Metrics::Histogram::observe(double seconds) {
+    size_t b = 0;
+    while (b < kBucketCount && seconds > kBuckets[b]) b++;
+    counts[b]++;
+    sum += seconds;
+}
+
+Metrics::Series& Metrics::series(const fs::path& mailbox) {
+    auto it = series_.find(mailbox);
+    if (it == series_.end()) it = series_.emplace(mailbox, Series{}).first;
+    return it->second;
+}
+
+void Metrics::sent(const fs::path& mailbox, size_t bytes) {
+    std::lock_guard<std::mutex> lock(mu_);
+    Series& s = series(mailbox);
+    s.commands++;
+    s.bytes_in += bytes;
+}
+
+void Metrics::replied(const fs::path& mailbox, const Reply& r) {
+    using sec = std::chrono::duration<double>;
+    std::lock_guard<std::mutex> lock(mu_);
+    Series& s = series(mailbox);
+    s.round_trip.observe(sec(r.host.total).count());
+    if (r.guest) {
+        s.bytes_out += static_cast<std::uint64_t>(r.guest->packed ? r.guest->packed : r.guest->out);
+        s.guest_exec.observe(static_cast<double>(r.guest->exec_ms) / 1000.0);
+    } else {
+        s.bytes_out += r.out.size();
+    }
+    if (r.host.claim.count() > 0) {
+        s.queue_wait.observe(sec(r.host.claim).count());
+    } else if (r.guest) {
+        const double work = static_cast<double>(r.guest->build_ms + r.guest->exec_ms + r.guest->publish_ms) / 1000.0;
+        s.queue_wait.observe(std::max(0.0, sec(r.host.total).count() - work));
+    }
+}
+
+void Metrics::timedOut(const fs::path& mailbox) {
+    std::lock_guard<std::mutex> lock(mu_);
+    series(mailbox).timeouts++;
+}
+
+void Metrics::failed(const fs::path& mailbox) {
+    std::lock_guard<std::mutex> lock(mu_);
+    series(mailbox).failures++;
+}
+
+std::string Metrics::prometheus() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    std::string text;
+    char num[64];
+
+    // Label values escape backslash, quote and newline; Windows paths need it.
+    std::vector<std::string> labels;
+    for (const auto& [mailbox, s] : series_) {
+        std::string l = "mailbox=\"";
+        for (char c : mailbox.string()) {
+            if (c == '\\' || c == '"') l += '\\';
+            if (c == '\n') { l += "\\n"; continue; }
+            l += c;
+        }
+        labels.push_back(l + "\"");
+    }
+
+    auto counter = [&](const char* name, const char* help, std::uint64_t Series::*field) {
+        text.append("# HELP ").append(name).append(" ").append(help).append("\n");
+        text.append("# TYPE ").append(name).append(" counter\n");
+        size_t i = 0;
+        for (const auto& entry : series_) {
+            text.append(name).append("{").append(labels[i++]).append("} ");
+            text.append(std::to_string(entry.second.*field)).append("\n");
+        }
+    };
+    auto histogram = [&](const char* name, const char* help, Histogram Series::*field) {
+        text.append("# HELP ").append(name).append(" ").append(help).append("\n");
+        text.append("# TYPE ").append(name).append(" histogram\n");
+        size_t i = 0;
+        for (const auto& entry : series_) {
+            const Histogram& h = entry.second.*field;
+            const std::string& l = labels[i++];
+            std::uint64_t total = 0;
+            for (size_t b = 0; b <= kBucketCount; b++) {
+                total += h.counts[b];
+                if (b < kBucketCount) std::snprintf(num, sizeof(num), "%g", kBuckets[b]);
+                text.append(name).append("_bucket{").append(l).append(",le=\"");
+                text.append(b < kBucketCount ? num : "+Inf").append("\"} ").append(std::to_string(total)).append("\n");
+            }
+            std::snprintf(num, sizeof(num), "%.6f", h.sum);
+            text.append(name).append("_sum{").append(l).append("} ").append(num).append("\n");
+            text.append(name).append("_count{").append(l).append("} ").append(std::to_string(total)).append("\n");
+        }
+    };
+
+    counter("mbx_commands_total", "Jobs written to the mailbox.", &Series::commands);
+    counter("mbx_timeouts_total", "Jobs given up on after their timeout.", &Series::timeouts);
+    counter("mbx_failures_total", "Jobs that failed otherwise (guest down, I/O errors).", &Series::failures);
+    counter("mbx_bytes_in_total", "Job bytes written to the guest.", &Series::bytes_in);
+    counter("mbx_bytes_out_total", "Reply bytes the guest published.", &Series::bytes_out);
+    histogram("mbx_round_trip_seconds", "Host-side time from writing a job to reading its reply.",
+              &Series::round_trip);
+    histogram("mbx_guest_exec_seconds", "Guest-reported job execution time.", &Series::guest_exec);
+    histogram("mbx_queue_wait_seconds", "Time before the guest started the job.", &Series::queue_wait);
+    return text;
+}
+
+void Metrics::writeFile(const fs::path& p) const {
+    fs::path tmp = p;
+    tmp += ".NEW";
+    writeFileText(tmp, prometheus());
+    safeRename(tmp, p);
+}
+
+class MetricsServer::Impl {
+public:
+#if defined(_WIN32)
+    using Socket = SOCKET;
+    static constexpr Socket kNoSocket = INVALID_SOCKET;
+#else
+    using Socket = int;
+    static constexpr Socket kNoSocket = -1;
+#endif
+
+    explicit Impl(const std::string& addr) {
+#if defined(_WIN32)
+        WSADATA wsa;
+        if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) throw std::runtime_error("WSAStartup failed");
+#endif
+        const size_t colon = addr.rfind(':');
+        const std::string host = colon == std::string::npos ? "127.0.0.1" : addr.substr(0, colon);
+        const std::string port = colon == std::string::npos ? addr : addr.substr(colon + 1);
+
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        addrinfo* res = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || !res) {
+            throw std::runtime_error("metrics: cannot resolve " + addr);
+        }
+        for (addrinfo* ai = res; ai && fd_ == kNoSocket; ai = ai->ai_next) {
+            fd_ = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd_ == kNoSocket) continue;
+            int one = 1;
+            setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&one), sizeof(one));
+            if (bind(fd_, ai->ai_addr, static_cast<int>(ai->ai_addrlen)) != 0 || listen(fd_, 8) != 0) {
+                closeSocket(fd_);
+            }
+        }
+        freeaddrinfo(res);
+        if (fd_ == kNoSocket) throw std::runtime_error("metrics: cannot listen on " + addr);
+
+        sockaddr_storage sa{};
+        socklen_t len = sizeof(sa);
+        if (getsockname(fd_, reinterpret_cast<sockaddr*>(&sa), &len) == 0) {
+            port_ = ntohs(sa.ss_family == AF_INET6 ? reinterpret_cast<sockaddr_in6*>(&sa)->sin6_port
+                                                   : reinterpret_cast<sockaddr_in*>(&sa)->sin_port);
+        }
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~Impl() {
+        stop_ = true;
+        thread_.join();
+        closeSocket(fd_);
+#if defined(_WIN32)
+        WSACleanup();
+#endif
+    }
+
+    unsigned short port() const { return port_; }
+
+private:
+    static void closeSocket(Socket& s) {
+        if (s == kNoSocket) return;
+#if defined(_WIN32)
+        closesocket(s);
+#else
+        close(s);
+#endif
+        s = kNoSocket;
+    }
+
+    // Is `s` readable within `ms`?
+    static bool readable(Socket s, int ms) {
+#if defined(_WIN32)
+        WSAPOLLFD pfd{s, POLLRDNORM, 0};
+        return WSAPoll(&pfd, 1, ms) > 0;
+#else
+        pollfd pfd{s, POLLIN, 0};
+        return poll(&pfd, 1, ms) > 0;
+#endif
+    }
+
+    void run() {
+        while (!stop_) {
+            if (!readable(fd_, 200)) continue;
+            Socket c = accept(fd_, nullptr, nullptr);
+            if (c == kNoSocket) continue;
+            serve(c);
+            closeSocket(c);
+        }
+    }
+
+    // One request per connection; the scraper's request line is all we need.
+    static void serve(Socket c) {
+        std::string req;
+        char buf[1024];
+        while (req.find("\r\n\r\n") == std::string::npos && req.size() < 8192 && readable(c, 2000)) {
+            const auto n = recv(c, buf, sizeof(buf), 0);
+            if (n <= 0) break;
+            req.append(buf, static_cast<size_t>(n));
+        }
+        const bool ok = req.compare(0, 13, "GET /metrics ") == 0 || req.compare(0, 6, "GET / ") == 0;
+        const std::string body = ok ? Metrics::global().prometheus() : std::string("Not found\n");
+        std::string reply = ok ? "HTTP/1.0 200 OK\r\n" : "HTTP/1.0 404 Not Found\r\n";
+        reply += "Content-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.size()) +
+                 "\r\nConnection: close\r\n\r\n" + body;
+        int flags = 0;
+#if defined(MSG_NOSIGNAL)
+        flags = MSG_NOSIGNAL; // a scraper that hung up mustn't kill mbxhost with SIGPIPE
+#endif
+        size_t sent = 0;
+        while (sent < reply.size()) {
+            const auto n = ::send(c, reply.data() + sent, static_cast<int>(reply.size() - sent), flags);
+            if (n <= 0) break;
+            sent += static_cast<size_t>(n);
+        }
+    }
+
+    Socket fd_ = kNoSocket;
+    unsigned short port_ = 0;
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+};
+
+MetricsServer::MetricsServer(const std::string& addr) : impl_(std::make_unique<Impl>(addr)) {}
+MetricsServer::~MetricsServer() = default;
+unsigned short MetricsServer::port() const { return impl_->port(); }
+
+} // namespace mbx
@@ -0,0 +1,665 @@
+// host-lib.h - host side of the DOSBox-X mailbox bridge, as a library.
+//
+// Everything mbxhost does is available here: blocking round trips through a
+// shared folder (sendCommandAndWait, submitBatch, CommandQueue), the serial
+// fast path (SerialLink), and AsyncClient, which drives any number of
+// mailboxes from one reactor thread and completes futures/callbacks.
+//
+// Build: g++ -std=c++17 -O2 -pthread -c host-lib.cpp && ar rcs libmbxhost.a host-lib.o
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <istream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace mbx {
+
+namespace fs = std::filesystem;
+
+std::string readFileText(const fs::path& p);
+void writeFileText(const fs::path& p, const std::string& s);
+std::optional<fs::file_time_type> mtimeIfExists(const fs::path& p);
+void safeRemove(const fs::path& p);
+// Rename over an existing file (remove first on Windows, copy as a last resort).
+void safeRename(const fs::path& from, const fs::path& to);
+
+// Wakes a waiter when entries in the mailbox folder change, so replies are
+// picked up as soon as the guest renames OUT.TXT/RC.TXT into place.
+// Backends: inotify (Linux), kqueue (macOS/BSD), ReadDirectoryChangesW (Windows).
+// If none can be set up (e.g. some network mounts), active() is false and
+// wait() degrades to a plain sleep, i.e. the classic polling loop.
+class DirWatcher {
+public:
+    explicit DirWatcher(const fs::path& dir);
+    ~DirWatcher();
+
+    DirWatcher(const DirWatcher&) = delete;
+    DirWatcher& operator=(const DirWatcher&) = delete;
+
+    bool active() const;
+
+    // Block until the folder changes or `d` elapses. Returns true on a change event.
+    bool wait(std::chrono::milliseconds d);
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+// With a live watcher we still re-check at this interval, in case an event
+// is missed (e.g. the folder is a mount whose writer is on another machine).
+constexpr std::chrono::milliseconds kWatchRecheck(250);
+
+struct MailboxPaths {
+    fs::path dir;
+    fs::path cmd_new, cmd_txt;
+    fs::path out_new, out_txt, rc_txt;
+    fs::path res_txt, sta_txt, cancel_txt;
+    // Ask for combined replies (see kResDirective) on classic jobs.
+    bool combined = false;
+    // Sent as ":MBX TIMEOUT" with every job; 0 leaves the guest's default.
+    std::chrono::seconds job_timeout{0};
+};
+
+MailboxPaths pathsFromDir(const fs::path& dir);
+
+// Host-side view of where a round trip's time went.
+struct HostTiming {
+    std::chrono::nanoseconds write{}; // CMD.NEW written and renamed to CMD.TXT
+    std::chrono::nanoseconds claim{}; // until CMD.TXT was gone (guest claimed it); 0 if never seen
+    std::chrono::nanoseconds total{}; // until the reply was read
+};
+
+// MBXSRV's own view, from the "TIM ..." line it appends to RC.TXT.
+// Times are in ms at the guest timer's resolution (res_ms).
+struct GuestTiming {
+    long claim_ms = 0, build_ms = 0, exec_ms = 0, publish_ms = 0;
+    long payload = 0, out = 0; // bytes
+    long packed = 0;           // bytes actually published, if :MBX PACK compressed the output
+    long res_ms = 0;
+};
+
+struct Reply {
+    std::string out;
+    std::optional<int> rc;
+    HostTiming host;
+    std::optional<GuestTiming> guest;
+};
+
+// First integer in an RC file, if any (after its ID line, if it has one).
+std::optional<int> parseReturnCode(std::string_view s);
+// The tag of an RC file that starts with "ID <tag>", if it does.
+std::optional<std::string> parseRequestId(std::string_view s);
+// The TIM line of an RC file, if present.
+std::optional<GuestTiming> parseGuestTiming(std::string_view s);
+
+// Receives job output as it is produced (streaming mode).
+using OutputSink = std::function<void(const char* data, size_t len)>;
+
+constexpr size_t kStreamChunk = 64 * 1024;
+
+// Output compression, negotiated per command: a job starting with ":MBX PACK"
+// lets MBXSRV LZSS-compress its output once it has run, if it is at least
+// 4 KB and shrinks. A packed OUT file starts with kPackMagic, then the plain
+// size and CRC32 (little-endian). Replies are unpacked on the host, so callers
+// only ever see plain output.
+constexpr const char* kPackDirective = ":MBX PACK";
+constexpr char kPackMagic[] = "\x1b" "MBXLZ1\n";
+constexpr size_t kPackHeader = 16;
+
+bool isPacked(const std::string& head);
+
+// Decode a packed stream (header included) into `sink`; returns the plain size.
+// Throws std::runtime_error if the data is truncated or fails its CRC.
+std::uintmax_t unpack(std::istream& in, const OutputSink& sink);
+
+// Classic jobs are sent with ":MBX ID <tag>", a tag unique to this call;
+// MBXSRV echoes it as the first line of RC.TXT, which it publishes after
+// OUT.TXT. A reply is recognised by reading RC.TXT and finding our tag, so a
+// stale OUT.TXT/RC.TXT is never mistaken for it, however coarse the share's
+// timestamps are.
+constexpr const char* kIdDirective = ":MBX ID";
+
+// With MailboxPaths::combined, jobs also carry ":MBX RES": MBXSRV then
+// publishes one RES.TXT instead of OUT.TXT and RC.TXT, made of the RC text,
+// "LEN <bytes>", an empty line and the output. One rename on the guest, one
+// file read on the host. A server that doesn't (MBX_RES=0, EXIT) still
+// answers in OUT.TXT/RC.TXT, which are accepted as before.
+constexpr const char* kResDirective = ":MBX RES";
+
+// ":MBX TIMEOUT <s>" has MBXSRV's timer watchdog stop the job once it has run
+// for s seconds; CANCEL.TXT holding the job's ID tag (or "*") stops it at
+// once. Either way the guest appends a note to the output, publishes the
+// return code below and goes back to READY. A job cancelled before it
+// starts isn't run at all.
+constexpr const char* kTimeoutDirective = ":MBX TIMEOUT";
+constexpr int kRcTimedOut = 124;
+constexpr int kRcCancelled = 130;
+
+// Ask the guest to stop the job tagged `tag` ("*": whatever is running).
+void cancelJob(const MailboxPaths& m, std::string_view tag = "*");
+
+// Wait up to `wait` for a running job's watchdog to take CANCEL.TXT. If
+// none does, the file is stale (no job was running, or it had ended) and
+// is removed, so it can't stop a later job; returns whether it was taken.
+// Guests leave a "*" they can't act on to the other workers of the folder.
+bool awaitCancel(const MailboxPaths& m, std::chrono::milliseconds wait = std::chrono::milliseconds(3000),
+                 std::chrono::milliseconds poll = std::chrono::milliseconds(50));
+
+// Append the directive lines every job carries for `m` (TIMEOUT, if set).
+void appendJobDirectives(std::string& text, const MailboxPaths& m);
+
+// Send one command and wait for its reply. With a `sink`, output is streamed
+// instead of returned: OUT.NEW is tailed while the job runs, the rest is read
+// from OUT.TXT once published, and Reply::out stays empty. Memory use is then
+// bounded by kStreamChunk, and `timeout` counts from the last output received.
+// With `pack` the command asks for compressed output; a sink then gets it all
+// once the job has finished, since OUT.NEW may be rewritten in packed form.
+Reply sendCommandAndWait(const MailboxPaths& m,
+                         const std::string& command,
+                         std::chrono::milliseconds timeout = std::chrono::milliseconds(5000),
+                         std::chrono::milliseconds poll = std::chrono::milliseconds(50),
+                         DirWatcher* watch = nullptr,
+                         const OutputSink& sink = nullptr,
+                         bool pack = false);
+
+// Line filter for job output, applied while it is read: pass sink() to
+// sendCommandAndWait (or feed() any other source), then finish() returns
+// only the kept lines, so a multi-MB log costs memory for what survives.
+// A line is kept if it matches an include pattern (or, with `errors`, looks
+// like a compiler error, warning or test failure) -- every line if there
+// are neither -- and no exclude pattern. Lines longer than kStreamChunk are
+// judged in kStreamChunk pieces.
+struct FilterOptions {
+    std::vector<std::string> include, exclude; // ECMAScript regexes, searched per line
+    bool icase = false;
+    bool errors = false;
+    // Limits on the kept output (0: none). Over a limit, the lines in the
+    // middle go and a "[... n lines, m bytes omitted ...]" line marks the gap.
+    size_t max_lines = 0;
+    std::uintmax_t max_bytes = 0;
+    enum class Keep { Head, Tail, Both } keep = Keep::Both; // Both: half the limit to each end
+
+    bool active() const { return !include.empty() || !exclude.empty() || errors || max_lines || max_bytes; }
+};
+
+class OutputFilter {
+public:
+    // Throws std::runtime_error on a bad pattern. With `pass`, kept lines
+    // from the head go to it as they are found instead of being held, and
+    // finish() sends it the rest.
+    explicit OutputFilter(const FilterOptions& o, OutputSink pass = nullptr);
+    ~OutputFilter();
+
+    OutputFilter(const OutputFilter&) = delete;
+    OutputFilter& operator=(const OutputFilter&) = delete;
+
+    void feed(const char* data, size_t len);
+    OutputSink sink() {
+        return [this](const char* data, size_t len) { feed(data, len); };
+    }
+
+    // Ends the input; returns what was kept (empty with `pass`).
+    std::string finish();
+
+    size_t lines() const;    // seen
+    size_t kept() const;     // returned
+    size_t omitted() const;  // matched but cut by a limit
+    std::uintmax_t bytes() const; // seen
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+// Read-only view of a whole file, mapped into memory (mmap / MapViewOfFile).
+// An empty file has a null data() and size 0.
+class MappedFile {
+public:
+    MappedFile();
+    // With `removeAfter` the file is deleted once the view is closed (on POSIX
+    // right away; the mapping stays valid).
+    explicit MappedFile(const fs::path& p, bool removeAfter = false);
+    ~MappedFile();
+
+    MappedFile(MappedFile&&) noexcept;
+    MappedFile& operator=(MappedFile&&) noexcept;
+
+    const char* data() const;
+    size_t size() const;
+    std::string_view view() const { return {data(), size()}; }
+
+    // Copy the file to stdout without staging it in user memory: sendfile(2)
+    // on Linux (works for files and pipes), write() from the mapping elsewhere.
+    // Flushes stdio's stdout first; returns the bytes written.
+    std::uintmax_t writeToStdout() const;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+// sendCommandAndWait, but the reply keeps OUT.TXT instead of copying it:
+// the file is renamed to a private name, mapped, and removed when `out`
+// is destroyed, so its size is limited by disk rather than memory. It
+// always asks for the classic reply, whatever MailboxPaths::combined says.
+// With `keep` OUT.TXT is mapped where it is and left in the folder, as
+// sendCommandAndWait leaves it; on Windows the next job can't publish its
+// OUT.TXT until `out` is closed.
+struct MappedReply {
+    MappedFile out;
+    std::optional<int> rc;
+    HostTiming host;
+    std::optional<GuestTiming> guest;
+};
+
+MappedReply sendCommandMapped(const MailboxPaths& m,
+                              const std::string& command,
+                              std::chrono::milliseconds timeout = std::chrono::milliseconds(5000),
+                              std::chrono::milliseconds poll = std::chrono::milliseconds(50),
+                              DirWatcher* watch = nullptr,
+                              bool keep = false);
+
+// Serial fast path. MBXSRV started with MBX_COM=1 (or 2) also takes jobs
+// over that COM port; with DOSBox-X's "serial1=nullmodem port:5000" the port
+// is a TCP socket on the host, so a round trip costs no host filesystem ops
+// and the guest wakes on the first byte instead of its next poll. Frames are
+// "<KIND> <len>\n" plus len bytes: CMD goes to the guest, OUT and RC (the
+// contents of OUT.TXT and RC.TXT) come back, PING/PONG probes the link.
+class SerialLink {
+public:
+    // Connect to "host:port" (or just "port" on localhost) and PING MBXSRV.
+    SerialLink(const std::string& addr, std::chrono::milliseconds timeout);
+    ~SerialLink();
+
+    SerialLink(const SerialLink&) = delete;
+    SerialLink& operator=(const SerialLink&) = delete;
+
+    const std::string& address() const;
+
+    // Same contract as sendCommandAndWait: OUT is the reply, RC optional.
+    Reply send(const std::string& command, std::chrono::milliseconds timeout, const OutputSink& sink = nullptr,
+               bool pack = false);
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+// Batch mode: several single-line commands travel as one job. The ":MBX BATCH"
+// directive makes MBXSRV echo "@MBX@ <n> <errorlevel>" after command n, which
+// is how the combined OUT.TXT is split back into one Reply per command. Only
+// a marker at the start of a line, for the next command in order, counts.
+constexpr const char* kBatchDirective = ":MBX BATCH";
+constexpr const char* kBatchMarker = "@MBX@ ";
+
+std::vector<Reply> splitBatchOutput(const std::string& out, size_t count);
+
+// Run `commands` in one mailbox round trip; returns one Reply per command.
+// Commands that never ran (the batch stopped early) come back without an rc.
+std::vector<Reply> submitBatch(const MailboxPaths& m,
+                               const std::vector<std::string>& commands,
+                               std::chrono::milliseconds timeout = std::chrono::milliseconds(5000),
+                               std::chrono::milliseconds poll = std::chrono::milliseconds(50),
+                               DirWatcher* watch = nullptr);
+
+// Queued (pipelined) mode: jobs are dropped as CMD.001..CMD.999 and answered
+// as OUT.nnn/RC.nnn, so several commands can be in flight at once. The guest
+// runs them in submission order and publishes RC.nnn before OUT.nnn.
+constexpr int kQueueMax = 999;
+constexpr int kQueueDepthMax = 99; // keep the in-flight window well under kQueueMax/2
+
+fs::path queueFile(const MailboxPaths& m, const char* stem, int seq);
+
+class CommandQueue {
+public:
+    CommandQueue(const MailboxPaths& m, DirWatcher* watch) : m_(m), watch_(watch) {}
+    // Withdraws jobs nobody waited for that the guest hasn't claimed yet.
+    ~CommandQueue();
+
+    CommandQueue(const CommandQueue&) = delete;
+    CommandQueue& operator=(const CommandQueue&) = delete;
+
+    // Drop the next numbered job and return its sequence number.
+    int submit(const std::string& command);
+
+    // Wait for OUT.nnn of a submitted job, read it with RC.nnn, and clean both up.
+    // On timeout the job is withdrawn (or, once claimed, cancelled) before this throws.
+    Reply wait(int seq,
+               std::chrono::milliseconds timeout = std::chrono::milliseconds(5000),
+               std::chrono::milliseconds poll = std::chrono::milliseconds(50));
+
+private:
+    struct Submitted {
+        std::chrono::steady_clock::time_point start;
+        std::chrono::nanoseconds write;
+        std::string id; // :MBX ID tag, for cancelJob
+    };
+
+    MailboxPaths m_;
+    DirWatcher* watch_;
+    int next_ = 1;
+    std::map<int, Submitted> inflight_;
+};
+
+// Job templates: batch files stored once as TPL/<NAME>.BAT in the shared
+// folder and run by MBXSRV as "RUN <name> [args]", which skips building a
+// job file. Names are DOS names: 1-8 letters, digits, '_' or '-'.
+constexpr size_t kTemplateArgsMax = 8;
+
+// Store (or replace) a template; line ends become CR LF.
+void registerTemplate(const MailboxPaths& m, const std::string& name, const std::string& script);
+
+// The command that runs `name` with `args` (at most kTemplateArgsMax, no spaces).
+std::string templateCommand(const std::string& name, const std::vector<std::string>& args = {});
+
+// First word of STA.TXT (READY, RUNNING, BYE), or "" if it can't be read.
+std::string guestState(const MailboxPaths& m);
+
+// STA.TXT in full. MBXSRV writes "<STATE> beat=<n> every=<ms> job=<file>"
+// and, while idle, rewrites it every <ms> with the next beat (servers
+// started with MBX_BEAT=0, and older ones, write only the state).
+struct GuestStatus {
+    std::string state;                  // "" if STA.TXT can't be read
+    long beat = -1;                     // -1: no heartbeat
+    std::chrono::milliseconds every{0}; // heartbeat interval
+    std::string job;                    // job file while RUNNING, else "-"
+    std::chrono::milliseconds age{0};   // since STA.TXT was last written
+};
+
+GuestStatus guestStatus(const MailboxPaths& m);
+
+// An idle guest whose heartbeat is older than kBeatMisses intervals plus
+// kBeatSlack is taken for dead. While RUNNING it can't beat (the shell has
+// the CPU), so only the job timeout applies there.
+constexpr int kBeatMisses = 3;
+constexpr std::chrono::milliseconds kBeatSlack(1000);
+
+// Why the guest can't take a job ("stopped", "heartbeat stalled ..."), or
+// nullopt if it may be alive (including servers without a heartbeat).
+std::optional<std::string> guestDown(const MailboxPaths& m);
+
+// Thrown when a job was taken back before any guest claimed it (a timeout
+// with CMD.TXT still in place): it never ran, so it may go to another guest.
+class Withdrawn : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Thrown instead of waiting out the timeout when guestDown() says so. The
+// job was never sent or was taken back unclaimed, so it is also Withdrawn.
+class GuestDown : public Withdrawn {
+public:
+    using Withdrawn::Withdrawn;
+};
+
+// Provisioning: start a guest on a shared folder and wait until it can take
+// jobs. provisionGuest() writes <dir>/MBXBOOT.CONF (mount the folder as C:,
+// the autoexec lines, then MBXSRV), launches DOSBox-X on it, waits for a
+// fresh READY in STA.TXT and runs the init script as template INIT, which
+// is only rewritten when it changes. MBXSRV.EXE must be in the folder (or
+// be given as `mbxsrv`, which is copied in). DOSBox-X's console output goes
+// to <dir>/MBXBOOT.LOG.
+struct ProvisionOptions {
+    std::string dosbox = "dosbox-x";    // executable, looked up in PATH
+    std::vector<std::string> args;      // extra DOSBox-X arguments
+    std::vector<std::string> config;    // "[section]" and "key=value" lines
+    std::vector<std::string> autoexec;  // run before MBXSRV (drivers, PATH, SET)
+    std::string init;                   // script run once READY; "" = none
+    fs::path mbxsrv;                    // MBXSRV.EXE to copy in; empty: already there
+    std::chrono::milliseconds timeout{60000}; // for READY, and again for INIT
+};
+
+struct ProvisionResult {
+    long pid = 0;
+    std::chrono::nanoseconds launch{}; // config written, process started
+    std::chrono::nanoseconds ready{};  // until STA.TXT said READY
+    std::chrono::nanoseconds init{};   // INIT round trip; 0 without one
+    std::optional<int> init_rc;
+};
+
+// The DOSBox-X config provisionGuest() would write for `m`.
+std::string bootConfig(const MailboxPaths& m, const ProvisionOptions& o);
+
+// Throws std::runtime_error if a guest already serves the folder, DOSBox-X
+// can't be started or exits early, or READY doesn't come within the timeout.
+// A failing INIT is not an error; see init_rc.
+ProvisionResult provisionGuest(const MailboxPaths& m, const ProvisionOptions& o);
+
+// Start every guest at once and wait for each; results are in `guests` order.
+std::vector<ProvisionResult> provisionGuests(const std::vector<MailboxPaths>& guests, const ProvisionOptions& o);
+
+// Bulk transfer through the STAT/PUT/GET verbs. Files move as XFR.nnn
+// chunk files in the shared folder, each with a CRC32, plus a whole-file
+// CRC32 at the end. An interrupted PUT resumes from the guest's partial
+// file (<name>.$$$), an interrupted GET from the host's <local>.part, and a
+// destination that already has the same size and CRC is left alone.
+std::uint32_t crc32(const void* data, size_t len, std::uint32_t crc = 0);
+
+struct TransferOptions {
+    size_t chunk = 1 << 20; // bytes per XFR.nnn; grown if the file needs more than 999
+    int retries = 3;        // resends after a chunk or file CRC mismatch
+    std::chrono::milliseconds timeout{60000}; // per round trip
+    std::chrono::milliseconds poll{50};
+    DirWatcher* watch = nullptr;
+};
+
+struct TransferResult {
+    bool skipped = false;     // destination already matched
+    std::uintmax_t size = 0;  // file size
+    std::uintmax_t moved = 0; // bytes sent through chunks this time
+    std::uint32_t crc = 0;
+    int chunks = 0, retries = 0;
+};
+
+TransferResult putFile(const MailboxPaths& m, const fs::path& local, const std::string& guestPath,
+                       const TransferOptions& o = {});
+TransferResult getFile(const MailboxPaths& m, const std::string& guestPath, const fs::path& local,
+                       const TransferOptions& o = {});
+
+// Two-way sync of a host directory with a directory inside the shared
+// folder. <shared>/MBXSYNC.MAN records each pair's size, mtimes and CRC32
+// as of the last sync, so only files that changed since are copied: a file
+// changed on one side is copied to the other, one deleted on one side and
+// unchanged on the other is deleted, and one changed on both sides is a
+// conflict the newer copy wins. Shared names are 8.3 so guest jobs see
+// the tree as it is: valid names are upper-cased, others become
+// BASE~N.EXT, and the manifest keeps the mapping stable across runs.
+struct SyncOptions {
+    unsigned threads = 0;  // I/O threads for hashing and copying; 0 = up to 8 by core count
+    bool dry_run = false;  // count what would happen, change nothing
+};
+
+struct SyncResult {
+    size_t scanned = 0;
+    size_t pushed = 0, pulled = 0; // host -> shared, shared -> host
+    size_t deleted_local = 0, deleted_shared = 0;
+    size_t conflicts = 0;
+    size_t unchanged = 0;
+    std::uintmax_t bytes = 0; // copied
+};
+
+SyncResult syncTree(const fs::path& local, const fs::path& shared, const SyncOptions& o = {});
+
+// Opt-in on-disk cache of replies to deterministic, read-only commands.
+// An entry is keyed by the mailbox folder, the command text and the path,
+// size and CRC32 of every declared input (relative to the shared folder;
+// a directory stands for all files below it), so editing an input misses.
+// A `RUN <name>` job also counts its template, TPL\<name>.BAT, as an input.
+// Each entry is one <key>.res file whose mtime is its last use; store()
+// evicts least recently used entries once the folder exceeds maxBytes.
+class ResultCache {
+public:
+    ResultCache(const fs::path& dir, std::uintmax_t maxBytes);
+
+    // Control verbs (EXIT, RESET, STAT/PUT/GET, ...) are never cached.
+    static bool cacheable(const std::string& command);
+
+    std::string key(const MailboxPaths& m, const std::string& command,
+                    const std::vector<std::string>& inputs) const;
+
+    std::optional<Reply> lookup(const std::string& key);
+    void store(const std::string& key, const Reply& r);
+
+    size_t hits() const { return hits_; }
+    size_t misses() const { return misses_; }
+    size_t entries() const;
+    std::uintmax_t bytes() const;
+
+private:
+    fs::path entry(const std::string& key) const;
+    void evict();
+
+    fs::path dir_;
+    std::uintmax_t maxBytes_;
+    size_t hits_ = 0, misses_ = 0;
+};
+
+// Thrown through an AsyncJob's future when it was cancelled.
+class Cancelled : public std::runtime_error {
+public:
+    Cancelled() : std::runtime_error("Command cancelled") {}
+};
+
+// Scheduling classes for jobs that wait on the host. A free slot goes to
+// the highest class with work waiting, and lower-class jobs queued on the
+// guest but not yet claimed are taken back until it has gone out, so an
+// interactive job waits for at most the one job already running.
+enum class Priority { Interactive, Normal, Bulk };
+constexpr size_t kPriorities = 3;
+
+const char* priorityName(Priority p);
+std::optional<Priority> parsePriority(std::string_view name);
+
+// Submit-to-reply latency of the jobs of one class.
+struct LatencyStats {
+    size_t count = 0;
+    std::chrono::nanoseconds p50{}, p95{}, max{};
+};
+
+// Summary of `samples`, which it sorts.
+LatencyStats summarizeLatency(std::vector<std::chrono::nanoseconds>& samples);
+
+// Handle to a command submitted through AsyncClient.
+struct AsyncJob {
+    std::uint64_t id = 0;
+    std::shared_future<Reply> reply; // throws on timeout, cancellation or I/O errors
+};
+
+// Non-blocking client: submit() returns at once and one reactor thread
+// services every outstanding command on every mailbox. Jobs travel in queued
+// mode (CMD.nnn), up to kQueueDepthMax in flight per mailbox; the rest wait
+// on the host until the window has room. Callbacks run on the reactor
+// thread (or in cancel() / the destructor for the job being cancelled), so
+// they should be quick and must not block on other jobs.
+class AsyncClient {
+public:
+    using Callback = std::function<void(std::uint64_t id, const Reply* reply, std::exception_ptr error)>;
+
+    explicit AsyncClient(std::chrono::milliseconds poll = std::chrono::milliseconds(10));
+    ~AsyncClient(); // cancels whatever is still outstanding
+
+    AsyncClient(const AsyncClient&) = delete;
+    AsyncClient& operator=(const AsyncClient&) = delete;
+
+    // Register a guest's shared folder; returns the index submit() takes.
+    size_t addMailbox(const fs::path& dir);
+
+    // Queue `command` on mailbox `mb`. `done`, if given, is called once with
+    // either the reply or the error, just before the future becomes ready.
+    AsyncJob submit(size_t mb, const std::string& command,
+                    std::chrono::milliseconds timeout = std::chrono::milliseconds(5000),
+                    Callback done = nullptr, Priority prio = Priority::Normal);
+
+    // Fail the job with Cancelled. Returns true if it was withdrawn before the
+    // guest claimed it; false if it already ran or is running (the guest is
+    // asked to stop it, see cancelJob, and its reply is discarded) or the id
+    // is unknown. A job that times out after its claim is stopped the same way.
+    bool cancel(std::uint64_t id);
+
+    // Commands submitted but not yet completed.
+    size_t outstanding() const;
+
+    // Latency of the last kLatencyWindow replies of class `prio`.
+    static constexpr size_t kLatencyWindow = 1024;
+    LatencyStats latency(Priority prio) const;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+// Process-wide counters and histograms, one set per mailbox (its folder, or
+// "serial:<host:port>"). Every round trip feeds them: sendCommandAndWait,
+// sendCommandMapped, CommandQueue, AsyncClient and SerialLink. Bytes out are
+// what the guest published (packed size for :MBX PACK replies). Queue wait is
+// the time before the guest started the job: until it claimed CMD.TXT, or
+// for queued jobs, the total less the guest's own build/exec/publish time.
+class Metrics {
+public:
+    static Metrics& global();
+
+    // Upper bounds of the histogram buckets, in seconds (then +Inf).
+    static constexpr double kBuckets[] = {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1,
+                                          0.25,  0.5,    1,     2.5,  5,     10,   30, 60};
+    static constexpr size_t kBucketCount = sizeof(kBuckets) / sizeof(kBuckets[0]);
+
+    void sent(const fs::path& mailbox, size_t bytes);
+    void replied(const fs::path& mailbox, const Reply& r);
+    void timedOut(const fs::path& mailbox);
+    void failed(const fs::path& mailbox);
+
+    // Prometheus text exposition format (version 0.0.4).
+    std::string prometheus() const;
+    // The same, written to `p` through <p>.NEW and a rename, for node_exporter's
+    // textfile collector.
+    void writeFile(const fs::path& p) const;
+
+private:
+    struct Histogram {
+        std::uint64_t counts[kBucketCount + 1] = {};
+        double sum = 0;
+        void observe(double seconds);
+    };
+    struct Series {
+        std::uint64_t commands = 0, timeouts = 0, failures = 0, bytes_in = 0, bytes_out = 0;
+        Histogram round_trip, guest_exec, queue_wait;
+    };
+
+    Series& series(const fs::path& mailbox);
+
+    mutable std::mutex mu_;
+    std::map<fs::path, Series> series_;
+};
+
+// Serves Metrics::global() as "GET /metrics" on a background thread. `addr`
+// is "port" (loopback only) or "host:port" ("0.0.0.0:9120" for scrapers on
+// other machines).
+class MetricsServer {
+public:
+    explicit MetricsServer(const std::string& addr);
+    ~MetricsServer();
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    unsigned short port() const;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+} // namespace mbx
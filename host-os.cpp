@@ -1,168 +1,782 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <functional>
 #include <filesystem>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <new>
 #include <optional>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <vector>
 
-namespace fs = std::filesystem;
+#include "host-lib.h"
 
-static std::string readFileText(const fs::path& p) {
-    std::ifstream in(p, std::ios::binary);
-    if (!in) throw std::runtime_error("Failed to open: " + p.string());
-    std::ostringstream ss;
-    ss << in.rdbuf();
-    return ss.str();
-}
+using namespace mbx;
 
-static void writeFileText(const fs::path& p, const std::string& s) {
-    std::ofstream out(p, std::ios::binary | std::ios::trunc);
-    if (!out) throw std::runtime_error("Failed to write: " + p.string());
-    out.write(s.data(), static_cast<std::streamsize>(s.size()));
-    if (!out) throw std::runtime_error("Failed while writing: " + p.string());
-}
+#ifdef MBX_COUNT_ALLOCS
+// Heap allocations made by the calling thread, reported by --bench as
+// allocs/cmd. Counting per thread keeps the --mock guest's own work out.
+// Off by default: normal builds keep the standard allocator.
+static thread_local std::uint64_t t_allocs = 0;
 
-static std::optional<fs::file_time_type> mtimeIfExists(const fs::path& p) {
-    std::error_code ec;
-    if (!fs::exists(p, ec) || ec) return std::nullopt;
-    auto t = fs::last_write_time(p, ec);
-    if (ec) return std::nullopt;
-    return t;
+// GCC pairs the inlined malloc with the delete-expression's free and warns.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void* operator new(std::size_t n) {
+    t_allocs++;
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
 }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif // MBX_COUNT_ALLOCS
 
-static void safeRemove(const fs::path& p) {
-    std::error_code ec;
-    fs::remove(p, ec);
+static void printStats(std::ostream& os, const Reply& r) {
+    using ms = std::chrono::duration<double, std::milli>;
+    os << std::fixed << std::setprecision(2)
+       << "[STATS] host write " << ms(r.host.write).count() << "  claim " << ms(r.host.claim).count()
+       << "  total " << ms(r.host.total).count() << " ms";
+    if (r.guest) {
+        os << " | guest claim " << r.guest->claim_ms << "  build " << r.guest->build_ms
+           << "  exec " << r.guest->exec_ms << "  publish " << r.guest->publish_ms
+           << " ms (res " << r.guest->res_ms << ")  payload " << r.guest->payload
+           << "  out " << r.guest->out << " bytes";
+        if (r.guest->packed) os << " (packed " << r.guest->packed << ")";
+    }
+    os << "\n";
 }
 
-static void safeRename(const fs::path& from, const fs::path& to) {
-    // Cross-platform atomic-ish rename semantics:
-    // - POSIX: rename over existing is atomic.
-    // - Windows: rename fails if destination exists.
-    std::error_code ec;
+// --metrics-file / --metrics-port: export Metrics::global() while mbxhost
+// runs. The file is rewritten every second and once more on the way out.
+class MetricsExport {
+public:
+    MetricsExport(std::optional<fs::path> file, const std::optional<std::string>& addr) : file_(std::move(file)) {
+        if (addr) {
+            server_.emplace(*addr);
+            std::cerr << "mbxhost: serving metrics on port " << server_->port() << " (GET /metrics)\n";
+        }
+        if (file_) {
+            writer_ = std::thread([this] {
+                std::unique_lock<std::mutex> lk(mu_);
+                while (!cv_.wait_for(lk, std::chrono::seconds(1), [this] { return stop_; })) write();
+            });
+        }
+    }
 
-    // Remove destination first (Windows friendliness)
-    fs::remove(to, ec); // ignore errors
+    ~MetricsExport() {
+        if (writer_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lk(mu_);
+                stop_ = true;
+            }
+            cv_.notify_all();
+            writer_.join();
+        }
+        if (file_) write();
+    }
 
-    fs::rename(from, to, ec);
-    if (ec) {
-        // If rename failed, try a copy+remove fallback (less ideal, but robust).
-        ec.clear();
-        fs::copy_file(from, to, fs::copy_options::overwrite_existing, ec);
-        if (ec) throw std::runtime_error("Failed to move " + from.string() + " -> " + to.string() +
-                                         " (rename/copy failed)");
-        fs::remove(from, ec); // ignore
+private:
+    void write() {
+        try {
+            Metrics::global().writeFile(*file_);
+        } catch (const std::exception& e) {
+            std::cerr << "mbxhost: metrics file: " << e.what() << "\n";
+        }
     }
-}
 
-struct MailboxPaths {
+    std::optional<fs::path> file_;
+    std::optional<MetricsServer> server_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+    std::thread writer_;
+};
+
+// Multi-guest pool: one dispatcher thread per guest (one DOSBox-X instance
+// per shared folder) takes the next queued command whenever its guest
+// reports READY, from the highest Priority that has any. Reserved guests
+// only run interactive jobs (unless no other guest is left). Replies are
+// collected in submission order.
+struct PoolJob {
+    std::string command;
+    Priority prio = Priority::Normal;
+};
+
+struct GuestStats {
     fs::path dir;
-    fs::path cmd_new, cmd_txt;
-    fs::path out_txt, rc_txt;
+    int jobs = 0;
+    std::chrono::steady_clock::duration busy{};
+    bool reserved = false; // interactive jobs only
+    bool retired = false;  // stopped answering; its remaining work went elsewhere
 };
 
-static MailboxPaths pathsFromDir(const fs::path& dir) {
-    MailboxPaths m;
-    m.dir = dir;
-    m.cmd_new = dir / "CMD.NEW";
-    m.cmd_txt = dir / "CMD.TXT";
-    m.out_txt = dir / "OUT.TXT";
-    m.rc_txt  = dir / "RC.TXT";
-    return m;
-}
+class GuestPool {
+public:
+    // The first `reserve` guests are kept for interactive jobs.
+    GuestPool(std::vector<MailboxPaths> guests, std::chrono::milliseconds timeout,
+              std::chrono::milliseconds poll, bool useWatch, size_t reserve = 0)
+        : guests_(std::move(guests)), timeout_(timeout), poll_(poll), useWatch_(useWatch),
+          reserve_(std::min(reserve, guests_.size())) {}
 
-struct Reply {
-    std::string out;
-    std::optional<int> rc;
+    // Run all commands; `onReply(i, reply)` is called in submission order as
+    // replies become available. Commands that could not run on any guest come
+    // back with an error message in `out` and no rc.
+    void run(const std::vector<PoolJob>& commands,
+             const std::function<void(size_t, const Reply&)>& onReply) {
+        commands_ = &commands;
+        results_.assign(commands.size(), std::nullopt);
+        for (auto& lane : pending_) lane.clear();
+        for (auto& lane : latency_) lane.clear();
+        for (size_t i = 0; i < commands.size(); i++) pending_[static_cast<size_t>(commands[i].prio)].push_back(i);
+        stats_.assign(guests_.size(), GuestStats{});
+        live_ = guests_.size();
+        open_ = guests_.size() - reserve_;
+        running_ = 0;
+
+        t0_ = std::chrono::steady_clock::now();
+        std::vector<std::thread> workers;
+        for (size_t g = 0; g < guests_.size(); g++) {
+            stats_[g].dir = guests_[g].dir;
+            stats_[g].reserved = g < reserve_;
+            workers.emplace_back([this, g] { worker(g); });
+        }
+
+        for (size_t next = 0; next < commands.size(); next++) {
+            std::unique_lock<std::mutex> lk(mu_);
+            cv_.wait(lk, [&] { return results_[next].has_value(); });
+            Reply r = *results_[next];
+            lk.unlock();
+            onReply(next, r);
+        }
+        for (auto& t : workers) t.join();
+        wall_ = std::chrono::steady_clock::now() - t0_;
+    }
+
+    void printUtilization(std::ostream& os) const {
+        using ms = std::chrono::duration<double, std::milli>;
+        const double wall = ms(wall_).count();
+        os << "[POOL] " << guests_.size() << " guests, " << std::fixed << std::setprecision(0) << wall << " ms\n";
+        for (const auto& st : stats_) {
+            const double busy = ms(st.busy).count();
+            os << "[POOL] " << st.dir.string() << ": " << st.jobs << " jobs, busy "
+               << std::setprecision(0) << busy << " ms ("
+               << std::setprecision(1) << (wall > 0 ? 100.0 * busy / wall : 0.0) << "%)"
+               << (st.reserved ? ", reserved" : "") << (st.retired ? ", retired" : "") << "\n";
+        }
+        // Per class, from the start of the run to the reply.
+        for (size_t c = 0; c < kPriorities; c++) {
+            auto samples = latency_[c];
+            const auto l = summarizeLatency(samples);
+            if (!l.count) continue;
+            os << "[POOL] " << priorityName(static_cast<Priority>(c)) << ": " << l.count << " jobs, latency p50 "
+               << std::setprecision(0) << ms(l.p50).count() << "  p95 " << ms(l.p95).count() << "  max "
+               << ms(l.max).count() << " ms\n";
+        }
+    }
+
+private:
+    // Wait until the guest reports READY; false if it doesn't within the
+    // timeout, has said BYE, or is READY with a stalled heartbeat.
+    bool waitReady(size_t g, DirWatcher* watch) {
+        if (guestDown(guests_[g])) return false;
+        const auto deadline = std::chrono::steady_clock::now() + timeout_;
+        while (guestState(guests_[g]) != "READY") {
+            if (std::chrono::steady_clock::now() > deadline || guestDown(guests_[g])) return false;
+            if (watch && watch->active()) watch->wait(kWatchRecheck);
+            else std::this_thread::sleep_for(poll_);
+        }
+        return true;
+    }
+
+    // Next job for guest g, best class first. A reserved guest waits for
+    // interactive work while other guests are there to run the rest. While
+    // jobs are running elsewhere, one may yet come back to be run again.
+    std::optional<size_t> take(size_t g) {
+        std::unique_lock<std::mutex> lk(mu_);
+        while (true) {
+            const bool any = std::any_of(pending_.begin(), pending_.end(), [](const auto& l) { return !l.empty(); });
+            if (!any && running_ == 0) return std::nullopt;
+            for (size_t c = 0; any && c < kPriorities; c++) {
+                if (c > 0 && stats_[g].reserved && open_ > 0) break;
+                if (pending_[c].empty()) continue;
+                const size_t i = pending_[c].front();
+                pending_[c].pop_front();
+                running_++;
+                return i;
+            }
+            cv_.wait(lk);
+        }
+    }
+
+    void finish(size_t i, Reply r) {
+        std::lock_guard<std::mutex> lk(mu_);
+        latency_[static_cast<size_t>((*commands_)[i].prio)].push_back(std::chrono::steady_clock::now() - t0_);
+        results_[i] = std::move(r);
+        running_--;
+        cv_.notify_all();
+    }
+
+    void retire(size_t g, std::optional<size_t> requeue) {
+        std::lock_guard<std::mutex> lk(mu_);
+        stats_[g].retired = true;
+        if (!stats_[g].reserved) open_--;
+        if (requeue) {
+            pending_[static_cast<size_t>((*commands_)[*requeue].prio)].push_front(*requeue);
+            running_--;
+        }
+        // Last guest gone: nothing can run what's left.
+        if (--live_ == 0) {
+            for (auto& lane : pending_) {
+                for (size_t i : lane) {
+                    Reply r;
+                    r.out = "mbxhost: no live guest left to run this command\n";
+                    results_[i] = std::move(r);
+                }
+                lane.clear();
+            }
+        }
+        cv_.notify_all();
+    }
+
+    void worker(size_t g) {
+        const MailboxPaths& m = guests_[g];
+        std::optional<DirWatcher> watch;
+        if (useWatch_) watch.emplace(m.dir);
+        DirWatcher* w = watch ? &*watch : nullptr;
+
+        while (true) {
+            if (!waitReady(g, w)) { retire(g, std::nullopt); return; }
+            auto i = take(g);
+            if (!i) return;
+
+            const auto t0 = std::chrono::steady_clock::now();
+            try {
+                Reply r = sendCommandAndWait(m, (*commands_)[*i].command, timeout_, poll_, w);
+                stats_[g].busy += std::chrono::steady_clock::now() - t0;
+                stats_[g].jobs++;
+                finish(*i, std::move(r));
+            } catch (const Withdrawn&) {
+                // The guest never claimed it (it timed out, or GuestDown) and
+                // it was taken back: let another guest run it.
+                retire(g, *i);
+                return;
+            } catch (const std::exception& e) {
+                // It may have run.
+                Reply r;
+                r.out = std::string("mbxhost: ") + e.what() + "\n";
+                finish(*i, std::move(r));
+                retire(g, std::nullopt);
+                return;
+            }
+        }
+    }
+
+    std::vector<MailboxPaths> guests_;
+    std::chrono::milliseconds timeout_, poll_;
+    bool useWatch_;
+    size_t reserve_;
+
+    const std::vector<PoolJob>* commands_ = nullptr;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::array<std::deque<size_t>, kPriorities> pending_; // one lane per Priority
+    std::array<std::vector<std::chrono::nanoseconds>, kPriorities> latency_;
+    std::vector<std::optional<Reply>> results_;
+    std::vector<GuestStats> stats_;
+    size_t live_ = 0, open_ = 0; // live guests; live unreserved ones
+    size_t running_ = 0;         // jobs taken by a guest and not yet finished
+    std::chrono::steady_clock::time_point t0_;
+    std::chrono::steady_clock::duration wall_{};
 };
 
-static std::optional<int> parseReturnCode(const std::string& s) {
-    // RC.TXT is expected to contain a number, possibly with whitespace/newlines.
-    std::string t;
-    for (char c : s) {
-        if (c == '\r' || c == '\n' || c == '\t') t.push_back(' ');
-        else t.push_back(c);
-    }
-    std::istringstream iss(t);
-    int v;
-    if (iss >> v) return v;
-    return std::nullopt;
-}
+// Host-side stand-in for MBXSRV that speaks the same file protocol (classic
+// CMD.TXT, queued CMD.nnn, :MBX BATCH, ID and RES, EXIT/QUIT), so the host side can be
+// exercised and benchmarked without DOSBox-X. It understands a tiny command
+// set: rem, echo, echo., dir [subdir] and ver; anything else fails with rc 1.
+class MockGuest {
+public:
+    // Says READY right away, so a host started next doesn't see a stale BYE.
+    explicit MockGuest(const fs::path& dir) : m_(pathsFromDir(dir)), watch_(dir) { setStatus("READY"); }
 
-static Reply sendCommandAndWait(const MailboxPaths& m,
-                                const std::string& command,
-                                std::chrono::milliseconds timeout = std::chrono::milliseconds(5000),
-                                std::chrono::milliseconds poll = std::chrono::milliseconds(50)) {
-    // Snapshot mtimes so we can detect "new" output.
-    auto out_before = mtimeIfExists(m.out_txt);
-    auto rc_before  = mtimeIfExists(m.rc_txt);
+    // Serve jobs until EXIT/QUIT arrives or `stop` becomes true.
+    void serve(const std::atomic<bool>& stop) {
+        while (!stop) {
+            std::error_code ec;
+            const fs::path run = m_.dir / "CMD.RUN";
+            bool busy = false;
 
-    // Clean stale CMD files (host-side). Be conservative: remove only CMD.NEW.
-    safeRemove(m.cmd_new);
+            if (!fs::exists(run, ec) && fs::exists(m_.cmd_txt, ec)) {
+                fs::rename(m_.cmd_txt, run, ec);
+            }
+            if (fs::exists(run, ec)) {
+                busy = true;
+                if (!runJob(run, m_.out_txt, m_.rc_txt, false)) return;
+            } else if (int seq = nextQueued()) {
+                const fs::path qrun = queueFile(m_, "RUN", seq);
+                fs::rename(queueFile(m_, "CMD", seq), qrun, ec);
+                if (!ec) {
+                    busy = true;
+                    if (!runJob(qrun, queueFile(m_, "OUT", seq), queueFile(m_, "RC", seq), true)) return;
+                }
+            }
+            if (!busy) watch_.wait(std::chrono::milliseconds(10));
+        }
+        setStatus("BYE");
+    }
 
-    // Write CMD.NEW then rename to CMD.TXT
-    writeFileText(m.cmd_new, command + "\r\n");
-    safeRename(m.cmd_new, m.cmd_txt);
+private:
+    void setStatus(const char* state) {
+        const fs::path tmp = m_.dir / "STA.NEW";
+        writeFileText(tmp, std::string(state) + "\r\n");
+        safeRename(tmp, m_.dir / "STA.TXT");
+    }
 
-    const auto start = std::chrono::steady_clock::now();
+    // Oldest pending CMD.nnn: the one right after the largest gap (see MBXSRV).
+    int nextQueued() {
+        std::vector<int> seqs;
+        std::error_code ec;
+        for (const auto& e : fs::directory_iterator(m_.dir, ec)) {
+            const std::string name = e.path().filename().string();
+            if (name.size() == 7 && name.compare(0, 4, "CMD.") == 0 &&
+                std::isdigit(static_cast<unsigned char>(name[4])) &&
+                std::isdigit(static_cast<unsigned char>(name[5])) &&
+                std::isdigit(static_cast<unsigned char>(name[6]))) {
+                int n = std::stoi(name.substr(4));
+                if (n >= 1 && n <= kQueueMax) seqs.push_back(n);
+            }
+        }
+        if (seqs.empty()) return 0;
+        std::sort(seqs.begin(), seqs.end());
+        int best = seqs.front();
+        int bestGap = seqs.front() + kQueueMax - seqs.back();
+        for (size_t i = 1; i < seqs.size(); i++) {
+            if (seqs[i] - seqs[i - 1] > bestGap) { bestGap = seqs[i] - seqs[i - 1]; best = seqs[i]; }
+        }
+        return best;
+    }
 
-    // Wait for OUT.TXT (and optionally RC.TXT) to update
-    while (true) {
-        auto out_now = mtimeIfExists(m.out_txt);
-        auto rc_now  = mtimeIfExists(m.rc_txt);
+    std::string execLine(const std::string& line, int& rc) {
+        std::string l = line;
+        if (!l.empty() && l[0] == '@') l.erase(0, 1);
+        std::string lower = l;
+        for (char& c : lower) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
 
-        bool out_updated = false;
-        if (out_now) {
-            if (!out_before) out_updated = true;
-            else out_updated = (*out_now != *out_before);
+        if (lower.empty() || lower == "echo off" || lower.compare(0, 3, "rem") == 0) return {};
+        if (lower == "echo.") { rc = 0; return "\r\n"; }
+        if (lower.compare(0, 5, "echo ") == 0) { rc = 0; return l.substr(5) + "\r\n"; }
+        if (lower == "ver") { rc = 0; return "\r\nMBXHOST mock guest\r\n"; }
+        if (lower == "dir" || lower.compare(0, 4, "dir ") == 0) {
+            fs::path p = m_.dir;
+            if (l.size() > 4) p /= l.substr(4);
+            std::string out;
+            std::error_code ec;
+            for (const auto& e : fs::recursive_directory_iterator(p, ec)) {
+                out += e.path().lexically_relative(m_.dir).string();
+                out += e.is_directory(ec) ? "  <DIR>\r\n" : "  " + std::to_string(e.file_size(ec)) + "\r\n";
+            }
+            rc = ec ? 1 : 0;
+            return out;
         }
+        rc = 1;
+        return "Bad command or file name\r\n";
+    }
 
-        bool rc_updated = false;
-        if (rc_now) {
-            if (!rc_before) rc_updated = true;
-            else rc_updated = (*rc_now != *rc_before);
+    // Returns false when the job asked the guest to exit.
+    bool runJob(const fs::path& run, const fs::path& out, const fs::path& rcFile, bool queued) {
+        using std::chrono::steady_clock;
+        auto msSince = [](steady_clock::time_point t) {
+            return static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                steady_clock::now() - t).count());
+        };
+        setStatus("RUNNING");
+        auto mark = steady_clock::now();
+        const std::string payload = readFileText(run);
+        std::istringstream in(payload);
+        std::vector<std::string> lines;
+        std::string line;
+        bool batch = false, combined = false, header = true;
+        std::string id;
+        while (std::getline(in, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (header && line.compare(0, 5, ":MBX ") == 0) {
+                if (line.substr(5) == "BATCH") batch = true;
+                else if (line.substr(5) == "RES") combined = !queued;
+                else if (line.compare(5, 3, "ID ") == 0) id = line.substr(8);
+                continue;
+            }
+            header = false;
+            lines.push_back(line);
         }
 
-        // Treat OUT update as the primary signal; RC is a nice-to-have.
-        if (out_updated) {
-            Reply r;
-            r.out = readFileText(m.out_txt);
+        std::string first;
+        for (const auto& l : lines) if (!l.empty()) { first = l; break; }
+        std::string upper = first;
+        for (char& c : upper) c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+        const bool exit = (upper == "EXIT" || upper == "QUIT");
+        const long buildMs = msSince(mark);
+        mark = steady_clock::now();
 
-            if (rc_updated) {
-                auto rc_text = readFileText(m.rc_txt);
-                r.rc = parseReturnCode(rc_text);
-            } else {
-                // If RC wasn't updated yet, give it a brief grace period.
-                // This helps when filesystem timestamps are coarse.
-                auto grace_end = std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
-                while (std::chrono::steady_clock::now() < grace_end) {
-                    auto rc2 = mtimeIfExists(m.rc_txt);
-                    bool rc2_updated = false;
-                    if (rc2) {
-                        if (!rc_before) rc2_updated = true;
-                        else rc2_updated = (*rc2 != *rc_before);
-                    }
-                    if (rc2_updated) {
-                        auto rc_text = readFileText(m.rc_txt);
-                        r.rc = parseReturnCode(rc_text);
-                        break;
-                    }
-                    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        std::string text;
+        int rc = 0, n = 0;
+        if (exit) {
+            text = "MBXSRV BYE\r\n";
+        } else {
+            for (const auto& l : lines) {
+                text += execLine(l, rc);
+                if (batch && l.find_first_not_of(" \t") != std::string::npos) {
+                    text += kBatchMarker + std::to_string(++n) + " " + std::to_string(rc) + "\r\n";
                 }
             }
+        }
+
+        const long execMs = msSince(mark);
+        mark = steady_clock::now();
+
+        const fs::path outNew = m_.dir / "OUT.NEW", rcNew = m_.dir / "RC.NEW";
+        writeFileText(outNew, text);
+        writeFileText(rcNew, (id.empty() ? "" : "ID " + id + "\r\n") + std::to_string(rc) + "\r\nTIM claim=0 build=" + std::to_string(buildMs) +
+                                 " exec=" + std::to_string(execMs) + " publish=" + std::to_string(msSince(mark)) +
+                                 " payload=" + std::to_string(payload.size()) +
+                                 " out=" + std::to_string(text.size()) + " res=1\r\n");
+        if (combined && !exit) {
+            const fs::path resNew = m_.dir / "RES.NEW";
+            writeFileText(resNew, readFileText(rcNew) + "LEN " + std::to_string(text.size()) + "\r\n\r\n" + text);
+            safeRemove(outNew);
+            safeRemove(rcNew);
+            safeRename(resNew, m_.dir / "RES.TXT");
+        } else if (queued) {
+            safeRename(rcNew, rcFile);
+            safeRename(outNew, out);
+        } else {
+            safeRename(outNew, out);
+            safeRename(rcNew, rcFile);
+        }
+        safeRemove(run);
+        setStatus(exit ? "BYE" : "READY");
+        return !exit;
+    }
+
+    MailboxPaths m_;
+    DirWatcher watch_;
+};
+
+// --bench: fire a workload through sendCommandAndWait and report latency
+// percentiles, throughput and where the time went.
+static std::string benchWorkload(const std::string& spec) {
+    auto arg = [&](int def) {
+        auto colon = spec.find(':');
+        return colon == std::string::npos ? def : std::stoi(spec.substr(colon + 1));
+    };
+    const std::string kind = spec.substr(0, spec.find(':'));
+    std::string job;
+    if (kind == "rem") return "rem";
+    if (kind == "echo") {
+        // ~N KB of output from 64-byte echo lines
+        const int lines = std::max(1, arg(1) * 1024 / 64);
+        for (int i = 0; i < lines; i++) {
+            if (i) job += "\r\n";
+            job += "echo " + std::string(57, 'x');
+        }
+        return job;
+    }
+    if (kind == "dir") {
+        auto colon = spec.find(':');
+        return colon == std::string::npos ? "dir" : "dir " + spec.substr(colon + 1);
+    }
+    if (kind == "script") {
+        const int lines = std::max(1, arg(10));
+        for (int i = 0; i < lines; i++) {
+            if (i) job += "\r\n";
+            job += "echo line " + std::to_string(i + 1);
+        }
+        return job;
+    }
+    if (kind == "cmd") return spec.substr(spec.find(':') + 1);
+    throw std::runtime_error("Unknown workload: " + spec + " (rem, echo:KB, dir[:path], script:N, cmd:TEXT)");
+}
+
+using SendFn = std::function<Reply(const std::string& command, const OutputSink& sink)>;
+
+static void runBench(const SendFn& send, const std::string& transport, const std::string& workload,
+                     int count, int warmup) {
+    using ms = std::chrono::duration<double, std::milli>;
+    const std::string job = benchWorkload(workload);
+
+    for (int i = 0; i < warmup; i++) send(job, nullptr);
+
+    std::vector<double> total;
+    double write = 0, claim = 0, rest = 0;
+    double gBuild = 0, gExec = 0, gPublish = 0;
+    long gRes = 0;
+    int timed = 0;
+    size_t bytes = 0;
+    total.reserve(static_cast<size_t>(count));
+#ifdef MBX_COUNT_ALLOCS
+    const auto allocs0 = t_allocs;
+#endif
+    const auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+        auto r = send(job, nullptr);
+        total.push_back(ms(r.host.total).count());
+        write += ms(r.host.write).count();
+        claim += ms(r.host.claim).count();
+        rest += ms(r.host.total - r.host.write - r.host.claim).count();
+        bytes += r.out.size();
+        if (r.guest) {
+            gBuild += static_cast<double>(r.guest->build_ms);
+            gExec += static_cast<double>(r.guest->exec_ms);
+            gPublish += static_cast<double>(r.guest->publish_ms);
+            gRes = std::max(gRes, r.guest->res_ms);
+            timed++;
+        }
+    }
+    const double wall = ms(std::chrono::steady_clock::now() - t0).count();
+#ifdef MBX_COUNT_ALLOCS
+    const auto allocs = t_allocs - allocs0;
+#endif
+
+    std::sort(total.begin(), total.end());
+    auto pct = [&](double q) {
+        size_t k = static_cast<size_t>(q * static_cast<double>(total.size()) + 0.999999);
+        return total[std::min(total.size(), std::max<size_t>(k, 1)) - 1];
+    };
+    const double n = static_cast<double>(count);
+
+    std::cout << std::fixed << std::setprecision(2)
+              << "transport    " << transport << "\n"
+              << "workload     " << workload << " (" << job.size() << " bytes in, "
+              << (count ? bytes / static_cast<size_t>(count) : 0) << " bytes out)\n"
+              << "commands     " << count << " in " << wall << " ms, "
+              << (wall > 0 ? 1000.0 * n / wall : 0.0) << " cmd/s\n"
+              << "latency ms   p50 " << pct(0.50) << "  p95 " << pct(0.95) << "  p99 " << pct(0.99)
+              << "  max " << total.back() << "\n"
+              << "split ms     write " << write / n << "  claim " << claim / n
+              << "  exec+publish " << rest / n << "\n";
+#ifdef MBX_COUNT_ALLOCS
+    std::cout << "allocs/cmd   " << static_cast<double>(allocs) / n << " (heap allocations on this thread)\n";
+#endif
+    if (timed) {
+        const double t = static_cast<double>(timed);
+        std::cout << "guest ms     build " << gBuild / t << "  exec " << gExec / t
+                  << "  publish " << gPublish / t << "  (timer res " << gRes << " ms)\n";
+    }
+}
+
+// --record / --replay: one JSON object per line for every command sent,
+//   {"at":<epoch ms>,"total_ms":..,"write_ms":..,"claim_ms":..,"rc":0,"out":<bytes>,
+//    "guest_claim_ms":..,"guest_build_ms":..,"guest_exec_ms":..,"guest_publish_ms":..,
+//    "guest_out":..,"guest_packed":..,"cmd":"..."}
+// "rc" is null when the guest gave none; "error" replaces the reply fields
+// when the round trip failed. "cmd" always comes last.
+static std::string jsonString(const std::string& s) {
+    std::string j = "\"";
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            j += '\\';
+            j += static_cast<char>(c);
+        } else if (c == '\n') {
+            j += "\\n";
+        } else if (c == '\r') {
+            j += "\\r";
+        } else if (c == '\t') {
+            j += "\\t";
+        } else if (c < 0x20) {
+            char u[8];
+            std::snprintf(u, sizeof(u), "\\u%04x", c);
+            j += u;
+        } else {
+            j += static_cast<char>(c);
+        }
+    }
+    return j + "\"";
+}
+
+class TraceRecorder {
+public:
+    explicit TraceRecorder(const fs::path& p) : out_(p, std::ios::binary | std::ios::app), path_(p) {
+        if (!out_) throw std::runtime_error("Failed to write: " + p.string());
+    }
 
+    Reply send(const SendFn& send, const std::string& command, const OutputSink& sink) {
+        using ms = std::chrono::duration<double, std::milli>;
+        const double at = ms(std::chrono::system_clock::now().time_since_epoch()).count();
+        std::ostringstream line;
+        line << std::fixed << std::setprecision(3) << "{\"at\":" << at;
+        try {
+            Reply r = send(command, sink);
+            line << ",\"total_ms\":" << ms(r.host.total).count() << ",\"write_ms\":" << ms(r.host.write).count()
+                 << ",\"claim_ms\":" << ms(r.host.claim).count()
+                 << ",\"rc\":" << (r.rc ? std::to_string(*r.rc) : std::string("null"))
+                 << ",\"out\":" << (r.guest ? static_cast<size_t>(r.guest->out) : r.out.size());
+            if (r.guest) {
+                line << ",\"guest_claim_ms\":" << r.guest->claim_ms << ",\"guest_build_ms\":" << r.guest->build_ms
+                     << ",\"guest_exec_ms\":" << r.guest->exec_ms << ",\"guest_publish_ms\":" << r.guest->publish_ms
+                     << ",\"guest_out\":" << r.guest->out << ",\"guest_packed\":" << r.guest->packed;
+            }
+            write(line, command);
             return r;
+        } catch (const std::exception& e) {
+            line << ",\"error\":" << jsonString(e.what());
+            write(line, command);
+            throw;
         }
+    }
+
+private:
+    void write(std::ostringstream& line, const std::string& command) {
+        line << ",\"cmd\":" << jsonString(command) << "}\n";
+        out_ << line.str() << std::flush; // a session that dies keeps what it did
+        if (!out_) throw std::runtime_error("Failed while writing: " + path_.string());
+    }
+
+    std::ofstream out_;
+    fs::path path_;
+};
 
-        if (std::chrono::steady_clock::now() - start > timeout) {
-            throw std::runtime_error("Timeout waiting for OUT.TXT. Is MBXSRV running in the shared folder?");
+struct TraceEntry {
+    double at = 0, total_ms = 0;
+    std::optional<int> rc;
+    size_t out = 0;
+    bool error = false;
+    std::string command;
+};
+
+// Reads back what TraceRecorder writes; not a general JSON parser.
+static std::optional<double> traceNumber(const std::string& line, const char* key) {
+    const std::string k = std::string("\"") + key + "\":";
+    const size_t at = line.find(k);
+    if (at == std::string::npos) return std::nullopt;
+    const char* p = line.c_str() + at + k.size();
+    char* end = nullptr;
+    const double v = std::strtod(p, &end);
+    if (end == p) return std::nullopt;
+    return v;
+}
+
+static std::vector<TraceEntry> loadTrace(const fs::path& p) {
+    std::vector<TraceEntry> trace;
+    std::istringstream lines(readFileText(p));
+    std::string line;
+    while (std::getline(lines, line)) {
+        const size_t cmd = line.rfind(",\"cmd\":\"");
+        const auto at = traceNumber(line, "at");
+        if (cmd == std::string::npos || !at) continue;
+        TraceEntry e;
+        e.at = *at;
+        e.total_ms = traceNumber(line, "total_ms").value_or(0);
+        if (auto rc = traceNumber(line, "rc")) e.rc = static_cast<int>(*rc);
+        e.out = static_cast<size_t>(traceNumber(line, "out").value_or(0));
+        e.error = line.find(",\"error\":") != std::string::npos;
+        for (size_t i = cmd + 8; i < line.size() && line[i] != '"'; i++) {
+            char c = line[i];
+            if (c == '\\' && i + 1 < line.size()) {
+                c = line[++i];
+                if (c == 'n') c = '\n';
+                else if (c == 'r') c = '\r';
+                else if (c == 't') c = '\t';
+                else if (c == 'u' && i + 4 < line.size()) {
+                    c = static_cast<char>(std::stoi(line.substr(i + 1, 4), nullptr, 16));
+                    i += 4;
+                }
+            }
+            e.command += c;
+        }
+        trace.push_back(std::move(e));
+    }
+    return trace;
+}
+
+// Send a recorded session again, keeping its gaps between commands (divided
+// by `speed`, and at most `maxGap` each), and compare the replies.
+static void runReplay(const SendFn& send, const std::string& transport, const fs::path& file, double speed,
+                      std::chrono::milliseconds maxGap) {
+    using ms = std::chrono::duration<double, std::milli>;
+    const auto trace = loadTrace(file);
+    if (trace.empty()) throw std::runtime_error("No commands in trace: " + file.string());
+
+    std::vector<std::chrono::nanoseconds> was, now;
+    size_t rcDiff = 0, outDiff = 0, failed = 0;
+    auto due = std::chrono::steady_clock::now();
+    const auto t0 = due;
+    std::cout << std::fixed << std::setprecision(2);
+    for (size_t i = 0; i < trace.size(); i++) {
+        const auto& e = trace[i];
+        if (i) {
+            const auto gap = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                ms(std::max(0.0, e.at - (trace[i - 1].at + trace[i - 1].total_ms)) / speed));
+            // The replayed reply may come later than the recorded one; then the gap starts from it.
+            due = std::max(due, std::chrono::steady_clock::now()) +
+                  std::min<std::chrono::nanoseconds>(gap, maxGap);
+            std::this_thread::sleep_until(due);
         }
 
-        std::this_thread::sleep_for(poll);
+        std::string note;
+        Reply r;
+        bool ok = true;
+        try {
+            r = send(e.command, nullptr);
+        } catch (const std::exception& ex) {
+            ok = false;
+            note = std::string("  error: ") + ex.what();
+        }
+        due = std::chrono::steady_clock::now();
+
+        const size_t out = r.guest ? static_cast<size_t>(r.guest->out) : r.out.size();
+        if (!ok) failed++;
+        if (ok && !e.error) {
+            was.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(ms(e.total_ms)));
+            now.push_back(r.host.total);
+            if (r.rc != e.rc) {
+                rcDiff++;
+                note += "  rc differs";
+            }
+            if (out != e.out) {
+                outDiff++;
+                note += "  output size differs";
+            }
+        }
+        std::string shown = e.command.substr(0, e.command.find_first_of("\r\n"));
+        if (shown.size() > 40) shown = shown.substr(0, 37) + "...";
+        std::cout << "[REPLAY] " << i + 1 << " " << shown << ": rc "
+                  << (e.rc ? std::to_string(*e.rc) : std::string("?")) << " -> "
+                  << (r.rc ? std::to_string(*r.rc) : std::string("?")) << ", out " << e.out << " -> " << out
+                  << " bytes, " << e.total_ms << " -> " << ms(r.host.total).count() << " ms" << note << "\n";
     }
+    const double wall = ms(std::chrono::steady_clock::now() - t0).count();
+    const double span = trace.back().at + trace.back().total_ms - trace.front().at;
+
+    const auto a = summarizeLatency(was), b = summarizeLatency(now);
+    auto delta = [](std::chrono::nanoseconds x, std::chrono::nanoseconds y) {
+        std::ostringstream os;
+        os << std::fixed << std::setprecision(2) << ms(x).count() << " -> " << ms(y).count();
+        if (x.count() > 0) {
+            os << std::showpos << std::setprecision(0) << " ("
+               << 100.0 * (static_cast<double>(y.count()) / static_cast<double>(x.count()) - 1) << "%)";
+        }
+        return os.str();
+    };
+    std::cout << "transport    " << transport << "\n"
+              << "commands     " << trace.size() << " replayed in " << wall << " ms (recorded span " << span
+              << " ms, speed " << speed << "x)\n"
+              << "latency ms   p50 " << delta(a.p50, b.p50) << "  p95 " << delta(a.p95, b.p95) << "  max "
+              << delta(a.max, b.max) << "\n"
+              << "differences  " << rcDiff << " rc, " << outDiff << " output size, " << failed << " failed\n";
 }
 
 static void usage() {
@@ -170,6 +784,77 @@ static void usage() {
         "Usage:\n"
         "  mbxhost <shared_folder_path>            # REPL mode\n"
         "  mbxhost <shared_folder_path> --cmd \"dir\" [--timeout ms]\n"
+        "  mbxhost <shared_folder_path> --queue [--depth n] < commands.txt\n"
+        "  mbxhost <shared_folder_path> --batch commands.txt [--timeout ms]\n"
+        "  mbxhost <shared_folder_path> --guest <dir2> [--guest <dir3> ...] --pool < commands.txt\n"
+        "  mbxhost <shared_folder_path> --bench [--workload w] [--count n] [--warmup n] [--mock]\n"
+        "  mbxhost <shared_folder_path> --replay trace.jsonl [--mock] [--speed x] [--max-gap ms]\n"
+        "  mbxhost <shared_folder_path> --put <local_file> <guest_path> [--chunk KB]\n"
+        "  mbxhost <shared_folder_path> --get <guest_path> <local_file> [--chunk KB]\n"
+        "  mbxhost <shared_folder_path> --sync <local_dir> <subdir> [--threads n] [--dry-run]\n"
+        "  mbxhost <shared_folder_path> --mock-guest\n"
+        "  mbxhost <shared_folder_path> --template <name> <file.bat> [--cmd \"RUN <name> args\"]\n"
+        "  mbxhost <shared_folder_path> --cancel [tag]\n"
+        "  mbxhost <shared_folder_path> [--guest <dir2> ...] --provision [--init init.bat] [--autoexec line ...]\n"
+        "\n"
+        "Options:\n"
+        "  --no-watch      poll OUT.TXT/RC.TXT instead of using file-change notifications\n"
+        "  --queue         pipeline one command per stdin line through CMD.nnn jobs\n"
+        "  --depth n       max queued jobs in flight (default 8, max 99)\n"
+        "  --batch file    run every line of file as one job; --timeout covers the whole batch\n"
+        "  --stream        print output while the job runs; --timeout then means time without output\n"
+        "  --pack          ask MBXSRV to compress large outputs (one-shot, REPL, bench); with --stream\n"
+        "                  the output then prints when the job ends\n"
+        "  --res           ask for one combined RES.TXT reply (RC, timings and output) per job\n"
+        "                  instead of OUT.TXT + RC.TXT\n"
+        "  --job-timeout s have MBXSRV stop any job that runs longer than s seconds (RC 124)\n"
+        "  --cancel [tag]  stop the guest's running job (the one tagged tag, default any: RC 130)\n"
+        "  --serial addr   try MBXSRV's serial link first (host:port of a DOSBox-X nullmodem\n"
+        "                  port, or MBX_SERIAL); falls back to the file mailbox\n"
+        "  --put/--get     copy a binary file to/from the guest in CRC-checked chunks; resumes\n"
+        "                  after interruption and skips files that already match\n"
+        "  --sync l s      two-way sync of host directory l with subdir s of the shared folder; only\n"
+        "                  changed files are copied, long names get 8.3 names (kept in s\\MBXSYNC.MAN)\n"
+        "  --threads n     --sync I/O threads (default: up to 8 by core count)\n"
+        "  --dry-run       with --sync: report what would be copied or deleted, change nothing\n"
+        "  --chunk KB      transfer chunk size (default 1024); --timeout is per round trip (default 60000)\n"
+        "  --template n f  store f as template n in the shared folder (repeatable); run it later\n"
+        "                  as \"RUN n arg1 ... arg8\" without a job file being built\n"
+        "  --cache dir     reuse replies of repeated one-shot/REPL commands from an on-disk cache\n"
+        "  --input path    with --cache: shared-folder file or directory the command reads (repeatable)\n"
+        "  --cache-max MB  cache size limit, least recently used entries go first (default 64)\n"
+        "  --include re    print only output lines matching regex re (repeatable); lines are\n"
+        "                  filtered as they are read, so only kept lines are held in memory\n"
+        "  --exclude re    drop output lines matching re (repeatable)\n"
+        "  --ignore-case   match --include/--exclude without regard to case\n"
+        "  --errors        keep error, warning and failure lines (like an --include)\n"
+        "  --max-lines n   keep at most n output lines, the first and last n/2 (see --keep)\n"
+        "  --max-kb KB     keep at most KB of output the same way\n"
+        "  --keep end      which end of the output survives the limits: head, tail or both\n"
+        "  --stats         print host and guest phase timings to stderr after each reply\n"
+        "  --guest dir     add another guest's shared folder to the pool (repeatable)\n"
+        "  --pool          run stdin lines across all guests; replies print in input order. Lines\n"
+        "                  starting \"@interactive \" go out first, \"@bulk \" last (default normal)\n"
+        "  --reserve n     with --pool: keep the first n guests for @interactive lines\n"
+        "  --bench         measure round trips; workloads: rem, echo:KB, dir[:path], script:lines, cmd:text\n"
+        "  --record file   append every command sent to the guest (REPL, one-shot, bench) to file as\n"
+        "                  JSON lines: submit time, round trip, rc, output size, guest phase timings\n"
+        "  --replay file   send a recorded session again with the same gaps between commands (also\n"
+        "                  to the --mock guest) and report how rc, output size and latency differ\n"
+        "  --speed x       with --replay: shrink the gaps x times (default 1)\n"
+        "  --max-gap ms    with --replay: wait at most ms between commands (default 10000)\n"
+        "  --provision     start DOSBox-X on every shared folder (generated MBXBOOT.CONF), wait for\n"
+        "                  READY and report time-to-ready; other modes then run on the new guests\n"
+        "  --dosbox path   DOSBox-X executable (default MBX_DOSBOX, or dosbox-x in PATH)\n"
+        "  --dosbox-arg a  extra DOSBox-X argument (repeatable)\n"
+        "  --dosbox-conf l config line for MBXBOOT.CONF, e.g. \"[cpu]\" then \"cycles=max\" (repeatable)\n"
+        "  --autoexec line run before MBXSRV at boot: drivers, PATH, SET (repeatable)\n"
+        "  --init file     run file once the guest is READY, kept as template INIT\n"
+        "  --mbxsrv file   copy this MBXSRV.EXE into each folder first\n"
+        "  --metrics-file f keep f up to date with Prometheus-format counters and latency histograms\n"
+        "  --metrics-port p serve the same on http://127.0.0.1:p/metrics (or host:port)\n"
+        "  --mock          with --bench or --replay, serve the folder with the built-in mock guest\n"
+        "  --mock-guest    serve the folder with the mock guest until EXIT (no DOSBox-X needed)\n"
         "\n"
         "Examples:\n"
         "  mbxhost ./shared\n"
@@ -192,7 +877,43 @@ int main(int argc, char** argv) {
         auto m = pathsFromDir(dir);
 
         std::optional<std::string> oneShotCmd;
+        std::optional<fs::path> batchFile;
         std::chrono::milliseconds timeout(5000);
+        bool timeoutSet = false;
+        std::optional<std::pair<std::string, std::string>> putArgs, getArgs, syncArgs;
+        SyncOptions syncOpts;
+        size_t chunkKB = 1024;
+        std::vector<std::pair<std::string, fs::path>> templates;
+        std::optional<fs::path> cacheDir;
+        std::vector<std::string> cacheInputs;
+        std::uintmax_t cacheMaxMB = 64;
+        bool useWatch = true;
+        bool queueMode = false;
+        bool stream = false;
+        bool pack = false;
+        bool combined = false;
+        std::chrono::seconds jobTimeout(0);
+        std::optional<std::string> cancelTag;
+        bool poolMode = false;
+        bool stats = false;
+        std::optional<std::string> serialAddr;
+        if (const char* env = std::getenv("MBX_SERIAL")) {
+            if (*env) serialAddr = env;
+        }
+        bool bench = false, mock = false, mockGuest = false;
+        std::string workload = "rem";
+        int benchCount = 100, benchWarmup = 5;
+        std::vector<MailboxPaths> guests{m};
+        int depth = 8;
+        size_t reserve = 0;
+        bool provision = false, dosboxSet = false;
+        std::optional<fs::path> metricsFile;
+        std::optional<std::string> metricsAddr;
+        std::optional<fs::path> recordFile, replayFile;
+        FilterOptions filter;
+        double replaySpeed = 1.0;
+        std::chrono::milliseconds maxGap(10000);
+        ProvisionOptions prov;
 
         for (int i = 2; i < argc; i++) {
             std::string a = argv[i];
@@ -200,6 +921,132 @@ int main(int argc, char** argv) {
                 oneShotCmd = argv[++i];
             } else if (a == "--timeout" && i + 1 < argc) {
                 timeout = std::chrono::milliseconds(std::stoi(argv[++i]));
+                timeoutSet = true;
+            } else if (a == "--put" && i + 2 < argc) {
+                putArgs.emplace(argv[i + 1], argv[i + 2]);
+                i += 2;
+            } else if (a == "--get" && i + 2 < argc) {
+                getArgs.emplace(argv[i + 1], argv[i + 2]);
+                i += 2;
+            } else if (a == "--sync" && i + 2 < argc) {
+                syncArgs.emplace(argv[i + 1], argv[i + 2]);
+                i += 2;
+            } else if (a == "--threads" && i + 1 < argc) {
+                syncOpts.threads = static_cast<unsigned>(std::max(1, std::stoi(argv[++i])));
+            } else if (a == "--dry-run") {
+                syncOpts.dry_run = true;
+            } else if (a == "--template" && i + 2 < argc) {
+                templates.emplace_back(argv[i + 1], argv[i + 2]);
+                i += 2;
+            } else if (a == "--cache" && i + 1 < argc) {
+                cacheDir = fs::path(argv[++i]);
+            } else if (a == "--input" && i + 1 < argc) {
+                cacheInputs.push_back(argv[++i]);
+            } else if (a == "--cache-max" && i + 1 < argc) {
+                cacheMaxMB = static_cast<std::uintmax_t>(std::max(1, std::stoi(argv[++i])));
+            } else if (a == "--chunk" && i + 1 < argc) {
+                chunkKB = static_cast<size_t>(std::max(1, std::stoi(argv[++i])));
+            } else if (a == "--batch" && i + 1 < argc) {
+                batchFile = fs::path(argv[++i]);
+            } else if (a == "--guest" && i + 1 < argc) {
+                fs::path g = fs::path(argv[++i]);
+                if (!fs::exists(g)) {
+                    std::cerr << "Shared folder does not exist: " << g.string() << "\n";
+                    return 2;
+                }
+                guests.push_back(pathsFromDir(g));
+            } else if (a == "--bench") {
+                bench = true;
+            } else if (a == "--workload" && i + 1 < argc) {
+                workload = argv[++i];
+            } else if (a == "--count" && i + 1 < argc) {
+                benchCount = std::max(1, std::stoi(argv[++i]));
+            } else if (a == "--warmup" && i + 1 < argc) {
+                benchWarmup = std::max(0, std::stoi(argv[++i]));
+            } else if (a == "--mock") {
+                mock = true;
+            } else if (a == "--mock-guest") {
+                mockGuest = true;
+            } else if (a == "--pool") {
+                poolMode = true;
+            } else if (a == "--metrics-file" && i + 1 < argc) {
+                metricsFile = fs::path(argv[++i]);
+            } else if (a == "--metrics-port" && i + 1 < argc) {
+                metricsAddr = argv[++i];
+            } else if (a == "--include" && i + 1 < argc) {
+                filter.include.push_back(argv[++i]);
+            } else if (a == "--exclude" && i + 1 < argc) {
+                filter.exclude.push_back(argv[++i]);
+            } else if (a == "--ignore-case") {
+                filter.icase = true;
+            } else if (a == "--errors") {
+                filter.errors = true;
+            } else if (a == "--max-lines" && i + 1 < argc) {
+                filter.max_lines = static_cast<size_t>(std::max(0, std::stoi(argv[++i])));
+            } else if (a == "--max-kb" && i + 1 < argc) {
+                filter.max_bytes = static_cast<std::uintmax_t>(std::max(0, std::stoi(argv[++i]))) * 1024;
+            } else if (a == "--keep" && i + 1 < argc) {
+                const std::string k = argv[++i];
+                if (k == "head") filter.keep = FilterOptions::Keep::Head;
+                else if (k == "tail") filter.keep = FilterOptions::Keep::Tail;
+                else if (k == "both") filter.keep = FilterOptions::Keep::Both;
+                else {
+                    std::cerr << "--keep must be head, tail or both\n";
+                    return 2;
+                }
+            } else if (a == "--record" && i + 1 < argc) {
+                recordFile = fs::path(argv[++i]);
+            } else if (a == "--replay" && i + 1 < argc) {
+                replayFile = fs::path(argv[++i]);
+            } else if (a == "--speed" && i + 1 < argc) {
+                replaySpeed = std::stod(argv[++i]);
+                if (!(replaySpeed > 0)) {
+                    std::cerr << "--speed must be > 0\n";
+                    return 2;
+                }
+            } else if (a == "--max-gap" && i + 1 < argc) {
+                maxGap = std::chrono::milliseconds(std::max(0, std::stoi(argv[++i])));
+            } else if (a == "--provision") {
+                provision = true;
+            } else if (a == "--dosbox" && i + 1 < argc) {
+                prov.dosbox = argv[++i];
+                dosboxSet = true;
+            } else if (a == "--dosbox-arg" && i + 1 < argc) {
+                prov.args.push_back(argv[++i]);
+            } else if (a == "--dosbox-conf" && i + 1 < argc) {
+                prov.config.push_back(argv[++i]);
+            } else if (a == "--autoexec" && i + 1 < argc) {
+                prov.autoexec.push_back(argv[++i]);
+            } else if (a == "--init" && i + 1 < argc) {
+                prov.init = readFileText(argv[++i]);
+            } else if (a == "--mbxsrv" && i + 1 < argc) {
+                prov.mbxsrv = fs::path(argv[++i]);
+            } else if (a == "--reserve" && i + 1 < argc) {
+                reserve = static_cast<size_t>(std::max(0, std::stoi(argv[++i])));
+            } else if (a == "--serial" && i + 1 < argc) {
+                serialAddr = argv[++i];
+            } else if (a == "--stats") {
+                stats = true;
+            } else if (a == "--stream") {
+                stream = true;
+            } else if (a == "--pack") {
+                pack = true;
+            } else if (a == "--res") {
+                combined = true;
+            } else if (a == "--job-timeout" && i + 1 < argc) {
+                jobTimeout = std::chrono::seconds(std::max(0, std::stoi(argv[++i])));
+            } else if (a == "--cancel") {
+                cancelTag = (i + 1 < argc && argv[i + 1][0] != '-') ? argv[++i] : "*";
+            } else if (a == "--queue") {
+                queueMode = true;
+            } else if (a == "--depth" && i + 1 < argc) {
+                depth = std::stoi(argv[++i]);
+                if (depth < 1 || depth > kQueueDepthMax) {
+                    std::cerr << "--depth must be 1.." << kQueueDepthMax << "\n";
+                    return 2;
+                }
+            } else if (a == "--no-watch") {
+                useWatch = false;
             } else if (a == "--help" || a == "-h") {
                 usage();
                 return 0;
@@ -209,17 +1056,350 @@ int main(int argc, char** argv) {
                 return 2;
             }
         }
+        MetricsExport exporter(metricsFile, metricsAddr);
+
+        m.combined = combined;
+        m.job_timeout = jobTimeout;
+        // Outwait the guest's own deadline, so its RC 124 reply is what we report.
+        if (jobTimeout.count() > 0 && !timeoutSet) timeout = jobTimeout + std::chrono::seconds(5);
+        for (auto& g : guests) {
+            g.combined = combined;
+            g.job_timeout = jobTimeout;
+        }
+
+        if (cancelTag) {
+            cancelJob(m, *cancelTag);
+            // A tag may name a job still queued, which checks for it when it starts;
+            // "*" is only for running jobs, so one nobody takes is cleared again.
+            if (*cancelTag != "*") {
+                std::cerr << "mbxhost: asked the guest to cancel " << *cancelTag << "\n";
+            } else if (awaitCancel(m)) {
+                std::cerr << "mbxhost: the guest is cancelling its running job\n";
+            } else {
+                std::cerr << "mbxhost: no running job took the cancel; CANCEL.TXT removed\n";
+                return 1;
+            }
+            return 0;
+        }
+
+        // Templates are plain files in the shared folder; later commands run
+        // them as "RUN <name> args".
+        for (const auto& [name, file] : templates) {
+            registerTemplate(m, name, readFileText(file));
+            std::cerr << "mbxhost: template " << name << " registered from " << file.string() << "\n";
+        }
+
+        // Start DOSBox-X on every folder and wait until each can take jobs.
+        if (provision) {
+            if (const char* env = std::getenv("MBX_DOSBOX"); env && *env && !dosboxSet) prov.dosbox = env;
+            if (timeoutSet) prov.timeout = timeout;
+            const auto t0 = std::chrono::steady_clock::now();
+            const auto results = provisionGuests(guests, prov);
+            using msd = std::chrono::duration<double, std::milli>;
+            for (size_t g = 0; g < guests.size(); g++) {
+                const auto& r = results[g];
+                std::cerr << std::fixed << std::setprecision(0) << "[PROVISION] " << guests[g].dir.string()
+                          << ": pid " << r.pid << ", launch " << msd(r.launch).count() << " ms, ready "
+                          << msd(r.ready).count() << " ms";
+                if (!prov.init.empty()) {
+                    std::cerr << ", init " << msd(r.init).count() << " ms (rc "
+                              << (r.init_rc ? std::to_string(*r.init_rc) : std::string("?")) << ")";
+                }
+                std::cerr << "\n";
+            }
+            std::cerr << "[PROVISION] " << guests.size() << " guests ready in "
+                      << msd(std::chrono::steady_clock::now() - t0).count() << " ms\n";
+        }
+
+        // Sync is host-side file work; the guest needn't be running.
+        if (syncArgs) {
+            const auto t0 = std::chrono::steady_clock::now();
+            const auto r = syncTree(syncArgs->first, dir / syncArgs->second, syncOpts);
+            const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - t0).count();
+            std::cout << "SYNC " << syncArgs->first << " <-> " << syncArgs->second
+                      << (syncOpts.dry_run ? " (dry run)" : "") << ": " << r.scanned << " files, " << r.pushed
+                      << " pushed, " << r.pulled << " pulled, " << r.deleted_local << " deleted on the host, "
+                      << r.deleted_shared << " deleted in the shared folder, " << r.conflicts << " conflicts, "
+                      << r.unchanged << " unchanged, " << r.bytes << " bytes, " << ms << " ms\n";
+            return 0;
+        }
+
+        // Registering or provisioning on its own is a complete run, not a REPL session.
+        if ((!templates.empty() || provision) && !oneShotCmd && !batchFile && !bench && !queueMode && !poolMode &&
+            !mockGuest && !putArgs && !getArgs) {
+            return 0;
+        }
+
+        std::optional<DirWatcher> watch;
+        if (useWatch) watch.emplace(dir);
+        DirWatcher* w = watch ? &*watch : nullptr;
+        const std::chrono::milliseconds poll(50);
+
+        OutputSink toStdout;
+        if (stream) {
+            toStdout = [](const char* data, size_t len) {
+                std::cout.write(data, static_cast<std::streamsize>(len));
+                std::cout.flush();
+            };
+        }
+
+        // One-shot, REPL and bench use the serial link when MBXSRV answers on it.
+        std::optional<SerialLink> link;
+        if (serialAddr && !mockGuest && !mock) {
+            try {
+                link.emplace(*serialAddr, std::chrono::milliseconds(1000));
+            } catch (const std::exception& e) {
+                std::cerr << "mbxhost: serial link unavailable (" << e.what() << "); using the file mailbox\n";
+            }
+        }
+        const SendFn guestSend = [&](const std::string& command, const OutputSink& sink) {
+            if (link) {
+                std::string job;
+                appendJobDirectives(job, m);
+                return link->send(job.append(command), timeout, sink, pack);
+            }
+            return sendCommandAndWait(m, command, timeout, poll, w, sink, pack);
+        };
+        const std::string transport = link ? "serial " + link->address() : "file mailbox";
+
+        // --record logs every command that reaches the guest, whichever mode sent it.
+        std::optional<TraceRecorder> recorder;
+        if (recordFile) recorder.emplace(*recordFile);
+        const SendFn send = [&](const std::string& command, const OutputSink& sink) {
+            return recorder ? recorder->send(guestSend, command, sink) : guestSend(command, sink);
+        };
+
+        // One-shot and REPL commands go through the result cache when enabled.
+        std::optional<ResultCache> cache;
+        if (cacheDir) cache.emplace(*cacheDir, cacheMaxMB * 1024 * 1024);
+        const SendFn cachedSend = [&](const std::string& command, const OutputSink& sink) {
+            if (!cache || !ResultCache::cacheable(command)) return send(command, sink);
+            const std::string key = cache->key(m, command, cacheInputs);
+            if (auto hit = cache->lookup(key)) {
+                if (sink) {
+                    sink(hit->out.data(), hit->out.size());
+                    hit->out.clear();
+                }
+                return *hit;
+            }
+            if (!sink) {
+                Reply r = send(command, nullptr);
+                if (r.rc) cache->store(key, r);
+                return r;
+            }
+            // Streamed or filtered: keep the whole output for the entry while
+            // passing it on, so the cache stores what the guest sent.
+            std::string whole;
+            Reply r = send(command, [&](const char* data, size_t len) {
+                whole.append(data, len);
+                sink(data, len);
+            });
+            if (r.rc) {
+                Reply entry = r;
+                entry.out = std::move(whole);
+                cache->store(key, entry);
+            }
+            return r;
+        };
+        // --include/--exclude/--errors/limits. Sends run the filter over output
+        // as it arrives; modes that collect replies whole filter them after.
+        auto printFilter = [&](const OutputFilter& f) {
+            if (!stats) return;
+            std::cerr << "[FILTER] " << f.lines() << " lines (" << f.bytes() << " bytes) in, " << f.kept()
+                      << " kept, " << f.omitted() << " cut by the limit\n";
+        };
+        const auto filteredSend = [&](const std::string& command) {
+            if (!filter.active()) return cachedSend(command, toStdout);
+            OutputFilter f(filter, toStdout);
+            Reply r = cachedSend(command, f.sink());
+            r.out = f.finish();
+            printFilter(f);
+            return r;
+        };
+        auto filterReply = [&](Reply& r) {
+            if (!filter.active()) return;
+            OutputFilter f(filter);
+            f.feed(r.out.data(), r.out.size());
+            r.out = f.finish();
+            printFilter(f);
+        };
+        if (filter.active()) OutputFilter check(filter); // report a bad pattern before anything runs
+
+        auto printCache = [&] {
+            if (!cache) return;
+            std::cerr << "[CACHE] " << cache->hits() << " hits, " << cache->misses() << " misses, "
+                      << cache->entries() << " entries, " << cache->bytes() / 1024 << " KB\n";
+        };
+
+        if (putArgs || getArgs) {
+            TransferOptions xo;
+            xo.chunk = chunkKB * 1024;
+            if (timeoutSet) xo.timeout = timeout;
+            xo.poll = poll;
+            xo.watch = w;
+
+            const auto t0 = std::chrono::steady_clock::now();
+            const auto res = putArgs ? putFile(m, putArgs->first, putArgs->second, xo)
+                                     : getFile(m, getArgs->first, getArgs->second, xo);
+            const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - t0).count();
+            std::cout << (putArgs ? "PUT " + putArgs->first + " -> " + putArgs->second
+                                  : "GET " + getArgs->first + " -> " + getArgs->second) << ": ";
+            if (res.skipped) {
+                std::cout << "unchanged (" << res.size << " bytes), skipped\n";
+            } else {
+                std::cout << res.size << " bytes, " << res.moved << " sent in " << res.chunks << " chunks, "
+                          << res.retries << " retries, " << ms << " ms\n";
+            }
+            return 0;
+        }
 
         if (oneShotCmd) {
-            auto r = sendCommandAndWait(m, *oneShotCmd, timeout);
+            // Plain file-mailbox round trips hand OUT.TXT straight to stdout,
+            // and leave it in the folder for scripts that read it afterwards.
+            if (!link && !cache && !stream && !pack && !combined && !recorder) {
+                auto r = sendCommandMapped(m, *oneShotCmd, timeout, poll, w, true);
+                if (filter.active()) {
+                    OutputFilter f(filter);
+                    f.feed(r.out.data(), r.out.size()); // straight from the mapping
+                    std::cout << f.finish();
+                    printFilter(f);
+                } else {
+                    r.out.writeToStdout();
+                }
+                if (r.rc) std::cout << "\n[RC] " << *r.rc << "\n";
+                if (stats) printStats(std::cerr, Reply{std::string(), r.rc, r.host, r.guest});
+                return r.rc.value_or(1);
+            }
+            auto r = filteredSend(*oneShotCmd);
             std::cout << r.out;
             if (r.rc) std::cout << "\n[RC] " << *r.rc << "\n";
-            return r.rc.value_or(0);
+            if (stats) printStats(std::cerr, r);
+            printCache();
+            return r.rc.value_or(1);
+        }
+
+        if (mockGuest) {
+            std::atomic<bool> stop{false};
+            MockGuest(dir).serve(stop);
+            return 0;
+        }
+
+        if (bench || replayFile) {
+            std::atomic<bool> stop{false};
+            std::thread guest;
+            std::optional<MockGuest> mocked;
+            if (mock) {
+                mocked.emplace(dir);
+                guest = std::thread([&] { mocked->serve(stop); });
+            }
+            try {
+                if (replayFile) runReplay(send, transport, *replayFile, replaySpeed, maxGap);
+                else runBench(send, transport, workload, benchCount, benchWarmup);
+            } catch (...) {
+                stop = true;
+                if (guest.joinable()) guest.join();
+                throw;
+            }
+            stop = true;
+            if (guest.joinable()) guest.join();
+            return 0;
+        }
+
+        if (batchFile) {
+            std::vector<std::string> commands;
+            std::istringstream lines(readFileText(*batchFile));
+            std::string line;
+            while (std::getline(lines, line)) {
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                if (!line.empty()) commands.push_back(line);
+            }
+
+            int status = 0;
+            for (auto& r : submitBatch(m, commands, timeout, poll, w)) {
+                filterReply(r);
+                std::cout << r.out;
+                if (r.rc) std::cout << "[RC] " << *r.rc << "\n";
+                else std::cout << "[RC] ?\n";
+                if (status == 0 && r.rc.value_or(1) != 0) status = r.rc.value_or(1);
+            }
+            return status;
+        }
+
+        if (poolMode) {
+            // "@interactive cmd", "@normal cmd" or "@bulk cmd"; unmarked lines are normal.
+            std::vector<PoolJob> commands;
+            std::string line;
+            while (std::getline(std::cin, line)) {
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                if (line.empty()) continue;
+                PoolJob job{line, Priority::Normal};
+                const size_t sp = line.find(' ');
+                if (line[0] == '@' && sp != std::string::npos) {
+                    if (auto prio = parsePriority(std::string_view(line).substr(1, sp - 1))) {
+                        job.prio = *prio;
+                        job.command = line.substr(sp + 1);
+                    }
+                }
+                commands.push_back(std::move(job));
+            }
+
+            if (reserve >= guests.size()) {
+                std::cerr << "--reserve must leave at least one guest for other jobs\n";
+                return 2;
+            }
+            GuestPool pool(guests, timeout, poll, useWatch, reserve);
+            int status = 0;
+            pool.run(commands, [&](size_t, const Reply& r) {
+                if (filter.active()) {
+                    Reply kept = r;
+                    filterReply(kept);
+                    std::cout << kept.out;
+                } else {
+                    std::cout << r.out;
+                }
+                if (r.rc) std::cout << "[RC] " << *r.rc << "\n";
+                else std::cout << "[RC] ?\n";
+                std::cout << std::flush;
+                if (stats) printStats(std::cerr, r);
+                if (status == 0 && r.rc.value_or(1) != 0) status = r.rc.value_or(1);
+            });
+            pool.printUtilization(std::cerr);
+            return status;
+        }
+
+        if (queueMode) {
+            // Keep up to `depth` jobs queued; replies print in submission order.
+            CommandQueue q(m, w);
+            std::deque<int> inflight;
+            int status = 0;
+            auto collect = [&]() {
+                auto r = q.wait(inflight.front(), timeout, poll);
+                inflight.pop_front();
+                filterReply(r);
+                std::cout << r.out;
+                if (r.rc) std::cout << "[RC] " << *r.rc << "\n";
+                if (stats) printStats(std::cerr, r);
+                if (status == 0 && r.rc.value_or(1) != 0) status = r.rc.value_or(1);
+            };
+
+            std::string line;
+            while (std::getline(std::cin, line)) {
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                if (line.empty()) continue;
+                if (static_cast<int>(inflight.size()) >= depth) collect();
+                inflight.push_back(q.submit(line));
+            }
+            while (!inflight.empty()) collect();
+            std::cout << std::flush;
+            return status;
         }
 
         // REPL mode
-        std::cout << "mbxhost REPL. Shared folder: " << dir.string() << "\n"
-                  << "Type DOS commands. Use 'exit' to quit. (Sends EXIT to guest with 'quit-guest')\n";
+        std::cout << "mbxhost REPL. Shared folder: " << dir.string() << " (" << transport << ")\n"
+                  << "Type DOS commands. Use 'exit' to quit. (Sends EXIT to guest with 'quit-guest')\n"
+                  << "With MBXSRV in session mode, 'reset-session' restores its startup directory and environment.\n";
 
         std::string line;
         while (true) {
@@ -231,18 +1411,23 @@ int main(int argc, char** argv) {
 
             // send EXIT to guest and quit
             if (line == "quit-guest") {
-                auto r = sendCommandAndWait(m, "EXIT", timeout);
+                auto r = send("EXIT", nullptr);
                 std::cout << r.out;
                 break;
             }
 
+            // drop the guest's session state (MBX_SESSION=1) back to startup
+            if (line == "reset-session") line = "RESET";
+
             if (line.empty()) continue;
 
-            auto r = sendCommandAndWait(m, line, timeout);
+            auto r = filteredSend(line);
             std::cout << r.out;
             if (r.rc) std::cout << "[RC] " << *r.rc << "\n";
+            if (stats) printStats(std::cerr, r);
         }
 
+        printCache();
         return 0;
     } catch (const std::exception& e) {
         std::cerr << "mbxhost error: " << e.what() << "\n";